@@ -25,8 +25,6 @@ typedef std::array<float,4> v4float;
 typedef std::array<uint32_t,4> v4uint;
 typedef std::array<int32_t,4> v4int;
 
-constexpr bool PRINT_TIMER_RESULTS = false;
-
 const uint32_t NO_LINE = 0xFFFFFFFF;
 const uint32_t NO_FILE = 0xFFFFFFFF;
 const uint32_t NO_COLUMN = 0xFFFFFFFF;
@@ -549,7 +547,17 @@ struct RiscVPhi;
 // Base class for individual instructions.
 struct Instruction {
     Instruction(const LineInfo& lineInfo)
-        : list(nullptr), lineInfo(lineInfo), needLiveness(false) {
+        : list(nullptr), lineInfo(lineInfo) {
+
+        // Nothing.
+    }
+    // Copies the operands and results, but not the position in a list
+    // or the liveness.
+    Instruction(const Instruction &other)
+        : list(nullptr), lineInfo(other.lineInfo),
+          resIdSet(other.resIdSet), resIdList(other.resIdList),
+          argIdSet(other.argIdSet), argIdList(other.argIdList),
+          targetLabelIds(other.targetLabelIds) {
 
         // Nothing.
     }
@@ -587,9 +595,6 @@ struct Instruction {
     // Registers that are live leaving this instruction.
     std::set<uint32_t> liveout;
 
-    // Whether we need to recompute liveness for this instruction.
-    bool needLiveness;
-
     // Step the interpreter forward one instruction.
     virtual void step(Interpreter *interpreter) = 0;
 
@@ -602,6 +607,9 @@ struct Instruction {
     // The name of this instruction (e.g., "OpFMul").
     virtual std::string name() const = 0;
 
+    // Make a copy of this instruction that's not in any list.
+    virtual std::shared_ptr<Instruction> clone() const = 0;
+
     // Whether this is a branch instruction (OpBranch, OpBranchConditional,
     // OpSwitch, OpReturn, or OpReturnValue).
     virtual bool isBranch() const { return false; }
@@ -658,6 +666,20 @@ struct Instruction {
         assert(foundCount > 0);
     }
 
+    // Change the result register. Asserts if the oldRegId isn't
+    // currently a result.
+    void changeResult(uint32_t oldRegId, uint32_t newRegId) {
+        assert(affectsRegister(oldRegId));
+        resIdSet.erase(oldRegId);
+        resIdSet.insert(newRegId);
+
+        for (auto itr = resIdList.begin(); itr != resIdList.end(); ++itr) {
+            if (*itr == oldRegId) {
+                *itr = newRegId;
+            }
+        }
+    }
+
     // Dump a rough disassembly to stdout.
     void dump(std::ostream &out) const;
 };
@@ -807,7 +829,7 @@ private:
 // The last instruction must be a variant of a branch.
 struct Block {
     Block(uint32_t blockId, Function *function)
-        : instructions(this), function(function), blockId(blockId), idom(NO_BLOCK_ID) {
+        : instructions(this), function(function), blockId(blockId), idom(NO_BLOCK_ID), loopDepth(0) {
         // Nothing.
     }
 
@@ -835,6 +857,9 @@ struct Block {
     // Children in idom tree.
     std::vector<std::shared_ptr<Block>> idomChildren;
 
+    // Number of loops this block is in.
+    int loopDepth;
+
     // Whether this block is dominated by the other block.
     bool isDominatedBy(uint32_t other) const {
         return dom.find(other) != dom.end();
@@ -847,6 +872,7 @@ struct CommandLineParameters
     int outputHeight;
     bool beVerbose;
     bool throwOnUnimplemented;
+    std::string textureCacheDirectory;  // Empty if not using the texture cache.
 };
 
 std::string readFileContents(std::string shaderFileName);
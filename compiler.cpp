@@ -1,35 +1,134 @@
 
+#include <algorithm>
 #include <iomanip>
 #include <sstream>
+#include <functional>
+#include <cmath>
+#include <sys/stat.h>
 
 #include "compiler.h"
 #include "risc-v.h"
 #include "pcopy.h"
 #include "function.h"
+#include "machine.h"
+#include "assembler.h"
+#include "linker.h"
+
+// Read the relocatable library object, or assemble the library source if
+// the object is missing or older than the source.
+static RelocatableObject loadLibraryObject(const std::string &objectPathname,
+        const std::string &sourcePathname) {
+
+    struct stat objectStat, sourceStat;
+    if (stat(objectPathname.c_str(), &objectStat) == 0 &&
+            stat(sourcePathname.c_str(), &sourceStat) == 0 &&
+            objectStat.st_mtime >= sourceStat.st_mtime) {
+
+        // Skip it quietly if it's an executable from an older "as".
+        std::ifstream file(objectPathname, std::ios::in | std::ios::binary);
+        uint32_t magic = 0;
+        file.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+        file.seekg(0);
+
+        RelocatableObject object;
+        if (file && magic == RunHeader3MagicExpected && ReadRelocatable(file, object)) {
+            return object;
+        }
+    }
 
-void Compiler::compile() {
-#if 0
-    // XXX disable this because the code is broken. This is done after liveness
-    // analysis, and the liveness info isn't copied to the new instructions.
-    // Maybe we can do this before liveness analysis, especially since this is
-    // likely to need new registers anyway.
+    Assembler assembler(true);
+    assembler.load(sourcePathname);
+    assembler.assemble();
+    return assembler.relocatableObject();
+}
 
-    // Transform SPIR-V instructions to RISC-V instructions.
+// Find the end of the library's small data, the data it accesses with
+// x0-relative offsets, and the undefined symbols it accesses that way.
+static void findLibrarySmallData(const RelocatableObject &library,
+        uint32_t &smallDataEnd, std::set<std::string> &externals) {
+
+    smallDataEnd = 0;
+    for (auto &relocation : library.relocations) {
+        if (isSmallDataRelocation(relocation.format, relocation.function)) {
+            auto &symbol = library.symbols[relocation.symbol];
+            if (symbol.undefined) {
+                externals.insert(symbol.name);
+            } else if (symbol.inDataSegment) {
+                for (auto &section : library.sections) {
+                    if (section.inDataSegment && section.address == symbol.address) {
+                        smallDataEnd = std::max(smallDataEnd, section.address + section.size);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void Compiler::compile() {
+    // Transform SPIR-V instructions to RISC-V instructions. This is done
+    // before liveness analysis so that constants folded into immediates
+    // don't take up registers.
+    Timer timer;
+    TimeReport &timeReport = pgm->timeReport;
     for (auto &[_, function] : pgm->functions) {
-        for (auto &[_, block] : function->blocks) {
-            transformInstructions(block->instructions);
+        // Estimate how often blocks run while loop exit tests are still
+        // recognizable.
+        std::map<uint32_t,double> executions = function->estimateBlockExecutions();
+        blockExecutions.insert(executions.begin(), executions.end());
+
+        timer.reset();
+        transformInstructions(function.get());
+        timeReport.add("transformInstructions", function->cleanName, timer.elapsed());
+    }
+
+    // The spiller and the allocator keep values that are live across
+    // library calls out of the registers that the routines modify.
+    timer.reset();
+    libraryClobbers = loadLibraryClobbers(libraryPathname("library.s"));
+    timeReport.add("loadLibraryClobbers", "", timer.elapsed());
+
+    // Compute liveness and spill variables.
+    pgm->runPerFunction("", [this](Function *function) {
+        function->ensureMaxRegisters([this](const Instruction *instruction) {
+            return maxFloatsAcross(instruction);
+        });
+    });
+
+    // Hide float latencies now that we know which registers are spilled.
+    if (useScheduler) {
+        for (auto &[_, function] : pgm->functions) {
+            timer.reset();
+            scheduleInstructions(function.get());
+            timeReport.add("scheduleInstructions", function->cleanName, timer.elapsed());
         }
     }
-#endif
 
     // Translate out of SSA by eliminating phi instructions.
+    timer.reset();
     translateOutOfSsa();
+    timeReport.add("translateOutOfSsa", "", timer.elapsed());
+
+    // Decide which variables and constants can be accessed with a single
+    // instruction. This may reserve gp, so do it before allocation.
+    timer.reset();
+    RelocatableObject library = loadLibraryObject(libraryPathname("library.o"),
+            libraryPathname("library.s"));
+    uint32_t librarySmallDataEnd;
+    std::set<std::string> libraryExternals;
+    findLibrarySmallData(library, librarySmallDataEnd, libraryExternals);
+    timeReport.add("loadLibrary", "", timer.elapsed());
+    timer.reset();
+    layOutData(librarySmallDataEnd, libraryExternals);
+    timeReport.add("layOutData", "", timer.elapsed());
 
     // Perform physical register assignment.
+    timer.reset();
     assignRegisters();
+    timeReport.add("assignRegisters", "", timer.elapsed());
 
     // Emit our header.
-    outFile << ".segment text\n";
+    timer.reset();
+    assembly << ".segment text\n";
     std::ostringstream ss;
 
     ss << "lui sp, %hi(" << RiscVInitialStackPointer << ")";
@@ -53,41 +152,120 @@ void Compiler::compile() {
 
     // Emit instructions.
     emitInstructions();
-    emitVariables();
-    emitConstants();
-    emitLibrary();
-
+    emitData(0, smallDataCount);
+
+    // Write the assembly text with the whole library appended, or assemble
+    // it in-process and link in only the library routines and tables that
+    // it uses. The linker moves the library's small data before our other
+    // data, but in the text the library has to go between them.
+    if (writeAssembly) {
+        emitLibrary();
+        emitData(smallDataCount, dataLayout.size());
+        outFile << assembly.str();
+        timeReport.add("emit", "", timer.elapsed());
+
+        // Assemble the text as "as -v" would, into an object and a listing
+        // next to it.
+        timer.reset();
+        std::string basePathname = outputPathname.substr(0, outputPathname.size() - 2);
+        Assembler assembler;
+        assembler.addSource(assembly.str(), outputPathname);
+        assembler.assemble();
+        assembler.save(basePathname + ".o");
+        std::ofstream listingFile(basePathname + ".lst");
+        assembler.dumpListing(listingFile);
+        timeReport.add("assemble", "", timer.elapsed());
+    } else {
+        emitData(smallDataCount, dataLayout.size());
+        timeReport.add("emit", "", timer.elapsed());
+
+        timer.reset();
+        Assembler assembler(true);
+        assembler.addSource(assembly.str(), "(compiler output)");
+        assembler.assemble();
+        timeReport.add("assemble", "", timer.elapsed());
+
+        timer.reset();
+        Linker linker;
+        linker.addObject(assembler.relocatableObject(), "(compiler output)", false);
+        linker.addObject(library, libraryPathname("library.o"), true);
+        linker.link();
+        linker.dumpStatistics(std::cout);
+        linker.write(outFile);
+        timeReport.add("link", "", timer.elapsed());
+    }
     outFile.close();
 }
 
 void Compiler::emitInstructions() {
     for (auto &[_, function] : pgm->functions) {
-        emitInstructionsForFunction(function.get());
+        // Branch straight to blocks if every branch in the function is sure
+        // to reach. If it's too big for that, emit it again with the
+        // conditional branches skipping over jumps.
+        std::streampos start = assembly.tellp();
+        uint32_t firstLocalLabel = localLabelCounter;
+        shortBranches = true;
+        std::string summary = emitInstructionsForFunction(function.get());
+        if (emittedInstructions*4 >= CONDITIONAL_BRANCH_RANGE) {
+            std::string text = assembly.str();
+            text.resize(start);
+            assembly.str(text);
+            assembly.seekp(0, std::ios::end);
+            localLabelCounter = firstLocalLabel;
+            shortBranches = false;
+            summary = emitInstructionsForFunction(function.get());
+        }
+
+        if (unexecutedCount > 0) {
+            std::cerr << "Warning: Function \"" << function->cleanName << "\" has "
+                << unexecutedCount << " fused multiply-adds, which the Verilog core doesn't execute.\n";
+        }
+        if (pgm->verbose) {
+            std::cout << summary << "\n";
+        }
     }
 }
 
-void Compiler::emitInstructionsForFunction(Function *function) {
-    outFile << "; ---------------------------- function \"" << function->cleanName << "\"\n";
-    outFile << ".segment text\n";
+std::string Compiler::emitInstructionsForFunction(Function *function) {
+    assembly << "; ---------------------------- function \"" << function->cleanName << "\"\n";
+    assembly << ".segment text\n";
     emitLabel(function->cleanName);
 
-    // Emit instructions to fill constants.
-    for (auto regId : function->blocks.at(function->startBlockId)->instructions.head->livein.at(0)) {
+    // Library calls overwrite ra, so save it once for the whole function.
+    emittedCycles = 0;
+    emittedInstructions = 0;
+    unexecutedCount = 0;
+    savedReturnAddress = false;
+    for (auto &[_, block] : function->blocks) {
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            if (!libraryRoutineFor(inst.get()).empty()) {
+                savedReturnAddress = true;
+            }
+        }
+    }
+    if (savedReturnAddress) {
+        emit("addi sp, sp, -4", "Make room on stack");
+        emit("sw ra, 0(sp)", "Save return address");
+    }
+
+    // Emit instructions to fill constants. Only constants are live here, so
+    // gp is free to build floats in, as long as we do that before loading
+    // the others: it's either reserved for far data or allocated to one of
+    // them.
+    const auto &liveIn = function->blocks.at(function->startBlockId)->instructions.head->livein.at(0);
+    std::vector<uint32_t> constIds(liveIn.begin(), liveIn.end());
+    std::stable_partition(constIds.begin(), constIds.end(), [this](uint32_t regId) {
+        return isRegFloat(regId) && !canBuildConstant(regId, false) && canBuildConstant(regId, true);
+    });
+    for (auto regId : constIds) {
         auto r = registers.find(regId);
         assert(r != registers.end());
         assert(r->second.phy != NO_REGISTER);
-        std::ostringstream ss;
-        if (isRegFloat(regId)) {
-            ss << "flw f" << (r->second.phy - 32);
-        } else {
-            ss << "lw x" << r->second.phy;
-        }
-        ss << ", .C" << regId << "(x0)";
+        Register const &pr = pgm->constants.at(regId);
 
         // Build comment with constant value.
         std::ostringstream ssc;
         ssc << "Load constant (";
-        Register const &pr = pgm->constants.at(regId);
         uint32_t typeOp = pgm->getTypeOp(r->second.type);
         switch (typeOp) {
             case SpvOpTypeInt:
@@ -112,23 +290,154 @@ void Compiler::emitInstructionsForFunction(Function *function) {
         }
         ssc << ")";
 
-        emit(ss.str(), ssc.str());
+        std::ostringstream ssr;
+        if (isRegFloat(regId)) {
+            ssr << "f" << (r->second.phy - 32);
+        } else {
+            ssr << "x" << r->second.phy;
+        }
+        emitLoadConstant(ssr.str(), isRegFloat(regId), regId, "gp", ssc.str());
+    }
+
+    // Emit blocks in an order that lets branches fall through. Estimate
+    // the cycles of each from its instructions and how often it runs.
+    // Library routines aren't counted, only the jal to them.
+    double functionCycles = emittedCycles;
+    std::vector<Block *> order = computeBlockOrder(function);
+    for (size_t i = 0; i < order.size(); i++) {
+        nextBlockId = i + 1 < order.size() ? order[i + 1]->blockId : NO_BLOCK_ID;
+        emittedCycles = 0;
+        emitInstructionsForBlock(order[i]);
+        double blockCycles = emittedCycles*blockExecutions.at(order[i]->blockId);
+        functionCycles += blockCycles;
+        if (writeAssembly && emittedCycles > 0) {
+            assembly << std::fixed << std::setprecision(0)
+                << "; block" << order[i]->blockId << ": " << emittedCycles << " cycles, run "
+                << blockExecutions.at(order[i]->blockId) << " times: " << blockCycles << " cycles\n"
+                << std::defaultfloat << std::setprecision(6);
+        }
+    }
+
+    std::ostringstream ss;
+    ss << "Estimated cycles for function \"" << function->cleanName << "\": "
+        << std::fixed << std::setprecision(0) << functionCycles << " per call.";
+    if (unexecutedCount > 0) {
+        ss << " Not counting " << unexecutedCount << " fused instructions.";
+    }
+    if (writeAssembly) {
+        assembly << "; " << ss.str() << "\n";
     }
 
-    // Start with start block.
-    emitInstructionsForBlockTree(function->blocks.at(function->startBlockId).get());
+    return ss.str();
 }
 
-void Compiler::emitInstructionsForBlockTree(Block *block) {
-    // Do block.
-    emitInstructionsForBlock(block);
+std::vector<Block *> Compiler::computeBlockOrder(const Function *function) const {
+    // Blocks reachable from the start block, in depth-first order so that
+    // ties below are broken the way the code was written.
+    std::vector<uint32_t> blockIds;
+    std::map<uint32_t,size_t> position;
+    std::vector<uint32_t> stack = { function->startBlockId };
+    while (!stack.empty()) {
+        uint32_t blockId = stack.back();
+        stack.pop_back();
+        if (position.find(blockId) == position.end()) {
+            position[blockId] = blockIds.size();
+            blockIds.push_back(blockId);
+            const std::set<uint32_t> &succ = function->blocks.at(blockId)->succ;
+            stack.insert(stack.end(), succ.rbegin(), succ.rend());
+        }
+    }
 
-    // Descend down idom tree. We could be more clever about this, maybe looking for
-    // block that only have one successor, and trying to put those back-to-back
-    // to avoid needless jumps.
-    for (auto subBlock : block->idomChildren) {
-        emitInstructionsForBlockTree(subBlock.get());
+    // Edges that could fall through, weighted by how often we expect them
+    // to run: each loop level counts eight times the one outside it, and
+    // an edge that leaves a loop counts half as much as one that stays.
+    struct Edge {
+        float weight;
+        uint32_t from;
+        uint32_t to;
+    };
+    std::vector<Edge> edges;
+    for (uint32_t blockId : blockIds) {
+        const Block *block = function->blocks.at(blockId).get();
+        uint32_t opcode = block->instructions.tail->opcode();
+        if (opcode != SpvOpBranch && opcode != SpvOpBranchConditional && opcode != RiscVOpBranch) {
+            continue;
+        }
+        for (uint32_t succId : block->succ) {
+            const Block *succ = function->blocks.at(succId).get();
+            if (succId == function->startBlockId) {
+                continue;
+            }
+            float weight = std::pow(8.0f, std::min(block->loopDepth, succ->loopDepth));
+            if (succ->loopDepth < block->loopDepth) {
+                weight /= 2;
+            }
+            edges.push_back({weight, blockId, succId});
+        }
+    }
+    std::stable_sort(edges.begin(), edges.end(), [&position](const Edge &a, const Edge &b) {
+        return a.weight != b.weight ? a.weight > b.weight :
+            std::make_pair(position.at(a.from), position.at(a.to)) <
+            std::make_pair(position.at(b.from), position.at(b.to));
+    });
+
+    // Greedily join chains of blocks along the heaviest edges (Pettis and
+    // Hansen). Each block starts as its own chain.
+    std::map<uint32_t,std::vector<uint32_t>> chains;
+    std::map<uint32_t,uint32_t> chainOf;
+    for (uint32_t blockId : blockIds) {
+        chains[blockId] = { blockId };
+        chainOf[blockId] = blockId;
+    }
+    for (const Edge &edge : edges) {
+        uint32_t fromChain = chainOf.at(edge.from);
+        uint32_t toChain = chainOf.at(edge.to);
+        if (fromChain != toChain &&
+                chains.at(fromChain).back() == edge.from &&
+                chains.at(toChain).front() == edge.to) {
+
+            for (uint32_t blockId : chains.at(toChain)) {
+                chains.at(fromChain).push_back(blockId);
+                chainOf[blockId] = fromChain;
+            }
+            chains.erase(toChain);
+        }
+    }
+
+    // Start with the chain of the start block, then repeatedly pick the
+    // chain that the heaviest edge from placed blocks goes to.
+    std::vector<Block *> order;
+    std::set<uint32_t> placed;
+    uint32_t nextChain = chainOf.at(function->startBlockId);
+    while (true) {
+        for (uint32_t blockId : chains.at(nextChain)) {
+            order.push_back(function->blocks.at(blockId).get());
+            placed.insert(blockId);
+        }
+        chains.erase(nextChain);
+        if (chains.empty()) {
+            break;
+        }
+
+        nextChain = NO_BLOCK_ID;
+        for (const Edge &edge : edges) {
+            if (placed.find(edge.from) != placed.end() && placed.find(edge.to) == placed.end()) {
+                nextChain = chainOf.at(edge.to);
+                break;
+            }
+        }
+        if (nextChain == NO_BLOCK_ID) {
+            // Only reached through returns or jumps we don't lay out.
+            for (uint32_t blockId : blockIds) {
+                if (placed.find(blockId) == placed.end()) {
+                    nextChain = chainOf.at(blockId);
+                    break;
+                }
+            }
+        }
     }
+
+    return order;
 }
 
 void Compiler::emitInstructionsForBlock(Block *block) {
@@ -142,44 +451,210 @@ void Compiler::emitInstructionsForBlock(Block *block) {
     }
 }
 
-void Compiler::emitVariables() {
-    outFile << "; ---------------------------- variables\n";
-    outFile << ".segment data\n";
-    for (auto &[id, var] : pgm->variables) {
-        std::string name = getVariableName(id);
+void Compiler::layOutData(uint32_t librarySmallDataEnd,
+        const std::set<std::string> &libraryExternals) {
+
+    // Count the instructions that load, store, or take the address of
+    // each variable.
+    std::map<uint32_t,int> useCount;
+    for (auto &[_, function] : pgm->functions) {
+        for (auto &[_, block] : function->blocks) {
+            for (auto inst = block->instructions.head; inst; inst = inst->next) {
+                for (uint32_t argId : inst->argIdList) {
+                    if (pgm->variables.find(argId) != pgm->variables.end()) {
+                        useCount[argId]++;
+                    }
+                }
+            }
+        }
+    }
 
-        // XXX Check storage class? (var.storageClass)
-        emitLabel(name);
-        size_t size = pgm->typeSizes.at(var.type);
-        for (size_t i = 0; i < size/4; i++) {
-            emit(".word 0", "");
+    // Constants are only stored if they're loaded rather than built, either
+    // at the start of a function or by a RiscVLoadConst. Those with the same
+    // bit pattern share a word.
+    std::map<uint32_t,uint32_t> wordOwner;
+    sharedConstant.clear();
+    auto loadConstant = [this, &useCount, &wordOwner](uint32_t id, bool haveScratch) {
+        if (!canBuildConstant(id, haveScratch)) {
+            uint32_t owner = id;
+            uint32_t word;
+            if (asConstantWord(id, word)) {
+                owner = wordOwner.emplace(word, id).first->second;
+            }
+            sharedConstant[id] = owner;
+            useCount[owner]++;
+        }
+    };
+    for (auto &[_, function] : pgm->functions) {
+        for (auto id : function->blocks.at(function->startBlockId)->instructions.head->livein.at(0)) {
+            loadConstant(id, true);
         }
-        for (size_t i = 0; i < size%4; i++) {
-            emit(".byte 0", "");
+        for (auto &[_, block] : function->blocks) {
+            for (auto inst = block->instructions.head; inst; inst = inst->next) {
+                if (inst->opcode() == RiscVOpLoadConst) {
+                    loadConstant(static_cast<RiscVLoadConst *>(inst.get())->constId,
+                            hasScratchRegister(inst.get()));
+                }
+            }
+        }
+    }
+
+    // Variables first, then stored constants, in ID order.
+    std::vector<uint32_t> ids;
+    for (auto &[id, _] : pgm->variables) {
+        ids.push_back(id);
+    }
+    size_t storedConstantCount = 0;
+    for (auto &[id, owner] : sharedConstant) {
+        if (id == owner) {
+            ids.push_back(id);
+            storedConstantCount++;
         }
     }
+
+    // The library's x0-relative accesses need these in the small-data area.
+    auto isPinned = [this, &libraryExternals](uint32_t id) {
+        return pgm->variables.find(id) != pgm->variables.end() &&
+            libraryExternals.find(getVariableName(id)) != libraryExternals.end();
+    };
+
+    // Pinned, then most used, then smallest.
+    std::stable_sort(ids.begin(), ids.end(), [this, &useCount, &isPinned](uint32_t a, uint32_t b) {
+        bool pinnedA = isPinned(a);
+        bool pinnedB = isPinned(b);
+        if (pinnedA != pinnedB) {
+            return pinnedA;
+        }
+        if (useCount[a] != useCount[b]) {
+            return useCount[a] > useCount[b];
+        }
+        return getDataSize(a) < getDataSize(b);
+    });
+
+    std::vector<uint32_t> smallData;
+    std::vector<uint32_t> otherData;
+    uint32_t smallDataSize = librarySmallDataEnd;
+    for (uint32_t id : ids) {
+        uint32_t size = getDataSize(id);
+        if (isPinned(id) || (size <= SMALL_DATA_MAX_OBJECT_SIZE &&
+                    smallDataSize + size <= SMALL_DATA_SIZE)) {
+
+            smallData.push_back(id);
+            smallDataSize += size;
+        } else {
+            otherData.push_back(id);
+        }
+    }
+
+    // Keep the rest in ID order.
+    std::sort(otherData.begin(), otherData.end());
+
+    dataLayout = smallData;
+    dataLayout.insert(dataLayout.end(), otherData.begin(), otherData.end());
+    smallDataCount = smallData.size();
+
+    farData.clear();
+    reserveGp = false;
+    for (uint32_t id : otherData) {
+        bool isVariable = pgm->variables.find(id) != pgm->variables.end();
+        farData.insert(isVariable ? getVariableName(id) : getConstantName(id));
+        if (useCount[id] > 0) {
+            reserveGp = true;
+        }
+    }
+
+    std::cout << "Constants: " << storedConstantCount << " stored, "
+        << (sharedConstant.size() - storedConstantCount) << " sharing storage, "
+        << (pgm->constants.size() - sharedConstant.size()) << " built or unused.\n";
+    std::cout << "Small data: " << smallData.size() << " variables and constants ("
+        << (smallDataSize - librarySmallDataEnd) << " bytes), "
+        << otherData.size() << " outside.\n";
 }
 
-void Compiler::emitConstants() {
-    outFile << "; ---------------------------- constants\n";
-    outFile << ".segment data\n";
-    for (auto &[id, reg] : pgm->constants) {
-        std::string name;
-        auto nameItr = pgm->names.find(id);
-        if (nameItr == pgm->names.end()) {
-            std::ostringstream ss;
-            ss << ".C" << id;
-            name = ss.str();
+void Compiler::emitData(size_t begin, size_t end) {
+    if (begin == end) {
+        return;
+    }
+
+    assembly << "; ---------------------------- "
+        << (begin == 0 ? "small data" : "other data") << "\n";
+    assembly << ".segment data\n";
+    for (size_t i = begin; i < end; i++) {
+        uint32_t id = dataLayout[i];
+
+        auto varItr = pgm->variables.find(id);
+        if (varItr != pgm->variables.end()) {
+            // XXX Check storage class? (var.storageClass)
+            emitLabel(getVariableName(id));
+            size_t size = pgm->typeSizes.at(varItr->second.type);
+            for (size_t j = 0; j < size/4; j++) {
+                emit(".word 0", "");
+            }
+            for (size_t j = 0; j < size%4; j++) {
+                emit(".byte 0", "");
+            }
         } else {
-            name = nameItr->second;
+            const Register &reg = pgm->constants.at(id);
+            emitLabel(getConstantName(id));
+            emitConstant(id, reg.type, reg.data);
         }
-        emitLabel(name);
-        emitConstant(id, reg.type, reg.data);
     }
 }
 
+uint32_t Compiler::getDataSize(uint32_t id) const {
+    auto varItr = pgm->variables.find(id);
+    if (varItr != pgm->variables.end()) {
+        return pgm->typeSizes.at(varItr->second.type);
+    }
+
+    // See emitConstant().
+    switch (pgm->getTypeOp(pgm->constants.at(id).type)) {
+        case SpvOpTypeVector:
+        case SpvOpTypeMatrix:
+            return 0;
+
+        default:
+            return 4;
+    }
+}
+
+std::string Compiler::dataOperand(const std::string &label, uint32_t offset) {
+    std::ostringstream ss;
+    ss << label;
+    if (offset != 0) {
+        ss << "+" << offset;
+    }
+
+    if (farData.find(label) == farData.end()) {
+        return ss.str() + "(x0)";
+    }
+
+    emit("lui gp, %hi(" + ss.str() + ")", "Outside small data");
+    return "%lo(" + ss.str() + ")(gp)";
+}
+
 void Compiler::emitLibrary() {
-    outFile << readFileContents("library.s");
+    assembly << readFileContents(libraryPathname("library.s"));
+}
+
+std::string Compiler::libraryPathname(const std::string &filename) const {
+    return libraryDirectory + "/" + filename;
+}
+
+std::string Compiler::getConstantName(uint32_t id) const {
+    auto shared = sharedConstant.find(id);
+    if (shared != sharedConstant.end()) {
+        id = shared->second;
+    }
+
+    auto nameItr = pgm->names.find(id);
+    if (nameItr == pgm->names.end()) {
+        std::ostringstream ss;
+        ss << ".C" << id;
+        return ss.str();
+    } else {
+        return nameItr->second;
+    }
 }
 
 std::string Compiler::getVariableName(uint32_t id) const {
@@ -243,6 +718,113 @@ void Compiler::emitConstant(uint32_t id, uint32_t typeId, unsigned char *data) {
     }
 }
 
+bool Compiler::asConstantWord(uint32_t id, uint32_t &word) const {
+    auto r = pgm->constants.find(id);
+    if (r == pgm->constants.end()) {
+        return false;
+    }
+
+    // See emitConstant().
+    switch (pgm->getTypeOp(r->second.type)) {
+        case SpvOpTypeBool:
+            word = *reinterpret_cast<bool *>(r->second.data) ? 1 : 0;
+            return true;
+
+        case SpvOpTypeInt:
+        case SpvOpTypeFloat:
+            word = *reinterpret_cast<uint32_t *>(r->second.data);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+bool Compiler::canBuildConstant(uint32_t id, bool haveScratch) const {
+    uint32_t word;
+    if (!asConstantWord(id, word)) {
+        return false;
+    }
+
+    switch (pgm->getTypeOp(pgm->constants.at(id).type)) {
+        case SpvOpTypeBool:
+        case SpvOpTypeInt:
+            return true;
+
+        case SpvOpTypeFloat: {
+            if (word == 0) {
+                return true;
+            }
+
+            // Common values like 1.0 and 0.5 have all-zero low bits and can
+            // be built with lui and fmv.s.x, but on the core that's only
+            // faster than flw if the load needs a lui of its own. Data isn't
+            // far until it's laid out, so anything that might be loaded is
+            // still stored.
+            if (!haveScratch || (word & 0xFFF) != 0) {
+                return false;
+            }
+            int loadCycles = instructionCycles("flw");
+            if (farData.find(getConstantName(id)) != farData.end()) {
+                loadCycles += instructionCycles("lui");
+            }
+            return instructionCycles("lui") + instructionCycles("fmv.s.x") < loadCycles;
+        }
+
+        default:
+            return false;
+    }
+}
+
+void Compiler::emitLoadConstant(const std::string &regName, bool isFloat, uint32_t id,
+        const std::string &scratch, const std::string &comment) {
+
+    uint32_t word;
+    if (!canBuildConstant(id, !scratch.empty()) || !asConstantWord(id, word)) {
+        emit(std::string(isFloat ? "flw " : "lw ") + regName + ", " +
+                dataOperand(getConstantName(id), 0), comment);
+    } else if (!isFloat) {
+        emitLoadImmediate(regName, word, comment);
+    } else if (word == 0) {
+        // Positive zero is all zero bits.
+        emit("fmv.s.x " + regName + ", x0", comment);
+    } else {
+        emitLoadImmediate(scratch, word, comment);
+        emit("fmv.s.x " + regName + ", " + scratch, "");
+    }
+}
+
+bool Compiler::hasScratchRegister(const Instruction *instruction) const {
+    // x4 to x31 are allocatable even if gp is reserved.
+    size_t liveInts = std::count_if(instruction->liveout.begin(), instruction->liveout.end(),
+            [this](uint32_t id) { return !pgm->isTypeFloat(pgm->typeIdOf(id)); });
+    return liveInts < 28;
+}
+
+std::string Compiler::findScratchRegister(const Instruction *instruction) const {
+    if (reserveGp) {
+        // Only used within a single load or store.
+        return "gp";
+    }
+
+    std::set<uint32_t> usedPhy;
+    for (uint32_t id : instruction->liveout) {
+        auto r = registers.find(id);
+        if (r != registers.end()) {
+            usedPhy.insert(r->second.phy);
+        }
+    }
+    for (uint32_t phy = 3; phy < 32; phy++) {
+        if (usedPhy.find(phy) == usedPhy.end()) {
+            std::ostringstream ss;
+            ss << "x" << phy;
+            return ss.str();
+        }
+    }
+
+    return "";
+}
+
 bool Compiler::asIntegerConstant(uint32_t id, uint32_t &value) const {
     auto r = pgm->constants.find(id);
     if (r != pgm->constants.end()) {
@@ -270,39 +852,403 @@ std::string Compiler::makeLocalLabel() {
     return ss.str();
 }
 
-void Compiler::transformInstructions(InstructionList &inList) {
-    InstructionList newList(inList.block);
+// Whether the integer fits in a sign-extended 12-bit immediate.
+static bool fitsInImmediate(uint32_t value) {
+    int32_t signedValue = value;
+    return signedValue >= -2048 && signedValue < 2048;
+}
+
+void Compiler::transformInstructions(Function *function) {
+    // Find the instructions that use each register.
+    std::map<uint32_t,std::vector<std::shared_ptr<Instruction>>> uses;
+    for (auto &[_, block] : function->blocks) {
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            for (uint32_t argId : inst->argIdList) {
+                uses[argId].push_back(inst);
+            }
+        }
+    }
 
-    std::shared_ptr<Instruction> nextInst;
-    for (auto inst = inList.head; inst; inst = nextInst) {
-        nextInst = inst->next;
+    for (auto &[_, block] : function->blocks) {
+        InstructionList &inList = block->instructions;
+
+        // Fuse a compare that only feeds the block's conditional branch
+        // into a compare-and-branch.
+        InsnBranchConditional *branch = dynamic_cast<InsnBranchConditional *>(inList.tail.get());
+        if (branch != nullptr && uses[branch->conditionId()].size() == 1) {
+            uint32_t conditionId = branch->conditionId();
+            std::shared_ptr<Instruction> compare;
+            for (auto inst = inList.head; inst != inList.tail; inst = inst->next) {
+                if (inst->affectsRegister(conditionId)) {
+                    compare = inst;
+                }
+            }
 
-        bool replaced = false;
-        Instruction *instruction = inst.get();
-        if (instruction->opcode() == SpvOpIAdd) {
-            InsnIAdd *insnIAdd = dynamic_cast<InsnIAdd *>(instruction);
+            // Use x0 for a zero operand.
+            auto operand = [this](uint32_t id) {
+                uint32_t value;
+                return asIntegerConstant(id, value) && value == 0 ? 0 : id;
+            };
+
+            std::shared_ptr<Instruction> newBranch;
+            if (compare && compare->opcode() == SpvOpSLessThan) {
+                InsnSLessThan *insn = dynamic_cast<InsnSLessThan *>(compare.get());
+                newBranch = std::make_shared<RiscVBranch>(branch->lineInfo, "blt",
+                        operand(insn->operand1Id()), operand(insn->operand2Id()),
+                        branch->trueLabelId, branch->falseLabelId);
+            } else if (compare && compare->opcode() == SpvOpIEqual) {
+                InsnIEqual *insn = dynamic_cast<InsnIEqual *>(compare.get());
+                newBranch = std::make_shared<RiscVBranch>(branch->lineInfo, "beq",
+                        operand(insn->operand1Id()), operand(insn->operand2Id()),
+                        branch->trueLabelId, branch->falseLabelId);
+            } else if (compare && compare->opcode() == SpvOpLogicalNot) {
+                InsnLogicalNot *insn = dynamic_cast<InsnLogicalNot *>(compare.get());
+                newBranch = std::make_shared<RiscVBranch>(branch->lineInfo, "beq",
+                        insn->operandId(), 0,
+                        branch->trueLabelId, branch->falseLabelId);
+            }
+            if (newBranch) {
+                inList.erase(compare);
+                inList.erase(inList.tail);
+                inList.push_back(newBranch);
+            }
+        }
 
+        std::shared_ptr<Instruction> nextInst;
+        for (auto inst = inList.head; inst; inst = nextInst) {
+            nextInst = inst->next;
+
+            std::shared_ptr<Instruction> newInst;
+            Instruction *instruction = inst.get();
             uint32_t imm;
-            if (asIntegerConstant(insnIAdd->operand1Id(), imm)) {
-                // XXX Verify that immediate fits in 12 bits.
-                newList.push_back(std::make_shared<RiscVAddi>(insnIAdd->lineInfo,
-                            insnIAdd->type, insnIAdd->resultId(), insnIAdd->operand2Id(), imm));
-                replaced = true;
-            } else if (asIntegerConstant(insnIAdd->operand2Id(), imm)) {
-                // XXX Verify that immediate fits in 12 bits.
-                newList.push_back(std::make_shared<RiscVAddi>(insnIAdd->lineInfo,
-                            insnIAdd->type, insnIAdd->resultId(), insnIAdd->operand1Id(), imm));
-                replaced = true;
+            switch (instruction->opcode()) {
+                case SpvOpIAdd: {
+                    InsnIAdd *insn = dynamic_cast<InsnIAdd *>(instruction);
+                    if (asIntegerConstant(insn->operand1Id(), imm) && fitsInImmediate(imm)) {
+                        newInst = std::make_shared<RiscVAddi>(insn->lineInfo,
+                                insn->type, insn->resultId(), insn->operand2Id(), imm);
+                    } else if (asIntegerConstant(insn->operand2Id(), imm) && fitsInImmediate(imm)) {
+                        newInst = std::make_shared<RiscVAddi>(insn->lineInfo,
+                                insn->type, insn->resultId(), insn->operand1Id(), imm);
+                    }
+                    break;
+                }
+
+                case SpvOpSLessThan: {
+                    InsnSLessThan *insn = dynamic_cast<InsnSLessThan *>(instruction);
+                    if (asIntegerConstant(insn->operand2Id(), imm) && fitsInImmediate(imm)) {
+                        newInst = std::make_shared<RiscVSlti>(insn->lineInfo,
+                                insn->type, insn->resultId(), insn->operand1Id(), imm);
+                    }
+                    break;
+                }
+
+                case SpvOpAccessChain: {
+                    // Fold a constant offset into the loads and stores that
+                    // use the pointer, addressing the variable directly.
+                    InsnAccessChain *insn = dynamic_cast<InsnAccessChain *>(instruction);
+                    auto variable = pgm->variables.find(insn->baseId());
+                    if (variable == pgm->variables.end()) {
+                        break;
+                    }
+                    uint32_t type = variable->second.type;
+                    uint32_t offset = 0;
+                    bool foldable = true;
+                    for (size_t i = 0; i < insn->indexesIdCount() && foldable; i++) {
+                        if (asIntegerConstant(insn->indexesId(i), imm)) {
+                            auto [subtype, subOffset] = pgm->getConstituentInfo(type, imm);
+                            type = subtype;
+                            offset += subOffset;
+                        } else {
+                            foldable = false;
+                        }
+                    }
+                    for (auto &use : uses[insn->resultId()]) {
+                        RiscVLoad *load = dynamic_cast<RiscVLoad *>(use.get());
+                        RiscVStore *store = dynamic_cast<RiscVStore *>(use.get());
+                        if (!(load != nullptr && load->pointerId() == insn->resultId()) &&
+                                !(store != nullptr && store->pointerId() == insn->resultId() &&
+                                    store->objectId() != insn->resultId())) {
+
+                            foldable = false;
+                        }
+                    }
+                    if (foldable) {
+                        for (auto &use : uses[insn->resultId()]) {
+                            use->changeArg(insn->resultId(), insn->baseId());
+                            if (RiscVLoad *load = dynamic_cast<RiscVLoad *>(use.get())) {
+                                load->offset += offset;
+                            } else {
+                                dynamic_cast<RiscVStore *>(use.get())->offset += offset;
+                            }
+                        }
+                        inList.erase(inst);
+                    }
+                    break;
+                }
+            }
+
+            if (newInst) {
+                inList.insert(newInst, inst);
+                inList.erase(inst);
+            }
+        }
+    }
+}
+
+int Compiler::estimateStallCycles(const std::vector<Instruction *> &instructions) {
+    // Cycle at which each register's value can be used.
+    std::map<uint32_t,int> readyCycle;
+    int cycle = 0;
+    int stalls = 0;
+
+    for (Instruction *instruction : instructions) {
+        int issue = cycle;
+        for (uint32_t argId : instruction->argIdSet) {
+            auto itr = readyCycle.find(argId);
+            if (itr != readyCycle.end()) {
+                issue = std::max(issue, itr->second);
+            }
+        }
+        stalls += issue - cycle;
+        for (uint32_t resId : instruction->resIdSet) {
+            readyCycle[resId] = issue + instructionLatency(instruction);
+        }
+        cycle = issue + 1;
+    }
+
+    return stalls;
+}
+
+bool Compiler::isSchedulingBarrier(const Instruction *instruction) const {
+    switch (instruction->opcode()) {
+        case SpvOpPhi:
+        case RiscVOpPhi:
+        case SpvOpFunctionCall:
+        case SpvOpFunctionParameter:
+            return true;
+    }
+
+    // Library calls clobber registers, so moving values across them would
+    // change what the allocator must keep out of those registers.
+    return instruction->isTermination() || !libraryRoutineFor(instruction).empty();
+}
+
+// Schedule a run of instructions that contains no barrier. The instructions
+// are in their original order. Float and int pressure are counted on the
+// live-in sets, which must be up to date. "endLive" is the live-in set of
+// the barrier that follows the run. Returns the new order, or an empty
+// vector if we couldn't stay within the register limits.
+static std::vector<Instruction *> scheduleRun(const Program *pgm,
+        const std::vector<Instruction *> &run, const std::set<uint32_t> &endLive) {
+
+    size_t count = run.size();
+
+    // Dependencies within the run. Registers are in SSA form, so we only
+    // need to order uses after definitions. Stores stay in order with
+    // each other and with loads.
+    std::vector<std::set<size_t>> preds(count);
+    std::vector<std::set<size_t>> succs(count);
+    std::map<uint32_t,size_t> definedBy;
+    std::vector<size_t> loads;
+    size_t lastStore = count;
+    for (size_t i = 0; i < count; i++) {
+        Instruction *instruction = run[i];
+        for (uint32_t argId : instruction->argIdSet) {
+            auto itr = definedBy.find(argId);
+            if (itr != definedBy.end()) {
+                preds[i].insert(itr->second);
+            }
+        }
+        uint32_t opcode = instruction->opcode();
+        bool isStore = opcode == SpvOpStore || opcode == RiscVOpStore;
+        bool isLoad = opcode == SpvOpLoad || opcode == RiscVOpLoad;
+        if ((isStore || isLoad) && lastStore != count) {
+            preds[i].insert(lastStore);
+        }
+        if (isStore) {
+            for (size_t load : loads) {
+                preds[i].insert(load);
+            }
+            loads.clear();
+            lastStore = i;
+        }
+        if (isLoad) {
+            loads.push_back(i);
+        }
+        for (size_t pred : preds[i]) {
+            succs[pred].insert(i);
+        }
+        for (uint32_t resId : instruction->resIdSet) {
+            definedBy[resId] = i;
+        }
+    }
+
+    // Priority is the length of the longest latency path to the end of the run.
+    std::vector<int> priority(count);
+    for (size_t i = count; i-- > 0; ) {
+        int longest = 0;
+        for (size_t succ : succs[i]) {
+            longest = std::max(longest, priority[succ]);
+        }
+        priority[i] = instructionLatency(run[i]) + longest;
+    }
+
+    // Uses left in the run, to know when a register dies.
+    std::map<uint32_t,int> usesLeft;
+    for (Instruction *instruction : run) {
+        for (uint32_t argId : instruction->argIdSet) {
+            usesLeft[argId]++;
+        }
+    }
+
+    auto isFloat = [pgm](uint32_t regId) {
+        return pgm->isTypeFloat(pgm->typeIdOf(regId));
+    };
+
+    // Registers live before the next instruction, and the most that were
+    // live in the original order. We don't let ints exceed that since
+    // there's no int spiller.
+    std::set<uint32_t> live = run[0]->livein.at(0);
+    size_t maxInts = 0;
+    for (Instruction *instruction : run) {
+        const std::set<uint32_t> &livein = instruction->livein.at(0);
+        size_t ints = std::count_if(livein.begin(), livein.end(),
+                [&isFloat](uint32_t regId) { return !isFloat(regId); });
+        maxInts = std::max(maxInts, ints);
+    }
+
+    // Returns the live set after issuing the instruction.
+    auto liveAfter = [&](size_t i) {
+        std::set<uint32_t> after = live;
+        for (uint32_t argId : run[i]->argIdSet) {
+            if (usesLeft.at(argId) == 1 && endLive.find(argId) == endLive.end()) {
+                after.erase(argId);
+            }
+        }
+        for (uint32_t resId : run[i]->resIdSet) {
+            if (usesLeft.find(resId) != usesLeft.end() || endLive.find(resId) != endLive.end()) {
+                after.insert(resId);
             }
         }
+        return after;
+    };
+
+    std::vector<Instruction *> scheduled;
+    std::vector<size_t> predsLeft(count);
+    std::vector<int> readyCycle(count, 0);
+    std::set<size_t> candidates;
+    for (size_t i = 0; i < count; i++) {
+        predsLeft[i] = preds[i].size();
+        if (predsLeft[i] == 0) {
+            candidates.insert(i);
+        }
+    }
+
+    int cycle = 0;
+    while (!candidates.empty()) {
+        // Prefer instructions that can issue now, then the longest path.
+        // Ties go to the original order.
+        size_t best = count;
+        std::set<uint32_t> bestLive;
+        for (size_t i : candidates) {
+            std::set<uint32_t> after = liveAfter(i);
+            size_t floats = std::count_if(after.begin(), after.end(), isFloat);
+            if (floats > MAX_LIVE_FLOATS || after.size() - floats > maxInts) {
+                continue;
+            }
+            if (best == count ||
+                    std::make_pair(readyCycle[i] <= cycle, priority[i]) >
+                    std::make_pair(readyCycle[best] <= cycle, priority[best])) {
+
+                best = i;
+                bestLive = after;
+            }
+        }
+        if (best == count) {
+            return std::vector<Instruction *>();
+        }
 
-        if (!replaced) {
-            newList.push_back(inst);
+        int issue = std::max(cycle, readyCycle[best]);
+        for (uint32_t argId : run[best]->argIdSet) {
+            usesLeft.at(argId)--;
         }
+        live = bestLive;
+        scheduled.push_back(run[best]);
+        candidates.erase(best);
+        for (size_t succ : succs[best]) {
+            readyCycle[succ] = std::max(readyCycle[succ], issue + instructionLatency(run[best]));
+            if (--predsLeft[succ] == 0) {
+                candidates.insert(succ);
+            }
+        }
+        cycle = issue + 1;
     }
 
-    /// std::swap(newList, inList); // XXX
-    newList.swap(inList);
+    assert(scheduled.size() == count);
+    return scheduled;
+}
+
+void Compiler::scheduleInstructions(Function *function) {
+    int stallsBefore = 0;
+    int stallsAfter = 0;
+
+    for (auto &[_, block] : function->blocks) {
+        std::vector<Instruction *> original;
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            original.push_back(inst.get());
+        }
+
+        // Schedule each run between barriers on its own.
+        std::vector<Instruction *> order;
+        std::vector<Instruction *> run;
+        for (Instruction *instruction : original) {
+            if (isSchedulingBarrier(instruction)) {
+                if (!run.empty()) {
+                    std::vector<Instruction *> scheduled =
+                        scheduleRun(pgm, run, instruction->livein.at(0));
+                    if (scheduled.empty() ||
+                            estimateStallCycles(scheduled) >= estimateStallCycles(run)) {
+
+                        scheduled = run;
+                    }
+                    order.insert(order.end(), scheduled.begin(), scheduled.end());
+                    run.clear();
+                }
+                order.push_back(instruction);
+            } else {
+                run.push_back(instruction);
+            }
+        }
+        assert(run.empty());
+
+        int before = estimateStallCycles(original);
+        int after = estimateStallCycles(order);
+        stallsBefore += before;
+        stallsAfter += after;
+        if (after == before) {
+            continue;
+        }
+
+        // Rebuild the block in the new order. Appending an instruction
+        // takes it out of its old position.
+        std::map<Instruction *,std::shared_ptr<Instruction>> owner;
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            owner[inst.get()] = inst;
+        }
+        for (Instruction *instruction : order) {
+            block->instructions.push_back(owner.at(instruction));
+        }
+    }
+
+    // The allocator needs liveness for the new order.
+    function->computeLiveness();
+
+    if (pgm->verbose) {
+        std::cout << "Scheduling saved an estimated " << stallsBefore - stallsAfter
+            << " of " << stallsBefore << " stall cycles in function \""
+            << function->name << "\".\n";
+    }
 }
 
 void Compiler::translateOutOfSsa() {
@@ -377,9 +1323,10 @@ void Compiler::assignRegisters() {
         registers[id] = CompilerRegister {type, count};
     }
 
-    // 32 registers; x0 is always zero; x1 is ra; x2 is sp.
+    // 32 registers; x0 is always zero; x1 is ra; x2 is sp; x3 is gp if
+    // we access data outside the small-data area.
     std::set<uint32_t> PHY_INT_REGS;
-    for (int i = 3; i < 32; i++) {
+    for (int i = reserveGp ? 4 : 3; i < 32; i++) {
         PHY_INT_REGS.insert(i);
     }
 
@@ -390,7 +1337,16 @@ void Compiler::assignRegisters() {
     }
 
     for (auto& [id, function] : pgm->functions) {
-        assignRegistersForFunction(function.get(), PHY_INT_REGS, PHY_FLOAT_REGS);
+        if (useGreedyAllocator) {
+            assignRegistersForFunction(function.get(), PHY_INT_REGS, PHY_FLOAT_REGS);
+        } else {
+            if (!assignRegistersByColoring(function.get(), PHY_INT_REGS, PHY_FLOAT_REGS)) {
+                if (pgm->verbose) {
+                    std::cout << "    Coloring failed, assigning greedily instead.\n";
+                }
+                assignRegistersForFunction(function.get(), PHY_INT_REGS, PHY_FLOAT_REGS);
+            }
+        }
     }
 }
 
@@ -398,7 +1354,7 @@ void Compiler::assignRegistersForFunction(const Function *function,
         const std::set<uint32_t> &allIntPhy,
         const std::set<uint32_t> &allFloatPhy) {
 
-    /// function->dumpInstructions("before register assignment");
+    /// function->dumpInstructions(std::cout, "before register assignment");
 
     // Start with blocks at the start of functions.
     Block *block = function->blocks.at(function->startBlockId).get();
@@ -407,6 +1363,8 @@ void Compiler::assignRegistersForFunction(const Function *function,
         std::cout << "Assigning registers for function \"" << function->name << "\"\n";
     }
 
+    computeCallClobbers(function);
+
     // Assign registers for constants.
     std::set<uint32_t> constIntRegs = allIntPhy;
     std::set<uint32_t> constFloatRegs = allFloatPhy;
@@ -418,10 +1376,15 @@ void Compiler::assignRegistersForFunction(const Function *function,
         }
         auto &c = pgm->constants.at(regId);
         auto r = CompilerRegister {c.type, 1}; // XXX get real count.
+        const std::set<uint32_t> &clobbered = callClobbers[regId];
         uint32_t phy;
         if (pgm->isTypeFloat(c.type)) {
-            assert(!constFloatRegs.empty());
-            phy = *constFloatRegs.begin();
+            auto itr = constFloatRegs.begin();
+            while (itr != constFloatRegs.end() && clobbered.find(*itr) != clobbered.end()) {
+                ++itr;
+            }
+            assert(itr != constFloatRegs.end());
+            phy = *itr;
             constFloatRegs.erase(phy);
             if (false) {
                 // Print allocated constants.
@@ -429,8 +1392,12 @@ void Compiler::assignRegistersForFunction(const Function *function,
                 std::cerr << "Allocating phy " << phy << " for value " << *f << "\n";
             }
         } else {
-            assert(!constIntRegs.empty());
-            phy = *constIntRegs.begin();
+            auto itr = constIntRegs.begin();
+            while (itr != constIntRegs.end() && clobbered.find(*itr) != clobbered.end()) {
+                ++itr;
+            }
+            assert(itr != constIntRegs.end());
+            phy = *itr;
             constIntRegs.erase(phy);
         }
         if (pgm->verbose) {
@@ -528,10 +1495,12 @@ void Compiler::assignRegistersForBlock(Block *block,
             const std::set<uint32_t> &allPhy =
                 pgm->isTypeFloat(r->second.type) ? allFloatPhy : allIntPhy;
 
-            // Find an available physical register.
+            // Find an available physical register that no call we're live
+            // across will overwrite.
+            const std::set<uint32_t> &clobbered = callClobbers[resId];
             bool found = false;
             for (uint32_t phy : allPhy) {
-                if (assigned.find(phy) == assigned.end()) {
+                if (assigned.find(phy) == assigned.end() && clobbered.find(phy) == clobbered.end()) {
                     r->second.phy = phy;
                     // If the result lives past this instruction, consider its
                     // register assigned.
@@ -550,6 +1519,397 @@ void Compiler::assignRegistersForBlock(Block *block,
     }
 }
 
+bool Compiler::assignRegistersByColoring(const Function *function,
+        const std::set<uint32_t> &allIntPhy,
+        const std::set<uint32_t> &allFloatPhy) {
+
+    if (pgm->verbose) {
+        std::cout << "Coloring registers for function \"" << function->name << "\"\n";
+    }
+
+    // The phi swap code assumes that f31 is free.
+    std::set<uint32_t> floatPhy = allFloatPhy;
+    floatPhy.erase(32 + 31);
+
+    // Constants live into the function are loaded at its start.
+    const std::set<uint32_t> &entryLive =
+        function->blocks.at(function->startBlockId)->instructions.head->livein.at(0);
+    for (auto regId : entryLive) {
+        if (registers.find(regId) != registers.end()) {
+            std::cerr << "Error: Constant "
+                << regId << " already assigned a register at head of function.\n";
+            exit(EXIT_FAILURE);
+        }
+        auto &c = pgm->constants.at(regId);
+        registers[regId] = CompilerRegister {c.type, 1}; // XXX get real count.
+    }
+
+    computeCallClobbers(function);
+
+    // Build the interference graph. A register interferes with everything
+    // live after its definition, except the source of a copy. Registers live
+    // into the function are all defined at once at its start.
+    std::map<uint32_t,std::set<uint32_t>> graph;
+    auto addEdge = [this, &graph](uint32_t a, uint32_t b) {
+        if (a != b && isRegFloat(a) == isRegFloat(b)) {
+            graph[a].insert(b);
+            graph[b].insert(a);
+        }
+    };
+    for (auto a : entryLive) {
+        graph[a];
+        for (auto b : entryLive) {
+            addEdge(a, b);
+        }
+    }
+
+    // Pairs of registers we'd like to coalesce, and the weight of the copy
+    // we'd save by doing so.
+    struct Affinity {
+        float weight;
+        uint32_t a;
+        uint32_t b;
+    };
+    std::vector<Affinity> affinities;
+
+    for (auto &[_, block] : function->blocks) {
+        float weight = powf(10, block->loopDepth);
+
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            Instruction *instruction = inst.get();
+            uint32_t copySource = NO_REGISTER;
+
+            if (instruction->opcode() == SpvOpCopyObject) {
+                InsnCopyObject *insnCopyObject = dynamic_cast<InsnCopyObject *>(instruction);
+                copySource = insnCopyObject->operandId();
+                if (registers.find(copySource) != registers.end()) {
+                    affinities.push_back({weight, insnCopyObject->resultId(), copySource});
+                }
+            } else if (instruction->opcode() == RiscVOpPhi) {
+                RiscVPhi *phi = dynamic_cast<RiscVPhi *>(instruction);
+                for (size_t i = 0; i < phi->resultIds.size(); i++) {
+                    for (size_t j = 0; j < phi->labelIds.size(); j++) {
+                        float edgeWeight = powf(10, function->blocks.at(phi->labelIds[j])->loopDepth);
+                        affinities.push_back({edgeWeight, phi->resultIds[i], phi->operandIds[i][j]});
+                    }
+                }
+            }
+
+            for (uint32_t resId : instruction->resIdSet) {
+                graph[resId];
+                for (uint32_t liveId : instruction->liveout) {
+                    if (liveId != copySource) {
+                        addEdge(resId, liveId);
+                    }
+                }
+                for (uint32_t otherResId : instruction->resIdSet) {
+                    addEdge(resId, otherResId);
+                }
+            }
+        }
+    }
+
+    auto paletteFor = [this, &allIntPhy, &floatPhy](uint32_t regId) -> const std::set<uint32_t> & {
+        return isRegFloat(regId) ? floatPhy : allIntPhy;
+    };
+
+    // Number of colors available to a register that's live across calls.
+    auto colorCount = [this, &paletteFor](uint32_t regId) {
+        const std::set<uint32_t> &palette = paletteFor(regId);
+        size_t count = palette.size();
+        auto itr = callClobbers.find(regId);
+        if (itr != callClobbers.end()) {
+            for (uint32_t phy : itr->second) {
+                count -= palette.count(phy);
+            }
+        }
+        return count;
+    };
+
+    // Coalesce, heaviest copies first. Only merge when the result has fewer
+    // than K neighbors of degree K or more (Briggs), so that a graph we could
+    // color stays colorable.
+    std::map<uint32_t,uint32_t> alias;
+    std::function<uint32_t(uint32_t)> find = [&alias, &find](uint32_t regId) {
+        auto itr = alias.find(regId);
+        return itr == alias.end() ? regId : (itr->second = find(itr->second));
+    };
+    std::stable_sort(affinities.begin(), affinities.end(),
+            [](const Affinity &x, const Affinity &y) { return x.weight > y.weight; });
+    int coalescedCount = 0;
+    for (auto &affinity : affinities) {
+        uint32_t a = find(affinity.a);
+        uint32_t b = find(affinity.b);
+        if (a == b || graph.find(a) == graph.end() || graph.find(b) == graph.end() ||
+                isRegFloat(a) != isRegFloat(b) || graph[a].count(b) != 0) {
+
+            continue;
+        }
+
+        // The merged register must avoid what either one had to avoid.
+        std::set<uint32_t> clobbered = callClobbers[a];
+        clobbered.insert(callClobbers[b].begin(), callClobbers[b].end());
+        size_t k = paletteFor(a).size();
+        for (uint32_t phy : clobbered) {
+            k -= paletteFor(a).count(phy);
+        }
+        std::set<uint32_t> neighbors = graph[a];
+        neighbors.insert(graph[b].begin(), graph[b].end());
+        size_t significantCount = 0;
+        for (uint32_t n : neighbors) {
+            size_t degree = graph[n].size() - (graph[a].count(n) != 0 && graph[b].count(n) != 0 ? 1 : 0);
+            if (degree >= colorCount(n)) {
+                significantCount++;
+            }
+        }
+        if (significantCount >= k) {
+            continue;
+        }
+
+        // Merge b into a.
+        alias[b] = a;
+        callClobbers[a] = clobbered;
+        if (callHints.find(a) == callHints.end() && callHints.find(b) != callHints.end()) {
+            callHints[a] = callHints[b];
+        }
+        for (uint32_t n : graph[b]) {
+            graph[n].erase(b);
+            graph[n].insert(a);
+            graph[a].insert(n);
+        }
+        graph.erase(b);
+        coalescedCount++;
+    }
+
+    // Simplify: repeatedly remove a register with fewer neighbors than
+    // colors. If there is none, optimistically remove the busiest one.
+    std::map<uint32_t,size_t> degree;
+    std::vector<uint32_t> lowDegree;
+    for (auto &[regId, neighbors] : graph) {
+        degree[regId] = neighbors.size();
+        if (neighbors.size() < colorCount(regId)) {
+            lowDegree.push_back(regId);
+        }
+    }
+    std::set<uint32_t> removed;
+    std::vector<uint32_t> stack;
+    while (stack.size() < graph.size()) {
+        uint32_t regId = NO_REGISTER;
+        while (!lowDegree.empty() && regId == NO_REGISTER) {
+            regId = lowDegree.back();
+            lowDegree.pop_back();
+            if (removed.find(regId) != removed.end()) {
+                regId = NO_REGISTER;
+            }
+        }
+        if (regId == NO_REGISTER) {
+            for (auto &[otherId, _] : graph) {
+                if (removed.find(otherId) == removed.end() &&
+                        (regId == NO_REGISTER || degree[otherId] > degree[regId])) {
+
+                    regId = otherId;
+                }
+            }
+        }
+
+        removed.insert(regId);
+        stack.push_back(regId);
+        for (uint32_t n : graph[regId]) {
+            if (removed.find(n) == removed.end() && degree[n]-- == colorCount(n)) {
+                lowDegree.push_back(n);
+            }
+        }
+    }
+
+    // Select: give each register the lowest color its neighbors don't have
+    // and no call it's live across overwrites. Prefer the register it's
+    // passed in to or returned from a call, to save a move.
+    while (!stack.empty()) {
+        uint32_t regId = stack.back();
+        stack.pop_back();
+
+        std::set<uint32_t> used = callClobbers[regId];
+        for (uint32_t n : graph[regId]) {
+            uint32_t phy = registers.at(n).phy;
+            if (phy != NO_REGISTER) {
+                used.insert(phy);
+            }
+        }
+
+        CompilerRegister &r = registers.at(regId);
+        auto hint = callHints.find(regId);
+        if (hint != callHints.end() && used.find(hint->second) == used.end() &&
+                paletteFor(regId).count(hint->second) != 0) {
+
+            r.phy = hint->second;
+        }
+        for (uint32_t phy : paletteFor(regId)) {
+            if (r.phy == NO_REGISTER && used.find(phy) == used.end()) {
+                r.phy = phy;
+                break;
+            }
+        }
+        if (r.phy == NO_REGISTER) {
+            // Optimistic removal didn't pay off. Undo the assignments so far,
+            // including the constants, so the function can be assigned again.
+            for (auto &[otherId, _] : graph) {
+                registers.at(otherId).phy = NO_REGISTER;
+            }
+            for (auto regId : entryLive) {
+                registers.erase(regId);
+            }
+            return false;
+        }
+    }
+
+    // Coalesced registers share their representative's register.
+    for (auto &[regId, _] : alias) {
+        registers.at(regId).phy = registers.at(find(regId)).phy;
+    }
+
+    if (pgm->verbose) {
+        std::cout << "    Coalesced " << coalescedCount << " of "
+            << affinities.size() << " copies.\n";
+    }
+
+    return true;
+}
+
+std::string Compiler::libraryRoutineFor(const Instruction *instruction) const {
+    // Must match the names used by the emit() methods.
+    std::ostringstream ss;
+    size_t argCount = instruction->argIdList.size();
+
+    switch (instruction->opcode()) {
+        case SpvOpFMod: ss << ".mod"; break;
+        case 0x10000 | GLSLstd450Sin: ss << ".sin"; break;
+        case 0x10000 | GLSLstd450Cos: ss << ".cos"; break;
+        case 0x10000 | GLSLstd450Atan2: ss << ".atan2"; break;
+        case 0x10000 | GLSLstd450Exp: ss << ".exp"; break;
+        case 0x10000 | GLSLstd450Exp2: ss << ".exp2"; break;
+        case 0x10000 | GLSLstd450Fract: ss << ".fract"; break;
+        case 0x10000 | GLSLstd450Floor: ss << ".floor"; break;
+        case 0x10000 | GLSLstd450Step: ss << ".step"; break;
+        case 0x10000 | GLSLstd450Pow: ss << ".pow"; break;
+        case 0x10000 | GLSLstd450Log: ss << ".log"; break;
+        case 0x10000 | GLSLstd450Log2: ss << ".log2"; break;
+        case 0x10000 | GLSLstd450FClamp: ss << ".clamp"; break;
+        case 0x10000 | GLSLstd450FMix: ss << ".mix"; break;
+        case 0x10000 | GLSLstd450SmoothStep: ss << ".smoothstep"; break;
+        case RiscVOpCross: ss << ".cross"; break;
+        case RiscVOpLength: ss << ".length" << argCount; break;
+        case RiscVOpReflect: ss << ".reflect" << instruction->resIdList.size(); break;
+        case RiscVOpNormalize: ss << ".normalize" << argCount; break;
+        case RiscVOpDistance: ss << ".distance" << argCount/2; break;
+        case RiscVOpDot: ss << ".dot" << argCount/2; break;
+        case RiscVOpAll: ss << ".all" << argCount; break;
+        case RiscVOpAny: ss << ".any" << argCount; break;
+    }
+
+    return ss.str();
+}
+
+std::vector<uint32_t> Compiler::callRegistersFor(const std::vector<uint32_t> &ids) const {
+    std::vector<uint32_t> phys;
+    uint32_t nextInt = LIBRARY_FIRST_INT_ARG;
+    uint32_t nextFloat = LIBRARY_FIRST_FLOAT_ARG;
+
+    for (uint32_t id : ids) {
+        // Constants might not have a register yet.
+        auto constant = pgm->constants.find(id);
+        bool isFloat = constant != pgm->constants.end()
+            ? pgm->isTypeFloat(constant->second.type)
+            : isRegFloat(id);
+        uint32_t &next = isFloat ? nextFloat : nextInt;
+        uint32_t first = isFloat ? LIBRARY_FIRST_FLOAT_ARG : LIBRARY_FIRST_INT_ARG;
+        if (next - first >= LIBRARY_ARG_REGISTER_COUNT) {
+            std::cerr << "Error: Too many " << (isFloat ? "float" : "int")
+                << " registers passed to library routine.\n";
+            exit(EXIT_FAILURE);
+        }
+        phys.push_back(next++);
+    }
+
+    return phys;
+}
+
+void Compiler::computeCallClobbers(const Function *function) {
+    callClobbers.clear();
+    callHints.clear();
+
+    for (auto &[_, block] : function->blocks) {
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            Instruction *instruction = inst.get();
+            std::string routine = libraryRoutineFor(instruction);
+            if (routine.empty()) {
+                continue;
+            }
+
+            auto itr = libraryClobbers.find(routine);
+            if (itr == libraryClobbers.end()) {
+                std::cerr << "Error: Library routine " << routine << " not found.\n";
+                exit(EXIT_FAILURE);
+            }
+
+            // The routine's own clobbers, plus the registers we pass and
+            // return values in, plus the return address.
+            std::set<uint32_t> clobbered = itr->second;
+            std::vector<uint32_t> argPhys = callRegistersFor(instruction->argIdList);
+            std::vector<uint32_t> resPhys = callRegistersFor(instruction->resIdList);
+            clobbered.insert(argPhys.begin(), argPhys.end());
+            clobbered.insert(resPhys.begin(), resPhys.end());
+            clobbered.insert(1);
+
+            for (uint32_t regId : instruction->liveout) {
+                if (instruction->resIdSet.find(regId) == instruction->resIdSet.end()) {
+                    callClobbers[regId].insert(clobbered.begin(), clobbered.end());
+                }
+            }
+
+            for (size_t i = 0; i < argPhys.size(); i++) {
+                callHints.insert({instruction->argIdList[i], argPhys[i]});
+            }
+            for (size_t i = 0; i < resPhys.size(); i++) {
+                callHints.insert({instruction->resIdList[i], resPhys[i]});
+            }
+        }
+    }
+}
+
+size_t Compiler::maxFloatsAcross(const Instruction *instruction) const {
+    std::string routine = libraryRoutineFor(instruction);
+    if (routine.empty()) {
+        return MAX_LIVE_FLOATS;
+    }
+
+    auto itr = libraryClobbers.find(routine);
+    if (itr == libraryClobbers.end()) {
+        std::cerr << "Error: Library routine " << routine << " not found.\n";
+        exit(EXIT_FAILURE);
+    }
+
+    // The routine's own float clobbers, plus the registers we pass and
+    // return floats in. Registers haven't been assigned yet, so go by type.
+    // Only count the MAX_LIVE_FLOATS registers that are allocated, f31 is
+    // never available.
+    std::set<uint32_t> clobbered;
+    for (uint32_t phy : itr->second) {
+        if (phy >= 32 && phy < 32 + MAX_LIVE_FLOATS) {
+            clobbered.insert(phy);
+        }
+    }
+    for (const std::vector<uint32_t> *ids : { &instruction->argIdList, &instruction->resIdList }) {
+        uint32_t nextFloat = LIBRARY_FIRST_FLOAT_ARG;
+        for (uint32_t id : *ids) {
+            if (pgm->isTypeFloat(pgm->typeIdOf(id))) {
+                clobbered.insert(nextFloat++);
+            }
+        }
+    }
+
+    return MAX_LIVE_FLOATS - clobbered.size();
+}
+
 uint32_t Compiler::physicalRegisterFor(uint32_t id, bool required) const {
     auto itr = registers.find(id);
     if (itr == registers.end()) {
@@ -662,15 +2022,36 @@ void Compiler::emitBinaryOp(const std::string &opName, int result, int op1, int
 }
 
 void Compiler::emitBinaryImmOp(const std::string &opName, int result, int op, uint32_t imm) {
+    // Immediates are sign-extended.
+    int32_t signedImm = imm;
     std::ostringstream ss1;
-    ss1 << opName << " " << reg(result) << ", " << reg(op) << ", " << imm;
+    ss1 << opName << " " << reg(result) << ", " << reg(op) << ", " << signedImm;
     std::ostringstream ss2;
-    ss2 << "r" << result << " = " << opName << " r" << op << " " << imm;
+    ss2 << "r" << result << " = " << opName << " r" << op << " " << signedImm;
     emit(ss1.str(), ss2.str());
 }
 
+void Compiler::emitLoadImmediate(const std::string &regName, uint32_t value,
+        const std::string &comment) {
+
+    int32_t signedValue = value;
+    std::ostringstream ss;
+    if (fitsInImmediate(value)) {
+        ss << "addi " << regName << ", x0, " << signedValue;
+        emit(ss.str(), comment);
+    } else {
+        ss << "lui " << regName << ", %hi(" << signedValue << ")";
+        emit(ss.str(), comment);
+        if ((value & 0xFFF) != 0) {
+            ss.str("");
+            ss << "addi " << regName << ", " << regName << ", %lo(" << signedValue << ")";
+            emit(ss.str(), "");
+        }
+    }
+}
+
 void Compiler::emitLabel(const std::string &label) {
-    outFile << notEmptyLabel(label) << ":\n";
+    assembly << notEmptyLabel(label) << ":\n";
 }
 
 std::string Compiler::notEmptyLabel(const std::string &label) const {
@@ -681,62 +2062,34 @@ void Compiler::emitCall(const std::string &functionName,
         const std::vector<uint32_t> resultIds,
         const std::vector<uint32_t> operandIds) {
 
-    // Push parameters.
-    {
-        std::ostringstream ss;
-        ss << "addi sp, sp, -" << 4*(operandIds.size() + 1);
-        emit(ss.str(), "Make room on stack");
-    }
-    {
-        std::ostringstream ss;
-        ss << "sw ra, " << 4*operandIds.size() << "(sp)";
-        emit(ss.str(), "Save return address");
+    if (libraryClobbers.find(functionName) == libraryClobbers.end()) {
+        std::cerr << "Error: Library routine " << functionName << " not found.\n";
+        exit(EXIT_FAILURE);
     }
 
-    for (int i = operandIds.size() - 1; i >= 0; i--) {
-        std::ostringstream ss;
-        uint32_t phy = asRegister(operandIds[i])->phy;
-        if (phy < 32) {
-            ss << "sw x" << phy << ", " << i*4 << "(sp)";
-        } else {
-            ss << "fsw f" << (phy - 32) << ", " << i*4 << "(sp)";
-        }
-        std::ostringstream ssc;
-        ssc << "Push parameter r" << operandIds[i];
-        emit(ss.str(), ssc.str());
+    // Move parameters into place.
+    std::vector<uint32_t> operandPhys = callRegistersFor(operandIds);
+    std::vector<PCopyPair> pairs;
+    for (size_t i = 0; i < operandIds.size(); i++) {
+        pairs.push_back({{physicalRegisterFor(operandIds[i], true)}, {operandPhys[i]}});
     }
+    emitParallelCopy(pairs, "Pass parameters");
 
-    // Call routines.
+    // Call routine. The prologue saved ra.
+    assert(savedReturnAddress);
     {
         std::ostringstream ss;
         ss << "jal ra, " << functionName;
         emit(ss.str(), "Call routine");
     }
 
-    // Pop parameters.
+    // Move results out.
+    std::vector<uint32_t> resultPhys = callRegistersFor(resultIds);
+    pairs.clear();
     for (size_t i = 0; i < resultIds.size(); i++) {
-        std::ostringstream ss;
-        uint32_t phy = asRegister(resultIds[i])->phy;
-        if (phy < 32) {
-            ss << "lw x" << phy << ", " << i*4 << "(sp)";
-        } else {
-            ss << "flw f" << (phy - 32) << ", " << i*4 << "(sp)";
-        }
-        std::ostringstream ssc;
-        ssc << "Pop result r" << resultIds[i];
-        emit(ss.str(), ssc.str());
-    }
-
-    {
-        std::ostringstream ss;
-        ss << "lw ra, " << 4*resultIds.size() << "(sp)";
-        emit(ss.str(), "Restore return address");
-    }
-    {
-        std::ostringstream ss;
-        ss << "addi sp, sp, " << 4*(resultIds.size() + 1);
-        emit(ss.str(), "Restore stack");
+        pairs.push_back({{resultPhys[i]}, {physicalRegisterFor(resultIds[i], true)}});
     }
+    emitParallelCopy(pairs, "Get results");
 }
 
 void Compiler::emitUniCall(const std::string &functionName, uint32_t resultId, uint32_t operandId) {
@@ -776,21 +2129,104 @@ void Compiler::emitTerCall(const std::string &functionName, uint32_t resultId,
     emitCall(functionName, resultIds, operandIds);
 }
 
+void Compiler::emitReturn() {
+    if (savedReturnAddress) {
+        emit("lw ra, 0(sp)", "Restore return address");
+        emit("addi sp, sp, 4", "Restore stack");
+    }
+    emit("jalr x0, ra, 0", "");
+}
+
 void Compiler::emit(const std::string &op, const std::string &comment) {
+    std::string mnemonic = op.substr(0, op.find(' '));
+    int cycles = instructionCycles(mnemonic);
+    emittedCycles += cycles;
+    if (mnemonic[0] != '.') {
+        emittedInstructions++;
+    }
+    if (!isExecutedByCore(mnemonic)) {
+        unexecutedCount++;
+    }
+
+    if (!writeAssembly) {
+        // Nobody will read it, skip the formatting.
+        assembly << op << "\n";
+        return;
+    }
+
     std::ios oldState(nullptr);
-    oldState.copyfmt(outFile);
+    oldState.copyfmt(assembly);
 
-    outFile
+    assembly
         << "        "
         << std::left
         << std::setw(30) << op
         << std::setw(0);
-    if(!comment.empty()) {
-        outFile << "; " << comment;
+    if (cycles > 0) {
+        assembly << "; [" << cycles << "]";
+        if(!comment.empty()) {
+            assembly << " " << comment;
+        }
+    } else if(!comment.empty()) {
+        assembly << "; " << comment;
     }
-    outFile << "\n";
+    assembly << "\n";
 
-    outFile.copyfmt(oldState);
+    assembly.copyfmt(oldState);
+}
+
+void Compiler::emitConditionalBranch(Instruction *instruction, std::string branchOp,
+        const std::string &rs1, const std::string &rs2, const std::string &comment,
+        uint32_t trueLabelId, uint32_t falseLabelId) {
+
+    static const std::map<std::string,std::string> INVERSE = {
+        { "beq", "bne" }, { "bne", "beq" }, { "blt", "bge" }, { "bge", "blt" },
+        { "bltu", "bgeu" }, { "bgeu", "bltu" },
+    };
+
+    // Make the false target the one we fall through to, if either.
+    std::string branchComment = comment;
+    std::string skipComment = "!(" + comment + ")";
+    if (trueLabelId == nextBlockId) {
+        branchOp = INVERSE.at(branchOp);
+        std::swap(trueLabelId, falseLabelId);
+        std::swap(branchComment, skipComment);
+    }
+
+    // Branch straight to the true target if nothing has to be copied on
+    // the way there.
+    if (shortBranches && !needsPhiCopy(instruction, trueLabelId)) {
+        std::ostringstream ss1;
+        ss1 << branchOp << " " << rs1 << ", " << rs2 << ", block" << trueLabelId;
+        emit(ss1.str(), branchComment);
+        emitPhiCopy(instruction, falseLabelId);
+        if (falseLabelId != nextBlockId) {
+            std::ostringstream ss2;
+            ss2 << "jal x0, block" << falseLabelId;
+            emit(ss2.str(), "");
+        }
+        return;
+    }
+
+    std::string localLabel = makeLocalLabel();
+
+    // Skip the true path if the comparison fails.
+    std::ostringstream ss1;
+    ss1 << INVERSE.at(branchOp) << " " << rs1 << ", " << rs2 << ", " << localLabel;
+    emit(ss1.str(), skipComment);
+    // True path.
+    emitPhiCopy(instruction, trueLabelId);
+    std::ostringstream ss2;
+    ss2 << "jal x0, block" << trueLabelId;
+    emit(ss2.str(), "");
+    // False path.
+    emitLabel(localLabel);
+    emitPhiCopy(instruction, falseLabelId);
+    if (falseLabelId != nextBlockId) {
+        std::ostringstream ss3;
+        ss3 << "jal x0, block" << falseLabelId;
+        emit(ss3.str(), "");
+    }
 }
 
 void Compiler::emitPhiCopy(Instruction *instruction, uint32_t blockId) {
@@ -821,7 +2257,6 @@ void Compiler::emitPhiCopy(Instruction *instruction, uint32_t blockId) {
 
     // Compute parallel copy steps.
     std::vector<PCopyPair> pairs;
-    std::vector<PCopyInstruction> instructions;
 
     // Set up our pairs.
     for (size_t resultIndex = 0; resultIndex < phi->resultIds.size(); resultIndex++) {
@@ -833,6 +2268,33 @@ void Compiler::emitPhiCopy(Instruction *instruction, uint32_t blockId) {
         pairs.push_back({{sourceReg}, {destReg}});
     }
 
+    emitParallelCopy(pairs, "Phi elimination");
+}
+
+bool Compiler::needsPhiCopy(Instruction *instruction, uint32_t blockId) {
+    Function *function = instruction->list->block->function;
+    Instruction *firstInstruction = function->blocks.at(blockId)->instructions.head.get();
+    if (firstInstruction->opcode() != RiscVOpPhi) {
+        return false;
+    }
+    RiscVPhi *phi = dynamic_cast<RiscVPhi *>(firstInstruction);
+
+    // Copies between the same physical register aren't emitted.
+    int labelIndex = phi->getLabelIndexForSource(instruction->blockId());
+    for (size_t resultIndex = 0; resultIndex < phi->resultIds.size(); resultIndex++) {
+        uint32_t destId = phi->resultIds[resultIndex];
+        uint32_t sourceId = phi->operandIds[resultIndex][labelIndex];
+        if (physicalRegisterFor(destId, true) != physicalRegisterFor(sourceId, true)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Compiler::emitParallelCopy(const std::vector<PCopyPair> &pairs, const std::string &description) {
+    std::vector<PCopyInstruction> instructions;
+
     // Compute necessary instructions.
     parallel_copy(pairs, instructions);
 
@@ -842,7 +2304,7 @@ void Compiler::emitPhiCopy(Instruction *instruction, uint32_t blockId) {
             case PCOPY_OP_MOVE: {
                 uint32_t sourceReg = instruction.mPair.mSource.mRegister;
                 uint32_t destReg = instruction.mPair.mDestination.mRegister;
-                emitCopyRegister(destReg, sourceReg, "Phi elimination (move)");
+                emitCopyRegister(destReg, sourceReg, description + " (move)");
                 break;
             }
 
@@ -854,7 +2316,7 @@ void Compiler::emitPhiCopy(Instruction *instruction, uint32_t blockId) {
                     {
                         std::ostringstream ss;
                         ss << "xor x" << destReg << ", x" << sourceReg << ", x" << destReg;
-                        emit(ss.str(), "Phi elimination (swap)");
+                        emit(ss.str(), description + " (swap)");
                     }
                     {
                         std::ostringstream ss;
@@ -876,7 +2338,7 @@ void Compiler::emitPhiCopy(Instruction *instruction, uint32_t blockId) {
                     {
                         std::ostringstream ss;
                         ss << "fsgnj.s f" << tmpReg << ", f" << sourceReg << ", f" << sourceReg;
-                        emit(ss.str(), "Phi elimination (swap)");
+                        emit(ss.str(), description + " (swap)");
                     }
                     {
                         std::ostringstream ss;
@@ -2,7 +2,22 @@
 #define COMPILER_H
 
 #include <fstream>
+#include <sstream>
 #include "program.h"
+#include "library.h"
+#include "pcopy.h"
+
+// Data within this many bytes of address 0 can be loaded and stored with a
+// single x0-relative instruction.
+static const uint32_t SMALL_DATA_SIZE = 2048;
+
+// Largest variable or constant that we put in the small-data area. Bigger
+// ones are tables that are indexed through a register anyway.
+static const uint32_t SMALL_DATA_MAX_OBJECT_SIZE = 64;
+
+// Conditional branches reach this many bytes either way. Functions whose
+// code is smaller can branch straight to any of their blocks.
+static const int CONDITIONAL_BRANCH_RANGE = 4096;
 
 // Virtual register used by the compiler.
 struct CompilerRegister {
@@ -51,31 +66,157 @@ struct Compiler {
     // entry here if the register participates in a phi instruction.
     std::map<uint32_t,std::shared_ptr<PhiClass>> phiClassMap;
 
+    // Assembly text of the whole program, built up as we emit it.
+    std::ostringstream assembly;
+
+    // Where we write the output, and whether it's the assembly text rather
+    // than an object file.
+    std::string outputPathname;
     std::ofstream outFile;
+    bool writeAssembly;
+
+    // Use the original greedy register allocator instead of graph coloring.
+    bool useGreedyAllocator;
+
+    // Reorder instructions within blocks to hide float latencies.
+    bool useScheduler;
+
+    // Directory that library.s and library.o are read from.
+    std::string libraryDirectory;
+
+    // Registers that each library routine may modify, from library.s.
+    LibraryClobberMap libraryClobbers;
+
+    // Map from virtual register to the physical registers it can't use
+    // because it's live across a library call that modifies them.
+    std::map<uint32_t,std::set<uint32_t>> callClobbers;
+
+    // Map from virtual register to the physical register it's passed in
+    // or returned in by a library call, if we'd like to allocate it there.
+    std::map<uint32_t,uint32_t> callHints;
+
+    // Whether the function being emitted saved ra on the stack.
+    bool savedReturnAddress;
+
+    // Block that will be emitted after the current one, or NO_BLOCK_ID.
+    // Branches to it fall through instead of jumping.
+    uint32_t nextBlockId;
 
-    Compiler(Program *pgm, const std::string &outputAssemblyPathname)
+    // Cycles of the instructions emitted since this was last reset, as the
+    // core spends them (see instructionCycles()).
+    int emittedCycles;
+
+    // Number of instructions emitted for the current function.
+    int emittedInstructions;
+
+    // Whether every conditional branch in the current function can reach
+    // any block in it, so doesn't need to skip over a jal.
+    bool shortBranches;
+
+    // Number of instructions emitted for the current function that the
+    // core doesn't execute (see isExecutedByCore()).
+    int unexecutedCount;
+
+    // Estimated number of times each block runs per call of its function.
+    std::map<uint32_t,double> blockExecutions;
+
+    // IDs of variables and constants in the order they're laid out in
+    // the data segment. The first smallDataCount are in the small-data area.
+    std::vector<uint32_t> dataLayout;
+    size_t smallDataCount;
+
+    // Labels of the variables and constants outside the small-data area.
+    // These are addressed by loading their upper bits into gp, which isn't
+    // allocated if any are used.
+    std::set<std::string> farData;
+    bool reserveGp;
+
+    // Constants that are stored share one word per bit pattern. Map from
+    // each stored constant to the one whose label it's loaded from.
+    std::map<uint32_t,uint32_t> sharedConstant;
+
+    // The output is assembly text if the pathname ends in ".s", otherwise
+    // it's assembled to an object file. The text is assembled too, to an
+    // object and a listing with the same base name.
+    Compiler(Program *pgm, const std::string &outputPathname)
         : pgm(pgm),
           localLabelCounter(1),
-          outFile(outputAssemblyPathname, std::ios::out)
+          outputPathname(outputPathname),
+          outFile(outputPathname, std::ios::out | std::ios::binary),
+          writeAssembly(outputPathname.size() >= 2 &&
+                  outputPathname.compare(outputPathname.size() - 2, 2, ".s") == 0),
+          useGreedyAllocator(false),
+          useScheduler(false),
+          libraryDirectory("."),
+          savedReturnAddress(false),
+          nextBlockId(NO_BLOCK_ID),
+          emittedCycles(0),
+          emittedInstructions(0),
+          shortBranches(true),
+          unexecutedCount(0),
+          smallDataCount(0),
+          reserveGp(false)
     {
         if (!outFile.good()) {
-            std::cerr << "Can't open file \"" << outputAssemblyPathname << "\".\n";
+            std::cerr << "Can't open file \"" << outputPathname << "\".\n";
             exit(EXIT_FAILURE);
         }
     }
 
     void compile();
     void emitInstructions();
-    void emitInstructionsForFunction(Function *function);
-    void emitInstructionsForBlockTree(Block *block);
+    // Returns the summary of its estimated cycles.
+    std::string emitInstructionsForFunction(Function *function);
     void emitInstructionsForBlock(Block *block);
-    void emitVariables();
-    void emitConstants();
+
+    // Order the function's reachable blocks to maximize fall-through,
+    // favoring edges in loops. The start block is first.
+    std::vector<Block *> computeBlockOrder(const Function *function) const;
+
+    // Order variables and constants by static use count and fill the
+    // small-data area with the most used ones, after the library's own
+    // small data. Variables that the library accesses with x0-relative
+    // offsets are always in it.
+    void layOutData(uint32_t librarySmallDataEnd, const std::set<std::string> &libraryExternals);
+
+    // Emit the variables and constants from dataLayout[begin] to dataLayout[end - 1].
+    void emitData(size_t begin, size_t end);
     void emitLibrary();
 
+    // Pathname of the library file "filename" in libraryDirectory.
+    std::string libraryPathname(const std::string &filename) const;
+
+    // Size in bytes of the variable or constant.
+    uint32_t getDataSize(uint32_t id) const;
+
+    // Return the operand that addresses the label plus offset in a load or
+    // store, such as "color+4(x0)". Labels outside the small-data area get
+    // a "lui gp" emitted first and return "%lo(...)(gp)".
+    std::string dataOperand(const std::string &label, uint32_t offset);
+
     // Emit constant value for the specified constant ID.
     void emitConstant(uint32_t id, uint32_t typeId, unsigned char *data);
 
+    // If the constant is a scalar, returns the word that stores it in
+    // "word" and returns true. Otherwise returns false.
+    bool asConstantWord(uint32_t id, uint32_t &word) const;
+
+    // Whether emitLoadConstant() builds the constant in a register rather
+    // than loading it. Floats other than zero need an integer scratch
+    // register, must fit in a single lui, and are only built when that's
+    // faster than loading them (see instructionCycles()).
+    bool canBuildConstant(uint32_t id, bool haveScratch) const;
+
+    // Put the constant in the register, building it if possible. The scratch
+    // register may be empty.
+    void emitLoadConstant(const std::string &regName, bool isFloat, uint32_t id,
+            const std::string &scratch, const std::string &comment);
+
+    // Whether an integer register is sure to be free while the instruction
+    // runs, whatever the allocator does, and which one it was given.
+    bool hasScratchRegister(const Instruction *instruction) const;
+    std::string findScratchRegister(const Instruction *instruction) const;
+
     // If the virtual register "id" points to an integer constant, returns it
     // in "value" and returns true. Otherwise returns false and leaves value
     // untouched.
@@ -89,11 +230,34 @@ struct Compiler {
     // the SPIR-V file, a unique name is generated based on the ID.
     std::string getVariableName(uint32_t id) const;
 
+    // Return the name of the constant with the specified ID, which is
+    // generated based on the ID if the SPIR-V file didn't name it. Constants
+    // that share storage have the name of the stored one.
+    std::string getConstantName(uint32_t id) const;
+
     // Make a new label that can be used for local jumps.
     std::string makeLocalLabel();
 
-    // Transform SPIR-V instructions to RISC-V instructions.
-    void transformInstructions(InstructionList &inList);
+    // Select RISC-V instructions for SPIR-V ones: adds and compares with
+    // small constants use immediates, compares that feed a conditional
+    // branch become compare-and-branch, and access chains with constant
+    // indices are folded into the loads and stores that use them. Runs
+    // before liveness analysis.
+    void transformInstructions(Function *function);
+
+    // Reorder the instructions of each block so that independent ones fill
+    // the latency of float operations (see machine.h), without making more
+    // registers live than we have. Phis, library calls, and branches stay
+    // in place. Needs liveness and recomputes it. Prints the estimated
+    // stall cycles saved.
+    void scheduleInstructions(Function *function);
+
+    // Whether the instruction must stay in place when scheduling.
+    bool isSchedulingBarrier(const Instruction *instruction) const;
+
+    // Estimated cycles spent waiting for operands if the instructions are
+    // issued in this order, one per cycle.
+    static int estimateStallCycles(const std::vector<Instruction *> &instructions);
 
     // Get rid of phi instructions.
     void translateOutOfSsa();
@@ -123,6 +287,30 @@ struct Compiler {
             const std::set<uint32_t> &allIntPhy,
             const std::set<uint32_t> &allFloatPhy);
 
+    // Assigns registers for this function by coloring its interference graph,
+    // after coalescing copy- and phi-related registers that don't interfere.
+    // Returns false, with no registers assigned, if it runs out of colors.
+    bool assignRegistersByColoring(const Function *function,
+            const std::set<uint32_t> &allIntPhy,
+            const std::set<uint32_t> &allFloatPhy);
+
+    // Return the name of the library routine that the instruction calls, or
+    // an empty string if it's not implemented by a call.
+    std::string libraryRoutineFor(const Instruction *instruction) const;
+
+    // Return the physical register that each of the virtual registers is
+    // passed in when calling a library routine.
+    std::vector<uint32_t> callRegistersFor(const std::vector<uint32_t> &ids) const;
+
+    // Fill callClobbers and callHints for the library calls in this function.
+    void computeCallClobbers(const Function *function);
+
+    // Most floats that can be live across the instruction and still be
+    // allocated: the float registers that the library call it makes doesn't
+    // modify (see computeCallClobbers()), or MAX_LIVE_FLOATS if it's not a
+    // call.
+    size_t maxFloatsAcross(const Instruction *instruction) const;
+
     // Return the physical register for the virtual register, or NO_REGISTER
     // if it hasn't been assigned yet. If required, the program fails if
     // the ID has no physical register.
@@ -144,15 +332,26 @@ struct Compiler {
     void emitUnaryOp(const std::string &opName, int result, int op);
     void emitBinaryOp(const std::string &opName, int result, int op1, int op2);
     void emitBinaryImmOp(const std::string &opName, int result, int op, uint32_t imm);
+
+    // Build an integer in the register with addi, or lui and addi if it
+    // doesn't fit in 12 bits.
+    void emitLoadImmediate(const std::string &regName, uint32_t value, const std::string &comment);
     void emitLabel(const std::string &label);
     void emitCopyVariable(uint32_t dst, uint32_t src, const std::string &comment);
     void emitCopyRegister(uint32_t dst, uint32_t src, const std::string &comment);
 
+    // Emit moves and swaps that copy physical registers as if in parallel.
+    void emitParallelCopy(const std::vector<PCopyPair> &pairs, const std::string &description);
+
+    // Emit a return from the function being emitted.
+    void emitReturn();
+
     // Return the label passed in, unless it's an empty string, in which case
     // it returns an appropriate non-empty string.
     std::string notEmptyLabel(const std::string &label) const;
 
-    // Emit a call to a floating-point routine.
+    // Emit a call to a library routine. Operands are copied to a0/fa0 and up,
+    // results are copied back from the same registers.
     void emitCall(const std::string &functionName,
             const std::vector<uint32_t> resultIds,
             const std::vector<uint32_t> operandIds);
@@ -170,10 +369,23 @@ struct Compiler {
 
     void emit(const std::string &op, const std::string &comment);
 
+    // Emit a two-way branch: to trueLabelId if "branchOp rs1, rs2" would
+    // branch, otherwise to falseLabelId, with phi copies on each path.
+    // The conditional branch goes to the true target if shortBranches and
+    // it has no phi copies, otherwise it skips over a jal to it. The jump
+    // to the next block is left out, inverting the condition if that's the
+    // true target.
+    void emitConditionalBranch(Instruction *instruction, std::string branchOp,
+            const std::string &rs1, const std::string &rs2, const std::string &comment,
+            uint32_t trueLabelId, uint32_t falseLabelId);
+
     // Just before a Branch or BranchConditional instruction, copy any
     // registers that a target OpPhi instruction might need. Instruction
     // is the branch; labelId is the target whose block has a phi.
     void emitPhiCopy(Instruction *instruction, uint32_t labelId);
+
+    // Whether emitPhiCopy() would emit anything.
+    bool needsPhiCopy(Instruction *instruction, uint32_t labelId);
 };
 
 #endif // COMPILER_H
@@ -12,6 +12,7 @@
 #include <atomic>
 #include "risc-v.h"
 #include "emu.h"
+#include "library.h"
 #include "timer.h"
 #include "disassemble.h"
 
@@ -265,6 +266,9 @@ struct CoreParameters
 
     uint32_t initialPC;
 
+    // Registers each library routine may change, for "--test".
+    LibraryClobberMap libraryClobbers;
+
     int imageWidth;
     int imageHeight;
     float frameTime;
@@ -482,13 +486,6 @@ static float runMathFunction(GPUEmuDebugOptions *debugOptions, CoreParameters *t
     // Set up the stack.
     core.regs.x[2] = RiscVInitialStackPointer;
 
-    // Push parameters in reverse order.
-    for (auto itr = params.rbegin(); itr != params.rend(); ++itr) {
-        float param = *itr;
-        core.regs.x[2] -= 4;
-        data_memory.writef(core.regs.x[2], param);
-    }
-
     // Set RA to catch final return.
     core.regs.x[1] = 0xfffffffe;
 
@@ -500,6 +497,11 @@ static float runMathFunction(GPUEmuDebugOptions *debugOptions, CoreParameters *t
         core.regs.f[i] = i*i*i + 123;
     }
 
+    // Parameters go in fa0 and up.
+    for (size_t i = 0; i < params.size(); i++) {
+        core.regs.f[LIBRARY_FIRST_FLOAT_ARG - 32 + i] = params[i];
+    }
+
     GPUCore::Registers oldRegs;
     try {
         do {
@@ -532,20 +534,28 @@ static float runMathFunction(GPUEmuDebugOptions *debugOptions, CoreParameters *t
         exit(EXIT_FAILURE);
     }
 
-    // Check registers so we can see which ones aren't being saved.
+    // Check registers so we can see which ones are changed without being
+    // in the routine's clobber set. The arguments and result registers
+    // belong to the caller anyway.
+    std::set<uint32_t> clobbers = tmpl->libraryClobbers[funcName];
+    for (size_t i = 0; i < std::max(params.size(), size_t(1)); i++) {
+        clobbers.insert(LIBRARY_FIRST_FLOAT_ARG + i);
+    }
+    if (core.regs.x[2] != RiscVInitialStackPointer) {
+        std::cerr << "Error: Stack pointer isn't restored in " << funcName << "\n";
+    }
     for (unsigned int i = 3; i < 32; i++) {
-        if (core.regs.x[i] != i*i*i) {
-            std::cerr << "Error: Register x" << i << " isn't being saved in " << funcName << "\n";
+        if (core.regs.x[i] != i*i*i && clobbers.find(i) == clobbers.end()) {
+            std::cerr << "Error: Register x" << i << " isn't in the clobber set of " << funcName << "\n";
         }
     }
     for (unsigned int i = 0; i < 32; i++) {
-        if (core.regs.f[i] != i*i*i + 123) {
-            std::cerr << "Error: Register f" << i << " isn't being saved in " << funcName << "\n";
+        if (core.regs.f[i] != i*i*i + 123 && clobbers.find(32 + i) == clobbers.end()) {
+            std::cerr << "Error: Register f" << i << " isn't in the clobber set of " << funcName << "\n";
         }
     }
 
-    // Pop result off the stack.
-    return data_memory.readf(core.regs.x[2]);
+    return core.regs.f[LIBRARY_FIRST_FLOAT_ARG - 32];
 }
 
 /**
@@ -617,9 +627,11 @@ static void tryTernaryFunction(GPUEmuDebugOptions *debugOptions, CoreParameters
  * Run a set of regression tests on our standard library. To run this,
  * first assemble the library:
  *
- *     % ./as library.s
+ *     % ./as -r library.s
  *     % ./emu --test library.o
  *
+ * The library source (library.s) must be next to the object file, it's
+ * used to compute each routine's clobber set.
  */
 static void runLibraryTest(GPUEmuDebugOptions *debugOptions, CoreParameters *tmpl) {
     int errors = 0;
@@ -839,6 +851,12 @@ int main(int argc, char **argv)
     tmpl.data_bytes.resize(RiscVInitialStackPointer);
 
     if (runTest) {
+        std::string sourcePathname = argv[0];
+        size_t dot = sourcePathname.rfind('.');
+        if (dot != std::string::npos) {
+            sourcePathname = sourcePathname.substr(0, dot);
+        }
+        tmpl.libraryClobbers = loadLibraryClobbers(sourcePathname + ".s");
         runLibraryTest(&debugOptions, &tmpl);
         exit(EXIT_SUCCESS);
     }
@@ -218,33 +218,6 @@ struct GPUCore
     // void write16(uint32_t addr, uint16_t v);
     // void write32(uint32_t addr, uint32_t v);
 
-    template <class RWM>
-    float pop32(RWM& data_memory)
-    {
-        float v = data_memory.read32(regs.x[2]);
-        regs.x[2] += 4;
-        return v;
-    };
-    template <class RWM>
-    void push32(RWM& data_memory, uint32_t f)
-    {
-        regs.x[2] -= 4;
-        data_memory.write32(regs.x[2], f);
-    };
-    template <class RWM>
-    float popf(RWM& data_memory)
-    {
-        float v = data_memory.readf(regs.x[2]);
-        regs.x[2] += 4;
-        return v;
-    };
-    template <class RWM>
-    void pushf(RWM& data_memory, float f)
-    {
-        regs.x[2] -= 4;
-        data_memory.writef(regs.x[2], f);
-    };
-    
     void unimpl(uint32_t insn, Status& status)
     {
         std::cerr << "unimplemented instruction " << std::hex << std::setfill('0') << std::setw(8) << insn;
@@ -404,6 +377,51 @@ GPUCore::Status GPUCore::step(ROM& text_memory, RWM& data_memory, RWM& sdram)
             break;
         }
 
+        CASE_MAKE_OPCODE_ALL_FUNCT3(0x11, 3)
+        {
+            if(dump) std::cout << "fmsub\n";
+            if(makeInstructionHistogram) { instructionHistogram["fmsub"]++; }
+            if(fmt == 0x0) { // size = .s
+                setrm(rm);
+                regs.f[rd] = regs.f[rs1] * regs.f[rs2] - regs.f[rs3];
+                restorerm();
+            } else {
+                unimpl(insn, status);
+            }
+            regs.pc += 4;
+            break;
+        }
+
+        CASE_MAKE_OPCODE_ALL_FUNCT3(0x12, 3)
+        {
+            if(dump) std::cout << "fnmsub\n";
+            if(makeInstructionHistogram) { instructionHistogram["fnmsub"]++; }
+            if(fmt == 0x0) { // size = .s
+                setrm(rm);
+                regs.f[rd] = -(regs.f[rs1] * regs.f[rs2]) + regs.f[rs3];
+                restorerm();
+            } else {
+                unimpl(insn, status);
+            }
+            regs.pc += 4;
+            break;
+        }
+
+        CASE_MAKE_OPCODE_ALL_FUNCT3(0x13, 3)
+        {
+            if(dump) std::cout << "fnmadd\n";
+            if(makeInstructionHistogram) { instructionHistogram["fnmadd"]++; }
+            if(fmt == 0x0) { // size = .s
+                setrm(rm);
+                regs.f[rd] = -(regs.f[rs1] * regs.f[rs2]) - regs.f[rs3];
+                restorerm();
+            } else {
+                unimpl(insn, status);
+            }
+            regs.pc += 4;
+            break;
+        }
+
         // fadd.s    rd rs1 rs2      31..27=0x00 rm       26..25=0 6..2=0x14 1..0=3
         // fmul.s    rd rs1 rs2      31..27=0x02 rm       26..25=0 6..2=0x14 1..0=3
         // fsub.s    rd rs1 rs2      31..27=0x01 rm       26..25=0 6..2=0x14 1..0=3
@@ -771,259 +789,261 @@ GPUCore::Status GPUCore::step(ROM& text_memory, RWM& data_memory, RWM& sdram)
                 if((funct3 == 0) && (rs1 == 0) && (immI == 0)) {
                     if(substFunctions.find(regs.pc) != substFunctions.end()) {
                         substitutedFunctions.insert(substFunctionNames[regs.pc]);
+                        // Arguments and results are in fa0 (f10) and up, or
+                        // a0 (x10) and up for booleans. See library.h.
                         switch(substFunctions[regs.pc]) {
                             case SUBST_SIN: {
-                                pushf(data_memory, sinf(popf(data_memory)));
+                                regs.f[10] = sinf(regs.f[10]);
                                 break;
                             }
                             case SUBST_ATAN: {
-                                pushf(data_memory, atanf(popf(data_memory)));
+                                regs.f[10] = atanf(regs.f[10]);
                                 break;
                             }
                             case SUBST_POW: {
-                                float x = popf(data_memory);
-                                float y = popf(data_memory);
-                                pushf(data_memory, powf(x, y));
+                                float x = regs.f[10];
+                                float y = regs.f[11];
+                                regs.f[10] = powf(x, y);
                                 break;
                             }
                             case SUBST_CLAMP: {
-                                float x = popf(data_memory);
-                                float minVal = popf(data_memory);
-                                float maxVal = popf(data_memory);
-                                pushf(data_memory, fclamp(x, minVal, maxVal));
+                                float x = regs.f[10];
+                                float minVal = regs.f[11];
+                                float maxVal = regs.f[12];
+                                regs.f[10] = fclamp(x, minVal, maxVal);
                                 break;
                             }
                             case SUBST_MIX: {
-                                float x = popf(data_memory);
-                                float y = popf(data_memory);
-                                float a = popf(data_memory);
-                                pushf(data_memory, fmix(x, y, a));
+                                float x = regs.f[10];
+                                float y = regs.f[11];
+                                float a = regs.f[12];
+                                regs.f[10] = fmix(x, y, a);
                                 break;
                             }
                             case SUBST_SMOOTHSTEP: {
-                                float edge0 = popf(data_memory);
-                                float edge1 = popf(data_memory);
-                                float x = popf(data_memory);
-                                pushf(data_memory, smoothstep(edge0, edge1, x));
+                                float edge0 = regs.f[10];
+                                float edge1 = regs.f[11];
+                                float x = regs.f[12];
+                                regs.f[10] = smoothstep(edge0, edge1, x);
                                 break;
                             }
                             case SUBST_COS: {
-                                pushf(data_memory, cosf(popf(data_memory)));
+                                regs.f[10] = cosf(regs.f[10]);
                                 break;
                             }
                             case SUBST_LOG2: {
-                                pushf(data_memory, log2f(popf(data_memory)));
+                                regs.f[10] = log2f(regs.f[10]);
                                 break;
                             }
                             case SUBST_EXP: {
-                                pushf(data_memory, expf(popf(data_memory)));
+                                regs.f[10] = expf(regs.f[10]);
                                 break;
                             }
                             case SUBST_MOD: {
-                                float x = popf(data_memory);
-                                float y = popf(data_memory);
+                                float x = regs.f[10];
+                                float y = regs.f[11];
                                 // fmodf() isn't right for us, it's the remainder after
                                 // rounding toward zero, but we need to floor.
                                 float q = floorf(x/y);
-                                pushf(data_memory, x - q*y);
+                                regs.f[10] = x - q*y;
                                 break;
                             }
                             case SUBST_INVERSESQRT: {
-                                pushf(data_memory, 1.0 / sqrtf(popf(data_memory)));
+                                regs.f[10] = 1.0 / sqrtf(regs.f[10]);
                                 break;
                             }
                             case SUBST_ASIN: {
-                                pushf(data_memory, asinf(popf(data_memory)));
+                                regs.f[10] = asinf(regs.f[10]);
                                 break;
                             }
                             case SUBST_LOG: {
-                                pushf(data_memory, logf(popf(data_memory)));
+                                regs.f[10] = logf(regs.f[10]);
                                 break;
                             }
                             case SUBST_ACOS: {
-                                pushf(data_memory, acosf(popf(data_memory)));
+                                regs.f[10] = acosf(regs.f[10]);
                                 break;
                             }
                             case SUBST_RADIANS: {
-                                pushf(data_memory, popf(data_memory) / 180.0 * M_PI);
+                                regs.f[10] = regs.f[10] / 180.0 * M_PI;
                                 break;
                             }
                             case SUBST_DEGREES: {
-                                pushf(data_memory, popf(data_memory) * 180.0 / M_PI);
+                                regs.f[10] = regs.f[10] * 180.0 / M_PI;
                                 break;
                             }
                             case SUBST_EXP2: {
-                                pushf(data_memory, exp2f(popf(data_memory)));
+                                regs.f[10] = exp2f(regs.f[10]);
                                 break;
                             }
                             case SUBST_TAN: {
-                                pushf(data_memory, tanf(popf(data_memory)));
+                                regs.f[10] = tanf(regs.f[10]);
                                 break;
                             }
                             case SUBST_ATAN2: {
-                                float y = popf(data_memory);
-                                float x = popf(data_memory);
-                                pushf(data_memory, atan2f(y, x));
+                                float y = regs.f[10];
+                                float x = regs.f[11];
+                                regs.f[10] = atan2f(y, x);
                                 break;
                             }
                             case SUBST_CROSS: {
                                 float v1[3], v2[3], cross[3];
-                                v1[0] = popf(data_memory);
-                                v1[1] = popf(data_memory);
-                                v1[2] = popf(data_memory);
-                                v2[0] = popf(data_memory);
-                                v2[1] = popf(data_memory);
-                                v2[2] = popf(data_memory);
+                                v1[0] = regs.f[10];
+                                v1[1] = regs.f[11];
+                                v1[2] = regs.f[12];
+                                v2[0] = regs.f[13];
+                                v2[1] = regs.f[14];
+                                v2[2] = regs.f[15];
                                 cross[0] = v1[1] * v2[2] - v2[1] * v1[2];
                                 cross[1] = v1[2] * v2[0] - v2[2] * v1[0];
                                 cross[2] = v1[0] * v2[1] - v2[0] * v1[1];
-                                pushf(data_memory, cross[2]);
-                                pushf(data_memory, cross[1]);
-                                pushf(data_memory, cross[0]);
+                                regs.f[12] = cross[2];
+                                regs.f[11] = cross[1];
+                                regs.f[10] = cross[0];
                                 break;
                             }
                             case SUBST_NORMALIZE1: {
-                                float x = popf(data_memory);
-                                pushf(data_memory, x < 0.0 ? -1.0f : 1.0f);
+                                float x = regs.f[10];
+                                regs.f[10] = x < 0.0 ? -1.0f : 1.0f;
                                 break;
                             }
                             case SUBST_NORMALIZE2: {
-                                float x = popf(data_memory);
-                                float y = popf(data_memory);
+                                float x = regs.f[10];
+                                float y = regs.f[11];
                                 float d = 1.0f / sqrtf(x * x + y * y);
-                                pushf(data_memory, y * d);
-                                pushf(data_memory, x * d);
+                                regs.f[11] = y * d;
+                                regs.f[10] = x * d;
                                 break;
                             }
                             case SUBST_NORMALIZE3: {
-                                float x = popf(data_memory);
-                                float y = popf(data_memory);
-                                float z = popf(data_memory);
+                                float x = regs.f[10];
+                                float y = regs.f[11];
+                                float z = regs.f[12];
                                 float d = 1.0f / sqrtf(x * x + y * y + z * z);
-                                pushf(data_memory, z * d);
-                                pushf(data_memory, y * d);
-                                pushf(data_memory, x * d);
+                                regs.f[12] = z * d;
+                                regs.f[11] = y * d;
+                                regs.f[10] = x * d;
                                 break;
                             }
                             case SUBST_NORMALIZE4: {
-                                float x = popf(data_memory);
-                                float y = popf(data_memory);
-                                float z = popf(data_memory);
-                                float w = popf(data_memory);
+                                float x = regs.f[10];
+                                float y = regs.f[11];
+                                float z = regs.f[12];
+                                float w = regs.f[13];
                                 float d = 1.0f / sqrtf(x * x + y * y + z * z + w * w);
-                                pushf(data_memory, w * d);
-                                pushf(data_memory, z * d);
-                                pushf(data_memory, y * d);
-                                pushf(data_memory, x * d);
+                                regs.f[13] = w * d;
+                                regs.f[12] = z * d;
+                                regs.f[11] = y * d;
+                                regs.f[10] = x * d;
                                 break;
                             }
                             case SUBST_FLOOR: {
-                                float f = popf(data_memory);
-                                pushf(data_memory, floorf(f));
+                                float f = regs.f[10];
+                                regs.f[10] = floorf(f);
                                 break;
                             }
                             case SUBST_DOT1: {
-                                float x1 = popf(data_memory);
-                                float x2 = popf(data_memory);
+                                float x1 = regs.f[10];
+                                float x2 = regs.f[11];
                                 float v = x1 * x2;
-                                pushf(data_memory, v);
+                                regs.f[10] = v;
                                 break;
                             }
                             case SUBST_DOT2: {
-                                float x1 = popf(data_memory);
-                                float y1 = popf(data_memory);
-                                float x2 = popf(data_memory);
-                                float y2 = popf(data_memory);
+                                float x1 = regs.f[10];
+                                float y1 = regs.f[11];
+                                float x2 = regs.f[12];
+                                float y2 = regs.f[13];
                                 float v = x1 * x2 + y1 * y2;
-                                pushf(data_memory, v);
+                                regs.f[10] = v;
                                 break;
                             }
                             case SUBST_DOT3: {
-                                float x1 = popf(data_memory);
-                                float y1 = popf(data_memory);
-                                float z1 = popf(data_memory);
-                                float x2 = popf(data_memory);
-                                float y2 = popf(data_memory);
-                                float z2 = popf(data_memory);
+                                float x1 = regs.f[10];
+                                float y1 = regs.f[11];
+                                float z1 = regs.f[12];
+                                float x2 = regs.f[13];
+                                float y2 = regs.f[14];
+                                float z2 = regs.f[15];
                                 float v = x1 * x2 + y1 * y2 + z1 * z2;
-                                pushf(data_memory, v);
+                                regs.f[10] = v;
                                 break;
                             }
                             case SUBST_DOT4: {
-                                float x1 = popf(data_memory);
-                                float y1 = popf(data_memory);
-                                float z1 = popf(data_memory);
-                                float w1 = popf(data_memory);
-                                float x2 = popf(data_memory);
-                                float y2 = popf(data_memory);
-                                float z2 = popf(data_memory);
-                                float w2 = popf(data_memory);
+                                float x1 = regs.f[10];
+                                float y1 = regs.f[11];
+                                float z1 = regs.f[12];
+                                float w1 = regs.f[13];
+                                float x2 = regs.f[14];
+                                float y2 = regs.f[15];
+                                float z2 = regs.f[16];
+                                float w2 = regs.f[17];
                                 float v = x1 * x2 + y1 * y2 + z1 * z2 + w1 * w2;
-                                pushf(data_memory, v);
+                                regs.f[10] = v;
                                 break;
                             }
                             case SUBST_ALL1: {
-                                uint32_t x = pop32(data_memory);
-                                push32(data_memory, x);
+                                uint32_t x = regs.x[10];
+                                regs.x[10] = x;
                                 break;
                             }
                             case SUBST_ALL2: {
-                                uint32_t x = pop32(data_memory);
-                                uint32_t y = pop32(data_memory);
-                                push32(data_memory, x && y);
+                                uint32_t x = regs.x[10];
+                                uint32_t y = regs.x[11];
+                                regs.x[10] = x && y;
                                 break;
                             }
                             case SUBST_ALL3: {
-                                uint32_t x = pop32(data_memory);
-                                uint32_t y = pop32(data_memory);
-                                uint32_t z = pop32(data_memory);
-                                push32(data_memory, x && y && z);
+                                uint32_t x = regs.x[10];
+                                uint32_t y = regs.x[11];
+                                uint32_t z = regs.x[12];
+                                regs.x[10] = x && y && z;
                                 break;
                             }
                             case SUBST_ALL4: {
-                                uint32_t x = pop32(data_memory);
-                                uint32_t y = pop32(data_memory);
-                                uint32_t z = pop32(data_memory);
-                                uint32_t w = pop32(data_memory);
-                                push32(data_memory, x && y && z && w);
+                                uint32_t x = regs.x[10];
+                                uint32_t y = regs.x[11];
+                                uint32_t z = regs.x[12];
+                                uint32_t w = regs.x[13];
+                                regs.x[10] = x && y && z && w;
                                 break;
                             }
                             case SUBST_ANY1: {
-                                uint32_t x = pop32(data_memory);
-                                push32(data_memory, x);
+                                uint32_t x = regs.x[10];
+                                regs.x[10] = x;
                                 break;
                             }
                             case SUBST_ANY2: {
-                                uint32_t x = pop32(data_memory);
-                                uint32_t y = pop32(data_memory);
-                                push32(data_memory, x || y);
+                                uint32_t x = regs.x[10];
+                                uint32_t y = regs.x[11];
+                                regs.x[10] = x || y;
                                 break;
                             }
                             case SUBST_ANY3: {
-                                uint32_t x = pop32(data_memory);
-                                uint32_t y = pop32(data_memory);
-                                uint32_t z = pop32(data_memory);
-                                push32(data_memory, x || y || z);
+                                uint32_t x = regs.x[10];
+                                uint32_t y = regs.x[11];
+                                uint32_t z = regs.x[12];
+                                regs.x[10] = x || y || z;
                                 break;
                             }
                             case SUBST_ANY4: {
-                                uint32_t x = pop32(data_memory);
-                                uint32_t y = pop32(data_memory);
-                                uint32_t z = pop32(data_memory);
-                                uint32_t w = pop32(data_memory);
-                                push32(data_memory, x || y || z || w);
+                                uint32_t x = regs.x[10];
+                                uint32_t y = regs.x[11];
+                                uint32_t z = regs.x[12];
+                                uint32_t w = regs.x[13];
+                                regs.x[10] = x || y || z || w;
                                 break;
                             }
                             case SUBST_STEP: {
-                                float edge = popf(data_memory);
-                                float x = popf(data_memory);
+                                float edge = regs.f[10];
+                                float x = regs.f[11];
                                 float y = (x < edge) ? 0.0f : 1.0f;
-                                pushf(data_memory, y);
+                                regs.f[10] = y;
                                 break;
                             }
                             case SUBST_FRACT: {
-                                float f = popf(data_memory);
-                                pushf(data_memory, f - floorf(f));
+                                float f = regs.f[10];
+                                regs.f[10] = f - floorf(f);
                                 break;
                             }
                             case SUBST_REFRACT1: {
@@ -1051,16 +1071,16 @@ GPUCore::Status GPUCore::step(ROM& text_memory, RWM& data_memory, RWM& sdram)
                                 break;
                             }
                             case SUBST_DISTANCE3: {
-                                float x1 = popf(data_memory);
-                                float y1 = popf(data_memory);
-                                float z1 = popf(data_memory);
-                                float x2 = popf(data_memory);
-                                float y2 = popf(data_memory);
-                                float z2 = popf(data_memory);
+                                float x1 = regs.f[10];
+                                float y1 = regs.f[11];
+                                float z1 = regs.f[12];
+                                float x2 = regs.f[13];
+                                float y2 = regs.f[14];
+                                float z2 = regs.f[15];
                                 float dx = x2 - x1;
                                 float dy = y2 - y1;
                                 float dz = z2 - z1;
-                                pushf(data_memory, sqrtf(dx*dx + dy*dy + dz*dz));
+                                regs.f[10] = sqrtf(dx*dx + dy*dy + dz*dz);
                                 break;
                             }
                             case SUBST_DISTANCE4: {
@@ -1076,19 +1096,19 @@ GPUCore::Status GPUCore::step(ROM& text_memory, RWM& data_memory, RWM& sdram)
                                 break;
                             }
                             case SUBST_REFLECT3: {
-                                float ix = popf(data_memory);
-                                float iy = popf(data_memory);
-                                float iz = popf(data_memory);
-                                float nx = popf(data_memory);
-                                float ny = popf(data_memory);
-                                float nz = popf(data_memory);
+                                float ix = regs.f[10];
+                                float iy = regs.f[11];
+                                float iz = regs.f[12];
+                                float nx = regs.f[13];
+                                float ny = regs.f[14];
+                                float nz = regs.f[15];
                                 float dot = ix*nx + iy*ny + iz*nz;
                                 float rx = ix - 2*dot*nx;
                                 float ry = iy - 2*dot*ny;
                                 float rz = iz - 2*dot*nz;
-                                pushf(data_memory, rx);
-                                pushf(data_memory, ry);
-                                pushf(data_memory, rz);
+                                regs.f[10] = rx;
+                                regs.f[11] = ry;
+                                regs.f[12] = rz;
                                 break;
                             }
                             case SUBST_REFLECT4: {
@@ -1112,32 +1132,32 @@ GPUCore::Status GPUCore::step(ROM& text_memory, RWM& data_memory, RWM& sdram)
                                 break;
                             }
                             case SUBST_LENGTH1: {
-                                float x = popf(data_memory);
-                                pushf(data_memory, fabsf(x));
+                                float x = regs.f[10];
+                                regs.f[10] = fabsf(x);
                                 break;
                             }
                             case SUBST_LENGTH2: {
-                                float x = popf(data_memory);
-                                float y = popf(data_memory);
+                                float x = regs.f[10];
+                                float y = regs.f[11];
                                 float d = sqrtf(x * x + y * y);
-                                pushf(data_memory, d);
+                                regs.f[10] = d;
                                 break;
                             }
                             case SUBST_LENGTH3: {
-                                float x = popf(data_memory);
-                                float y = popf(data_memory);
-                                float z = popf(data_memory);
+                                float x = regs.f[10];
+                                float y = regs.f[11];
+                                float z = regs.f[12];
                                 float d = sqrtf(x * x + y * y + z * z);
-                                pushf(data_memory, d);
+                                regs.f[10] = d;
                                 break;
                             }
                             case SUBST_LENGTH4: {
-                                float x = popf(data_memory);
-                                float y = popf(data_memory);
-                                float z = popf(data_memory);
-                                float w = popf(data_memory);
+                                float x = regs.f[10];
+                                float y = regs.f[11];
+                                float z = regs.f[12];
+                                float w = regs.f[13];
                                 float d = sqrtf(x * x + y * y + z * z + w * w);
-                                pushf(data_memory, d);
+                                regs.f[10] = d;
                                 break;
                             }
                         }
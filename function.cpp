@@ -1,5 +1,8 @@
 
 #include <iomanip>
+#include <algorithm>
+#include <functional>
+#include <cmath>
 
 #include "function.h"
 #include "program.h"
@@ -82,6 +85,9 @@ void Function::computeDomTree(bool verbose) {
     }
 
     // Compute immediate dom for each block.
+    for (auto& [_, block] : blocks) {
+        block->idomChildren.clear();
+    }
     for (auto& [blockId, block] : blocks) {
         block->idom = NO_BLOCK_ID;
 
@@ -123,75 +129,92 @@ void Function::computeDomTree(bool verbose) {
     }
 
     if (verbose) {
-        dumpBlockInfo();
-        dumpGraph(unreached);
-        dumpInstructions("after dom tree");
+        dumpBlockInfo(log);
+        dumpGraph(log, unreached);
+        dumpInstructions(log, "after dom tree");
     }
 }
 
-void Function::dumpBlockInfo() const {
-    std::cout << "----------------------- Block info\n";
+void Function::dumpBlockInfo(std::ostream &out) const {
+    out << "----------------------- Block info\n";
     for (auto& [blockId, block] : blocks) {
-        std::cout << "Block " << blockId << ":\n";
-        std::cout << "    Pred:";
+        out << "Block " << blockId << ":\n";
+        out << "    Pred:";
         for (auto blockId : block->pred) {
-            std::cout << " " << blockId;
+            out << " " << blockId;
         }
-        std::cout << "\n";
-        std::cout << "    Succ:";
+        out << "\n";
+        out << "    Succ:";
         for (auto blockId : block->succ) {
-            std::cout << " " << blockId;
+            out << " " << blockId;
         }
-        std::cout << "\n";
-        std::cout << "    Dom:";
+        out << "\n";
+        out << "    Dom:";
         for (auto blockId : block->dom) {
-            std::cout << " " << blockId;
+            out << " " << blockId;
         }
-        std::cout << "\n";
+        out << "\n";
         if (block->idom != NO_BLOCK_ID) {
-            std::cout << "    Immediate Dom: " << block->idom << "\n";
+            out << "    Immediate Dom: " << block->idom << "\n";
         }
     }
-    std::cout << "-----------------------\n";
+    out << "-----------------------\n";
 }
 
-void Function::dumpGraph(const std::set<uint32_t> &unreached) const {
+void Function::dumpGraph(std::ostream &out, const std::set<uint32_t> &unreached) const {
     // http://www.webgraphviz.com/
-    std::cout << "digraph CFG {\n  rankdir=TB;\n";
+    out << "digraph CFG {\n  rankdir=TB;\n";
     for (auto& [blockId, block] : blocks) {
         if (unreached.find(blockId) == unreached.end()) {
             for (auto pred : block->pred) {
                 // XXX this is laid out much better if the function's start
                 // block is mentioned first.
                 if (unreached.find(pred) == unreached.end()) {
-                    std::cout << "  \"" << pred << "\" -> \"" << blockId << "\"";
-                    std::cout << ";\n";
+                    out << "  \"" << pred << "\" -> \"" << blockId << "\"";
+                    out << ";\n";
                 }
             }
             if (block->idom != NO_BLOCK_ID) {
-                std::cout << "  \"" << blockId << "\" -> \"" << block->idom << "\"";
-                std::cout << " [color=\"0.000, 0.999, 0.999\"]";
-                std::cout << ";\n";
+                out << "  \"" << blockId << "\" -> \"" << block->idom << "\"";
+                out << " [color=\"0.000, 0.999, 0.999\"]";
+                out << ";\n";
             }
         }
     }
-    std::cout << "}\n";
-    std::cout << "-----------------------\n";
+    out << "}\n";
+    out << "-----------------------\n";
 }
 
-void Function::dumpInstructions(const std::string &description) const {
-    std::cout << "----------------------- Instruction info (" << description << ")\n";
-    std::cout << cleanName << ":\n";
+void Function::dumpInstructions(std::ostream &out, const std::string &description) const {
+    out << "----------------------- Instruction info (" << description << ")\n";
+    out << cleanName << ":\n";
     for (auto& [blockId, block] : blocks) {
-        std::cout << "Block " << blockId << ":\n";
+        out << "Block " << blockId << ":\n";
 
         for (auto instruction = block->instructions.head; instruction;
                 instruction = instruction->next) {
 
-            instruction->dump(std::cout);
+            instruction->dump(out);
         }
     }
-    std::cout << "-----------------------\n";
+    out << "-----------------------\n";
+}
+
+uint32_t Function::newId() {
+    // Only passes run by Program::runPerFunction() have a range.
+    assert(nextId < endId);
+    return nextId++;
+}
+
+uint32_t Function::newRegister(uint32_t typeId) {
+    uint32_t id = newId();
+    newResultTypes[id] = typeId;
+    return id;
+}
+
+bool Function::isVariable(uint32_t id) const {
+    return program->variables.find(id) != program->variables.end() ||
+        newVariables.find(id) != newVariables.end();
 }
 
 // From "The Design and Implementation of a SSA-based Register Allocator" by
@@ -205,7 +228,7 @@ void Function::phiLifting() {
         }
     }
 
-    /// dumpInstructions("after phi lifting");
+    /// dumpInstructions(log, "after phi lifting");
 }
 
 void Function::phiLiftingForBlock(Block *block, RiscVPhi *phi) {
@@ -217,9 +240,8 @@ void Function::phiLiftingForBlock(Block *block, RiscVPhi *phi) {
             uint32_t blockId = phi->labelIds.at(blockIndex);
 
             // Generate a new ID.
-            uint32_t newId = program->nextReg++;
             uint32_t type = program->typeIdOf(operandId);
-            program->resultTypes[newId] = type;
+            uint32_t newId = newRegister(type);
 
             // Replace the ID in the phi, in-place.
             phi->operandIds[res][blockIndex] = newId;
@@ -237,165 +259,1639 @@ void Function::phiLiftingForBlock(Block *block, RiscVPhi *phi) {
     phi->recomputeArgs();
 }
 
-void Function::ensureMaxRegisters() {
-    // Set of registers that have already been spilled, so we don't spill them
-    // again.
-    std::set<uint32_t> alreadySpilled;
-    uint32_t spilledRegId = NO_REGISTER;
+void Function::peepholeFloat(bool fastMath, bool fuseMultiplyAdd) {
+    // Map from register to the instruction that defines it.
+    std::map<uint32_t,std::shared_ptr<Instruction>> definition;
 
-    do {
-        computeLiveness(spilledRegId);
-        // dumpInstructions("After liveness");
-        spilledRegId = spillIfNecessary(alreadySpilled);
-        if (spilledRegId != NO_REGISTER) {
-            alreadySpilled.insert(spilledRegId);
+    // Number of times each register is used as an operand.
+    std::map<uint32_t,int> useCount;
+
+    auto computeUses = [this, &definition, &useCount]() {
+        definition.clear();
+        useCount.clear();
+        for (auto &[_, block] : blocks) {
+            for (auto inst = block->instructions.head; inst; inst = inst->next) {
+                for (uint32_t resId : inst->resIdList) {
+                    definition[resId] = inst;
+                }
+                for (uint32_t argId : inst->argIdList) {
+                    useCount[argId]++;
+                }
+            }
         }
-        // Keep going as long as we're spilling.
-    } while (spilledRegId != NO_REGISTER);
+    };
+
+    // Defining instruction if it has this opcode and the register is used only once.
+    auto singleUseDefinition = [&definition, &useCount](uint32_t regId,
+            uint32_t opcode) -> std::shared_ptr<Instruction> {
+
+        auto itr = definition.find(regId);
+        if (itr == definition.end() || itr->second->opcode() != opcode || useCount[regId] != 1) {
+            return nullptr;
+        }
+        return itr->second;
+    };
+
+    auto asFloatConstant = [this](uint32_t regId, float &value) {
+        auto itr = program->constants.find(regId);
+        if (itr == program->constants.end() ||
+                program->getTypeOp(itr->second.type) != SpvOpTypeFloat) {
+
+            return false;
+        }
+        value = *reinterpret_cast<float *>(itr->second.data);
+        return true;
+    };
+
+    // Put the new instructions where the old one was.
+    auto replace = [](std::shared_ptr<Instruction> inst,
+            const std::vector<std::shared_ptr<Instruction>> &newInsts) {
+
+        InstructionList *list = inst->list;
+        for (auto &newInst : newInsts) {
+            list->insert(newInst, inst);
+        }
+        list->erase(inst);
+    };
+
+    int simplifiedCount = 0;
+    int fusedCount = 0;
+
+    // Simplify.
+    computeUses();
+    for (auto &[_, block] : blocks) {
+        std::shared_ptr<Instruction> nextInst;
+        for (auto inst = block->instructions.head; inst; inst = nextInst) {
+            nextInst = inst->next;
+            const LineInfo &lineInfo = inst->lineInfo;
+
+            switch (inst->opcode()) {
+                case SpvOpFDiv: {
+                    // x/c = x*(1/c). That's exact when c is a power of two
+                    // whose reciprocal is a normal number.
+                    InsnFDiv *insn = dynamic_cast<InsnFDiv *>(inst.get());
+                    float divisor;
+                    if (asFloatConstant(insn->operand2Id(), divisor) && divisor != 0 &&
+                            std::isfinite(divisor)) {
+
+                        int exponent;
+                        float reciprocal = 1/divisor;
+                        bool isExact = std::fabs(std::frexp(divisor, &exponent)) == 0.5f &&
+                            std::isnormal(divisor) && std::isnormal(reciprocal);
+                        if (isExact || fastMath) {
+                            replace(inst, {std::make_shared<InsnFMul>(lineInfo, insn->type,
+                                        insn->resultId(), insn->operand1Id(),
+                                        program->getFloatConstant(insn->type, reciprocal))});
+                            simplifiedCount++;
+                        }
+                    }
+                    break;
+                }
+
+                case 0x10000 | GLSLstd450Pow: {
+                    // Small constant exponents don't need the library.
+                    InsnGLSLstd450Pow *insn = dynamic_cast<InsnGLSLstd450Pow *>(inst.get());
+                    uint32_t x = insn->xId();
+                    uint32_t type = insn->type;
+                    float exponent;
+                    if (!asFloatConstant(insn->yId(), exponent)) {
+                        break;
+                    }
+                    if (exponent == 1) {
+                        replace(inst, {std::make_shared<InsnCopyObject>(lineInfo, type, insn->resultId(), x)});
+                    } else if (exponent == 2) {
+                        replace(inst, {std::make_shared<InsnFMul>(lineInfo, type, insn->resultId(), x, x)});
+                    } else if (exponent == 3 || exponent == 4) {
+                        uint32_t squared = program->nextReg++;
+                        program->resultTypes[squared] = type;
+                        replace(inst, {
+                            std::make_shared<InsnFMul>(lineInfo, type, squared, x, x),
+                            std::make_shared<InsnFMul>(lineInfo, type, insn->resultId(),
+                                    squared, exponent == 3 ? x : squared)});
+                    } else if (exponent == 0.5) {
+                        replace(inst, {std::make_shared<InsnGLSLstd450Sqrt>(lineInfo, type, insn->resultId(), x)});
+                    } else {
+                        break;
+                    }
+                    simplifiedCount++;
+                    break;
+                }
+
+                case 0x10000 | GLSLstd450Sqrt: {
+                    // sqrt(x*x) = abs(x).
+                    InsnGLSLstd450Sqrt *insn = dynamic_cast<InsnGLSLstd450Sqrt *>(inst.get());
+                    auto itr = definition.find(insn->xId());
+                    if (itr != definition.end() && itr->second->opcode() == SpvOpFMul &&
+                            itr->second->argIdList[0] == itr->second->argIdList[1]) {
+
+                        std::shared_ptr<Instruction> mul = itr->second;
+                        replace(inst, {std::make_shared<InsnGLSLstd450FAbs>(lineInfo, insn->type,
+                                    insn->resultId(), mul->argIdList[0])});
+                        if (useCount[insn->xId()] == 1 && mul->list != nullptr) {
+                            mul->list->erase(mul);
+                        }
+                        simplifiedCount++;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    // Fuse a multiply into the add or subtract that uses it. The multiply
+    // must be used only there, and be in the same block so that we don't
+    // stretch its operands' live ranges across blocks. Only done when asked
+    // for, since the Verilog core doesn't execute the fused instructions.
+    if (fuseMultiplyAdd) {
+        computeUses();
+        for (auto &[_, block] : blocks) {
+            std::shared_ptr<Instruction> nextInst;
+            for (auto inst = block->instructions.head; inst; inst = nextInst) {
+                nextInst = inst->next;
+
+                uint32_t opcode = inst->opcode();
+                if (opcode != SpvOpFAdd && opcode != SpvOpFSub) {
+                    continue;
+                }
+
+                // Find a product (possibly negated) in the operand.
+                std::shared_ptr<Instruction> mul;
+                std::shared_ptr<Instruction> negate;
+                auto findProduct = [&](uint32_t regId) {
+                    mul = singleUseDefinition(regId, SpvOpFMul);
+                    negate = nullptr;
+                    if (!mul) {
+                        negate = singleUseDefinition(regId, SpvOpFNegate);
+                        if (negate) {
+                            mul = singleUseDefinition(negate->argIdList[0], SpvOpFMul);
+                            if (!mul || negate->list != inst->list) {
+                                negate = nullptr;
+                                mul = nullptr;
+                            }
+                        }
+                    }
+                    if (mul && mul->list != inst->list) {
+                        mul = nullptr;
+                        negate = nullptr;
+                    }
+                    return mul != nullptr;
+                };
+
+                uint32_t resultId = inst->resIdList[0];
+                uint32_t operand1Id = inst->argIdList[0];
+                uint32_t operand2Id = inst->argIdList[1];
+                uint32_t addId;
+                bool negateProduct;
+                bool negateAddend;
+                if (findProduct(operand1Id)) {
+                    // p + b, p - b
+                    addId = operand2Id;
+                    negateProduct = negate != nullptr;
+                    negateAddend = opcode == SpvOpFSub;
+                } else if (findProduct(operand2Id)) {
+                    // a + p, a - p
+                    addId = operand1Id;
+                    negateProduct = (negate != nullptr) != (opcode == SpvOpFSub);
+                    negateAddend = false;
+                } else {
+                    continue;
+                }
+
+                replace(inst, {std::make_shared<RiscVFmadd>(inst->lineInfo,
+                            program->typeIdOf(resultId), resultId,
+                            mul->argIdList[0], mul->argIdList[1], addId,
+                            negateProduct, negateAddend)});
+                mul->list->erase(mul);
+                if (negate) {
+                    negate->list->erase(negate);
+                }
+                fusedCount++;
+            }
+        }
+    }
+
+    if (program->verbose) {
+        std::cout << "Simplified " << simplifiedCount << " and fused " << fusedCount
+            << " float operations in function \"" << name << "\".\n";
+    }
 }
 
-int ___count = 0; // XXX
+std::vector<Loop> Function::findLoops() const {
+    // Find the natural loop of each back edge (an edge to a block that dominates
+    // its source), merging loops that share a header.
+    std::map<uint32_t,Loop> loops;
+    for (auto &[blockId, block] : blocks) {
+        for (uint32_t headerId : block->succ) {
+            if (block->isDominatedBy(headerId)) {
+                Loop &loop = loops[headerId];
+                loop.headerId = headerId;
+                loop.latchIds.insert(blockId);
+                std::set<uint32_t> &body = loop.blockIds;
+                body.insert(headerId);
+
+                // Everything that reaches the back edge without going through the header.
+                std::vector<uint32_t> worklist;
+                if (body.insert(blockId).second) {
+                    worklist.push_back(blockId);
+                }
+                while (!worklist.empty()) {
+                    uint32_t id = worklist.back();
+                    worklist.pop_back();
+                    for (uint32_t predId : blocks.at(id)->pred) {
+                        if (body.insert(predId).second) {
+                            worklist.push_back(predId);
+                        }
+                    }
+                }
+            }
+        }
+    }
 
-void Function::computeLiveness(uint32_t spilledRegId) {
-    Timer timer;
-    std::set<Instruction *> inst_worklist; // Instructions left to work on.
+    std::vector<Loop> result;
+    for (auto &[_, loop] : loops) {
+        result.push_back(loop);
+    }
+
+    return result;
+}
 
-    // Insert all instructions of all blocks.
+void Function::computeLoopDepth() {
+    for (auto &[_, block] : blocks) {
+        block->loopDepth = 0;
+    }
+
+    for (const Loop &loop : findLoops()) {
+        for (uint32_t blockId : loop.blockIds) {
+            blocks.at(blockId)->loopDepth++;
+        }
+    }
+}
+
+uint32_t Function::findPreheader(const Loop &loop) const {
+    uint32_t preheaderId = NO_BLOCK_ID;
+
+    for (uint32_t predId : blocks.at(loop.headerId)->pred) {
+        if (loop.blockIds.find(predId) == loop.blockIds.end()) {
+            if (preheaderId != NO_BLOCK_ID) {
+                return NO_BLOCK_ID;
+            }
+            preheaderId = predId;
+        }
+    }
+    if (preheaderId != NO_BLOCK_ID && blocks.at(preheaderId)->succ.size() != 1) {
+        return NO_BLOCK_ID;
+    }
+
+    return preheaderId;
+}
+
+size_t Function::loopFloatPressure(const Loop &loop) {
+    size_t pressure = 0;
+
+    for (uint32_t blockId : loop.blockIds) {
+        for (auto inst = blocks.at(blockId)->instructions.head; inst; inst = inst->next) {
+            std::set<uint32_t> liveInts;
+            std::set<uint32_t> liveFloats;
+            computeLiveSets(inst.get(), liveInts, liveFloats);
+            pressure = std::max(pressure, liveFloats.size());
+        }
+    }
+
+    return pressure;
+}
+
+// Whether the instruction only computes its results from its operands,
+// so it can be removed if they're unused or merged with an identical one.
+static bool isPureOperation(uint32_t opcode) {
+    if ((opcode & 0x10000) != 0) {
+        // GLSL.std.450 extended instructions.
+        return true;
+    }
+
+    switch (opcode) {
+        case SpvOpFAdd:
+        case SpvOpFSub:
+        case SpvOpFMul:
+        case SpvOpFDiv:
+        case SpvOpFMod:
+        case SpvOpFNegate:
+        case SpvOpIAdd:
+        case SpvOpISub:
+        case SpvOpIMul:
+        case SpvOpIEqual:
+        case SpvOpINotEqual:
+        case SpvOpSLessThan:
+        case SpvOpSLessThanEqual:
+        case SpvOpSGreaterThan:
+        case SpvOpSGreaterThanEqual:
+        case SpvOpFOrdEqual:
+        case SpvOpFOrdNotEqual:
+        case SpvOpFOrdLessThan:
+        case SpvOpFOrdLessThanEqual:
+        case SpvOpFOrdGreaterThan:
+        case SpvOpFOrdGreaterThanEqual:
+        case SpvOpLogicalNot:
+        case SpvOpLogicalAnd:
+        case SpvOpLogicalOr:
+        case SpvOpLogicalEqual:
+        case SpvOpLogicalNotEqual:
+        case SpvOpConvertSToF:
+        case SpvOpConvertFToS:
+        case SpvOpSelect:
+        case RiscVOpCross:
+        case RiscVOpLength:
+        case RiscVOpReflect:
+        case RiscVOpNormalize:
+        case RiscVOpDot:
+        case RiscVOpAll:
+        case RiscVOpAny:
+        case RiscVOpDistance:
+        case RiscVOpFmadd:
+        case RiscVOpFloorToInt:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+// Whether the order of the two operands doesn't matter.
+static bool isCommutative(uint32_t opcode) {
+    switch (opcode) {
+        case SpvOpFAdd:
+        case SpvOpFMul:
+        case SpvOpIAdd:
+        case SpvOpIMul:
+        case SpvOpIEqual:
+        case SpvOpINotEqual:
+        case SpvOpFOrdEqual:
+        case SpvOpFOrdNotEqual:
+        case SpvOpLogicalAnd:
+        case SpvOpLogicalOr:
+        case SpvOpLogicalEqual:
+        case SpvOpLogicalNotEqual:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+void Function::optimizeSsa() {
+    // Replace uses of registers in the map. Values in the map are never
+    // themselves keys.
+    auto renameArgs = [](Instruction *inst, const std::map<uint32_t,uint32_t> &newIds) {
+        if (inst->opcode() == RiscVOpPhi) {
+            RiscVPhi *phi = dynamic_cast<RiscVPhi *>(inst);
+            for (std::vector<uint32_t> &operandIds : phi->operandIds) {
+                for (uint32_t &operandId : operandIds) {
+                    auto itr = newIds.find(operandId);
+                    if (itr != newIds.end()) {
+                        operandId = itr->second;
+                    }
+                }
+            }
+            phi->recomputeArgs();
+        } else {
+            std::set<uint32_t> argIds = inst->argIdSet;
+            for (uint32_t argId : argIds) {
+                auto itr = newIds.find(argId);
+                if (itr != newIds.end()) {
+                    inst->changeArg(argId, itr->second);
+                }
+            }
+        }
+    };
+
+    // Copy propagation: use the source of each copy instead of its result.
+    // Scalarizing vectors leaves a copy for every extracted component.
+    std::map<uint32_t,uint32_t> copySource;
+    for (auto &[_, block] : blocks) {
+        std::shared_ptr<Instruction> nextInst;
+        for (auto inst = block->instructions.head; inst; inst = nextInst) {
+            nextInst = inst->next;
+            if (inst->opcode() == SpvOpCopyObject) {
+                copySource[inst->resIdList[0]] = inst->argIdList[0];
+                block->instructions.erase(inst);
+            }
+        }
+    }
+    int copyCount = copySource.size();
+    for (auto &[resultId, sourceId] : copySource) {
+        // Follow chains of copies.
+        auto itr = copySource.find(sourceId);
+        while (itr != copySource.end()) {
+            sourceId = itr->second;
+            itr = copySource.find(sourceId);
+        }
+    }
     for (auto &[_, block] : blocks) {
         for (auto inst = block->instructions.head; inst; inst = inst->next) {
-            if (spilledRegId == NO_REGISTER) {
-                // Clear all info for initial liveness analysis.
-                inst->livein.clear();
-                inst->liveout.clear();
-                inst_worklist.insert(inst.get());
+            renameArgs(inst.get(), copySource);
+        }
+    }
+
+    // Value numbering: walk the dominator tree, remembering the operations
+    // computed in the dominating blocks, and reuse the result of an identical
+    // earlier one.
+    typedef std::tuple<uint32_t,std::string,uint32_t,std::vector<uint32_t>> ValueKey;
+    std::map<ValueKey,uint32_t> available;
+    std::map<uint32_t,uint32_t> redundant;
+    std::function<void(Block *)> numberValues = [&](Block *block) {
+        std::vector<ValueKey> added;
+
+        std::shared_ptr<Instruction> nextInst;
+        for (auto inst = block->instructions.head; inst; inst = nextInst) {
+            nextInst = inst->next;
+
+            // Phi operands come from blocks we may not have seen yet.
+            // They're renamed at the end.
+            if (inst->opcode() == RiscVOpPhi) {
+                continue;
+            }
+            renameArgs(inst.get(), redundant);
+            if (!isPureOperation(inst->opcode()) || inst->resIdList.size() != 1) {
+                continue;
+            }
+
+            uint32_t resultId = inst->resIdList[0];
+            std::vector<uint32_t> argIds = inst->argIdList;
+            if (isCommutative(inst->opcode())) {
+                std::sort(argIds.begin(), argIds.end());
+            }
+            // The name distinguishes variants of the same opcode (fmadd, fmsub).
+            ValueKey key { inst->opcode(), inst->name(), program->typeIdOf(resultId), argIds };
+            auto [itr, inserted] = available.insert({key, resultId});
+            if (inserted) {
+                added.push_back(key);
             } else {
-                // We just spilled one register. No need to clear all, just do
-                // the one we spilled.
-                for (auto &[_, livein] : inst->livein) {
-                    livein.erase(spilledRegId);
+                redundant[resultId] = itr->second;
+                block->instructions.erase(inst);
+            }
+        }
+
+        for (auto &child : block->idomChildren) {
+            numberValues(child.get());
+        }
+
+        for (auto &key : added) {
+            available.erase(key);
+        }
+    };
+    numberValues(blocks.at(startBlockId).get());
+    for (auto &[_, block] : blocks) {
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            renameArgs(inst.get(), redundant);
+        }
+    }
+
+    // Dead code elimination: remove operations whose results are never used,
+    // until there are no more.
+    int deadCount = 0;
+    bool changed;
+    do {
+        changed = false;
+        std::map<uint32_t,int> useCount;
+        for (auto &[_, block] : blocks) {
+            for (auto inst = block->instructions.head; inst; inst = inst->next) {
+                for (uint32_t argId : inst->argIdList) {
+                    useCount[argId]++;
                 }
-                inst->liveout.erase(spilledRegId);
+            }
+        }
+        auto isUsed = [&useCount](uint32_t regId) {
+            auto itr = useCount.find(regId);
+            return itr != useCount.end() && itr->second > 0;
+        };
+
+        for (auto &[_, block] : blocks) {
+            std::shared_ptr<Instruction> nextInst;
+            for (auto inst = block->instructions.head; inst; inst = nextInst) {
+                nextInst = inst->next;
+
+                if (inst->opcode() == RiscVOpPhi) {
+                    // Drop the unused results.
+                    RiscVPhi *phi = dynamic_cast<RiscVPhi *>(inst.get());
+                    for (size_t i = phi->resultIds.size(); i-- > 0; ) {
+                        if (!isUsed(phi->resultIds[i])) {
+                            phi->resultIds.erase(phi->resultIds.begin() + i);
+                            phi->operandIds.erase(phi->operandIds.begin() + i);
+                            deadCount++;
+                            changed = true;
+                        }
+                    }
+                    phi->resIdSet.clear();
+                    phi->resIdList.clear();
+                    for (uint32_t resultId : phi->resultIds) {
+                        phi->addResult(resultId);
+                    }
+                    phi->recomputeArgs();
+                    if (phi->resultIds.empty()) {
+                        block->instructions.erase(inst);
+                    }
+                    continue;
+                }
+
+                if ((isPureOperation(inst->opcode()) || inst->opcode() == RiscVOpLoad) &&
+                        std::none_of(inst->resIdList.begin(), inst->resIdList.end(), isUsed)) {
+
+                    block->instructions.erase(inst);
+                    deadCount++;
+                    changed = true;
+                }
+            }
+        }
+    } while (changed);
+
+    if (program->verbose) {
+        log << "Propagated " << copyCount << " copies, removed "
+            << redundant.size() << " redundant and " << deadCount
+            << " dead instructions in function \"" << name << "\".\n";
+    }
+}
 
-                if (inst->needLiveness) {
-                    inst_worklist.insert(inst.get());
-                    inst->needLiveness = false;
+int Function::hoistLoopInvariants(const Loop &loop) {
+    uint32_t preheaderId = findPreheader(loop);
+    if (preheaderId == NO_BLOCK_ID) {
+        return 0;
+    }
+    InstructionList &preheaderList = blocks.at(preheaderId)->instructions;
+
+    // Registers defined in the loop, and the memory it writes.
+    std::set<uint32_t> definedInLoop;
+    std::set<uint32_t> storedVariables;
+    bool storesThroughPointer = false;
+    for (uint32_t blockId : loop.blockIds) {
+        for (auto inst = blocks.at(blockId)->instructions.head; inst; inst = inst->next) {
+            definedInLoop.insert(inst->resIdList.begin(), inst->resIdList.end());
+            if (inst->opcode() == RiscVOpStore) {
+                uint32_t pointerId = dynamic_cast<RiscVStore *>(inst.get())->pointerId();
+                if (isVariable(pointerId)) {
+                    storedVariables.insert(pointerId);
+                } else {
+                    storesThroughPointer = true;
                 }
+            } else if (inst->opcode() == SpvOpFunctionCall || inst->opcode() == SpvOpStore) {
+                storesThroughPointer = true;
             }
         }
     }
 
-    while (!inst_worklist.empty()) {
-        // Pick any PC to start with.
-        Instruction *instruction = *inst_worklist.begin();
-        inst_worklist.erase(instruction);
+    auto isInvariant = [&](Instruction *inst) {
+        if (inst->opcode() == RiscVOpLoad) {
+            // Loads of variables that the loop doesn't write.
+            uint32_t pointerId = dynamic_cast<RiscVLoad *>(inst)->pointerId();
+            if (!isVariable(pointerId) ||
+                    storesThroughPointer ||
+                    storedVariables.find(pointerId) != storedVariables.end()) {
+
+                return false;
+            }
+        } else if (!isPureOperation(inst->opcode())) {
+            return false;
+        }
+        for (uint32_t argId : inst->argIdList) {
+            if (definedInLoop.find(argId) != definedInLoop.end()) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    // Each hoisted float is live across the whole loop.
+    computeLiveness();
+    size_t pressure = loopFloatPressure(loop);
+
+    int hoistedCount = 0;
+    bool changed;
+    do {
+        changed = false;
+        for (uint32_t blockId : loop.blockIds) {
+            // Only hoist from blocks that run on every iteration, so that we
+            // don't add work to paths that wouldn't have done it.
+            bool runsEveryIteration = true;
+            for (uint32_t latchId : loop.latchIds) {
+                if (!blocks.at(latchId)->isDominatedBy(blockId)) {
+                    runsEveryIteration = false;
+                }
+            }
+            if (!runsEveryIteration) {
+                continue;
+            }
+
+            std::shared_ptr<Instruction> nextInst;
+            for (auto inst = blocks.at(blockId)->instructions.head; inst; inst = nextInst) {
+                nextInst = inst->next;
+                if (!isInvariant(inst.get())) {
+                    continue;
+                }
 
-        // Keep track of old livein/liveout for comparison.
-        std::map<uint32_t,std::set<uint32_t>> oldLivein = instruction->livein;
-        std::set<uint32_t> oldLiveout = instruction->liveout;
+                bool isFloat = false;
+                for (uint32_t resId : inst->resIdList) {
+                    if (program->isTypeFloat(program->typeIdOf(resId))) {
+                        isFloat = true;
+                    }
+                }
+                if (isFloat && pressure >= MAX_LIVE_FLOATS) {
+                    continue;
+                }
 
-        // Compute liveout as union of next instructions' liveins.
-        instruction->liveout.clear();
-        for (Instruction *succInstruction : instruction->succ()) {
-            // Add livein from any branch (0).
-            instruction->liveout.insert(
-                    succInstruction->livein[0].begin(),
-                    succInstruction->livein[0].end());
+                // Insert before the preheader's branch.
+                preheaderList.insert(inst, preheaderList.tail);
+                for (uint32_t resId : inst->resIdList) {
+                    definedInLoop.erase(resId);
+                }
+                if (isFloat) {
+                    pressure++;
+                }
+                hoistedCount++;
+                changed = true;
+            }
+        }
+    } while (changed);
+
+    return hoistedCount;
+}
 
-            // Add livein specifically from this branch (if phi).
-            auto itr = succInstruction->livein.find(instruction->blockId());
-            if (itr != succInstruction->livein.end()) {
-                instruction->liveout.insert(itr->second.begin(), itr->second.end());
+uint32_t Function::findExitingBlock(const Loop &loop) const {
+    uint32_t exitingId = NO_BLOCK_ID;
+    for (uint32_t blockId : loop.blockIds) {
+        for (uint32_t succId : blocks.at(blockId)->succ) {
+            if (loop.blockIds.find(succId) == loop.blockIds.end()) {
+                if (exitingId != NO_BLOCK_ID && exitingId != blockId) {
+                    return NO_BLOCK_ID;
+                }
+                exitingId = blockId;
             }
         }
+    }
+
+    return exitingId;
+}
+
+int64_t Function::constantTripCount(const Loop &loop) const {
+    uint32_t preheaderId = findPreheader(loop);
+    if (preheaderId == NO_BLOCK_ID || loop.latchIds.size() != 1) {
+        return -1;
+    }
+    uint32_t headerId = loop.headerId;
+    uint32_t latchId = *loop.latchIds.begin();
+
+    // A single block that leaves the loop, run on every iteration.
+    uint32_t exitingId = findExitingBlock(loop);
+    if (exitingId == NO_BLOCK_ID || !blocks.at(latchId)->isDominatedBy(exitingId)) {
+        return -1;
+    }
+
+    // The exit test must be "i < limit", staying in the loop when true.
+    InsnBranchConditional *exitBranch = dynamic_cast<InsnBranchConditional *>(
+            blocks.at(exitingId)->instructions.tail.get());
+    if (exitBranch == nullptr ||
+            loop.blockIds.find(exitBranch->trueLabelId) == loop.blockIds.end() ||
+            loop.blockIds.find(exitBranch->falseLabelId) != loop.blockIds.end()) {
+
+        return -1;
+    }
 
-        // Livein is liveout minus what we generate ...
-        instruction->livein[0] = instruction->liveout;
-        for (uint32_t resId : instruction->resIdSet) {
-            instruction->livein[0].erase(resId);
+    std::map<uint32_t,Instruction *> definition;
+    for (auto &[_, block] : blocks) {
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            for (uint32_t resId : inst->resIdList) {
+                definition[resId] = inst.get();
+            }
         }
-        // ... plus what we need.
-        assert(instruction->opcode() != SpvOpPhi); // Should have been replaced.
-        if (instruction->opcode() == RiscVOpPhi) {
-            // Special handling of Phi instruction, because we must specify
-            // which branch our livein is from. Otherwise all branches will
-            // think they need all inputs, which is incorrect.
-            RiscVPhi *phi = dynamic_cast<RiscVPhi *>(instruction);
-            assert(phi->operandIds.size() == phi->resultIds.size());
-            for (size_t i = 0; i < phi->operandIds.size(); i++) {
-                // Operands for a specific result.
-                const std::vector<uint32_t> &operandIds = phi->operandIds[i];
-                assert(phi->labelIds.size() == operandIds.size());
+    }
+    auto findDefinition = [&definition](uint32_t regId) -> Instruction * {
+        auto itr = definition.find(regId);
+        return itr == definition.end() ? nullptr : itr->second;
+    };
+    auto asIntegerConstant = [this](uint32_t regId, int32_t &value) {
+        auto itr = program->constants.find(regId);
+        if (itr == program->constants.end() ||
+                program->getTypeOp(itr->second.type) != SpvOpTypeInt) {
+
+            return false;
+        }
+        value = *reinterpret_cast<int32_t *>(itr->second.data);
+        return true;
+    };
+
+    InsnSLessThan *compare = dynamic_cast<InsnSLessThan *>(findDefinition(exitBranch->conditionId()));
+    int32_t limit;
+    if (compare == nullptr || !asIntegerConstant(compare->operand2Id(), limit)) {
+        return -1;
+    }
 
-                for (size_t j = 0; j < operandIds.size(); j++) {
-                    instruction->livein[phi->labelIds[j]].insert(operandIds[j]);
+    // The induction variable is a header phi, starting at a constant and
+    // incremented by a constant on the back edge.
+    uint32_t ivId = compare->operand1Id();
+    RiscVPhi *ivPhi = dynamic_cast<RiscVPhi *>(findDefinition(ivId));
+    if (ivPhi == nullptr || ivPhi->list != &blocks.at(headerId)->instructions) {
+        return -1;
+    }
+    size_t ivIndex = std::find(ivPhi->resultIds.begin(), ivPhi->resultIds.end(), ivId) -
+        ivPhi->resultIds.begin();
+    int preheaderIndex = ivPhi->getLabelIndexForSource(preheaderId);
+    int latchIndex = ivPhi->getLabelIndexForSource(latchId);
+    if (preheaderIndex < 0 || latchIndex < 0) {
+        return -1;
+    }
+    int32_t start;
+    int32_t step;
+    InsnIAdd *increment = dynamic_cast<InsnIAdd *>(findDefinition(ivPhi->operandIds[ivIndex][latchIndex]));
+    if (!asIntegerConstant(ivPhi->operandIds[ivIndex][preheaderIndex], start) ||
+            increment == nullptr ||
+            !((increment->operand1Id() == ivId && asIntegerConstant(increment->operand2Id(), step)) ||
+              (increment->operand2Id() == ivId && asIntegerConstant(increment->operand1Id(), step))) ||
+            step <= 0) {
+
+        return -1;
+    }
+
+    return start < limit ? ((int64_t) limit - start + step - 1)/step : 0;
+}
+
+std::map<uint32_t,double> Function::estimateBlockExecutions() const {
+    std::map<uint32_t,double> executions;
+    for (auto &[blockId, _] : blocks) {
+        executions[blockId] = 1;
+    }
+
+    for (const Loop &loop : findLoops()) {
+        auto itr = unrolledTripCounts.find(loop.headerId);
+        int64_t tripCount = itr != unrolledTripCounts.end() ? itr->second : constantTripCount(loop);
+        double iterations = tripCount < 0 ? DEFAULT_TRIP_COUNT : tripCount;
+        for (uint32_t blockId : loop.blockIds) {
+            executions.at(blockId) *= iterations;
+        }
+    }
+
+    return executions;
+}
+
+bool Function::unrollLoop(const Loop &loop) {
+    // Only simple branches.
+    size_t instructionCount = 0;
+    for (uint32_t blockId : loop.blockIds) {
+        Block *block = blocks.at(blockId).get();
+        uint32_t opcode = block->instructions.tail->opcode();
+        if (opcode != SpvOpBranch && opcode != SpvOpBranchConditional) {
+            return false;
+        }
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            instructionCount++;
+        }
+    }
+    int64_t tripCount = constantTripCount(loop);
+    if (tripCount < 0) {
+        return false;
+    }
+    uint32_t headerId = loop.headerId;
+    uint32_t latchId = *loop.latchIds.begin();
+    uint32_t exitingId = findExitingBlock(loop);
+    InsnBranchConditional *exitBranch = static_cast<InsnBranchConditional *>(
+            blocks.at(exitingId)->instructions.tail.get());
+
+    // Pick the largest factor that divides the trip count and fits our
+    // budgets. The copies only add registers if they're interleaved later,
+    // so leave that much room.
+    computeLiveness();
+    if (loopFloatPressure(loop) + UNROLL_PRESSURE_MARGIN > MAX_LIVE_FLOATS) {
+        return false;
+    }
+    int factor = 0;
+    for (int candidate : { 4, 2 }) {
+        if (tripCount >= candidate && tripCount % candidate == 0 &&
+                instructionCount*candidate <= UNROLL_SIZE_BUDGET) {
+
+            factor = candidate;
+            break;
+        }
+    }
+    if (factor == 0) {
+        return false;
+    }
+
+    // Labels and registers of each copy. Copy 0 is the original loop.
+    std::vector<std::map<uint32_t,uint32_t>> labelMap(factor);
+    std::vector<std::map<uint32_t,uint32_t>> regMap(factor);
+    auto labelFor = [&labelMap](int copy, uint32_t labelId) {
+        auto itr = labelMap[copy].find(labelId);
+        return itr == labelMap[copy].end() ? labelId : itr->second;
+    };
+    auto regFor = [&regMap](int copy, uint32_t regId) {
+        auto itr = regMap[copy].find(regId);
+        return itr == regMap[copy].end() ? regId : itr->second;
+    };
+    auto isHeaderPhi = [headerId](const Block *block, const Instruction *inst) {
+        return block->blockId == headerId && inst->opcode() == RiscVOpPhi;
+    };
+    for (int copy = 1; copy < factor; copy++) {
+        for (uint32_t blockId : loop.blockIds) {
+            Block *block = blocks.at(blockId).get();
+            labelMap[copy][blockId] = newId();
+            for (auto inst = block->instructions.head; inst; inst = inst->next) {
+                if (!isHeaderPhi(block, inst.get())) {
+                    for (uint32_t resId : inst->resIdList) {
+                        regMap[copy][resId] = newRegister(program->typeIdOf(resId));
+                    }
                 }
             }
-        } else {
-            // Non-phi instruction, all parameters are livein.
-            for (uint32_t argId : instruction->argIdSet) {
-                // Don't consider /*constants or*/ variables, they're never in registers.
-                if (/*constants.find(argId) == constants.end() &&*/
-                        program->variables.find(argId) == program->variables.end()) {
+        }
+    }
+    // Header phis of a copy are just the values from the end of the previous copy.
+    for (int copy = 1; copy < factor; copy++) {
+        for (auto inst = blocks.at(headerId)->instructions.head; inst; inst = inst->next) {
+            if (inst->opcode() == RiscVOpPhi) {
+                RiscVPhi *phi = dynamic_cast<RiscVPhi *>(inst.get());
+                int index = phi->getLabelIndexForSource(latchId);
+                for (size_t i = 0; i < phi->resultIds.size(); i++) {
+                    regMap[copy][phi->resultIds[i]] = regFor(copy - 1, phi->operandIds[i][index]);
+                }
+            }
+        }
+    }
+
+    // Back edges go to the header of the next copy, and from the last copy
+    // to the original header.
+    auto targetFor = [&](int copy, uint32_t labelId) {
+        return labelId == headerId ? labelFor((copy + 1) % factor, headerId) : labelFor(copy, labelId);
+    };
+    auto retarget = [&](Instruction *inst, int copy) {
+        if (InsnBranch *branch = dynamic_cast<InsnBranch *>(inst)) {
+            branch->targetLabelId = targetFor(copy, branch->targetLabelId);
+        } else if (InsnBranchConditional *branch = dynamic_cast<InsnBranchConditional *>(inst)) {
+            branch->trueLabelId = targetFor(copy, branch->trueLabelId);
+            branch->falseLabelId = targetFor(copy, branch->falseLabelId);
+        }
+        std::set<uint32_t> targetLabelIds;
+        for (uint32_t labelId : inst->targetLabelIds) {
+            targetLabelIds.insert(targetFor(copy, labelId));
+        }
+        inst->targetLabelIds = targetLabelIds;
+    };
+
+    for (int copy = 1; copy < factor; copy++) {
+        for (uint32_t blockId : loop.blockIds) {
+            Block *block = blocks.at(blockId).get();
+            auto newBlock = std::make_shared<Block>(labelFor(copy, blockId), this);
+
+            for (auto inst = block->instructions.head; inst; inst = inst->next) {
+                if (isHeaderPhi(block, inst.get())) {
+                    continue;
+                }
+                std::shared_ptr<Instruction> newInst;
+                if (blockId == exitingId && inst == block->instructions.tail) {
+                    // The trip count is a multiple of the factor, so only
+                    // the first copy can leave the loop.
+                    newInst = std::make_shared<InsnBranch>(inst->lineInfo,
+                            targetFor(copy, exitBranch->trueLabelId));
+                    newBlock->instructions.push_back(newInst);
+                    continue;
+                }
+
+                newInst = inst->clone();
+                for (uint32_t resId : inst->resIdList) {
+                    newInst->changeResult(resId, regFor(copy, resId));
+                }
+                if (newInst->opcode() == RiscVOpPhi) {
+                    RiscVPhi *phi = dynamic_cast<RiscVPhi *>(newInst.get());
+                    for (uint32_t &resultId : phi->resultIds) {
+                        resultId = regFor(copy, resultId);
+                    }
+                    for (uint32_t &labelId : phi->labelIds) {
+                        labelId = labelFor(copy, labelId);
+                    }
+                    for (std::vector<uint32_t> &operandIds : phi->operandIds) {
+                        for (uint32_t &operandId : operandIds) {
+                            operandId = regFor(copy, operandId);
+                        }
+                    }
+                    phi->recomputeArgs();
+                } else {
+                    // Rename all at once, since new names may be old names in the loop.
+                    newInst->argIdSet.clear();
+                    for (uint32_t &argId : newInst->argIdList) {
+                        argId = regFor(copy, argId);
+                        newInst->argIdSet.insert(argId);
+                    }
+                }
+                if (newInst->isTermination()) {
+                    retarget(newInst.get(), copy);
+                }
+                newBlock->instructions.push_back(newInst);
+            }
+
+            blocks[newBlock->blockId] = newBlock;
+        }
+    }
+
+    // The original latch continues to the second copy, and the original
+    // header takes its loop values from the last copy.
+    retarget(blocks.at(latchId)->instructions.tail.get(), 0);
+    for (auto inst = blocks.at(headerId)->instructions.head; inst; inst = inst->next) {
+        if (inst->opcode() == RiscVOpPhi) {
+            RiscVPhi *phi = dynamic_cast<RiscVPhi *>(inst.get());
+            int index = phi->getLabelIndexForSource(latchId);
+            phi->labelIds[index] = labelFor(factor - 1, latchId);
+            for (std::vector<uint32_t> &operandIds : phi->operandIds) {
+                operandIds[index] = regFor(factor - 1, operandIds[index]);
+            }
+            phi->recomputeArgs();
+        }
+    }
+
+    // Rebuild the control flow graph and dominator tree.
+    for (auto &[_, block] : blocks) {
+        block->pred.clear();
+    }
+    for (auto &[blockId, block] : blocks) {
+        block->succ = block->instructions.tail->targetLabelIds;
+        for (uint32_t succId : block->succ) {
+            blocks.at(succId)->pred.insert(blockId);
+        }
+    }
+    computeDomTree(false);
+    unrolledTripCounts[headerId] = tripCount/factor;
 
-                    instruction->livein[0].insert(argId);
+    if (program->verbose) {
+        log << "Unrolled loop at block " << headerId << " by " << factor
+            << " (trip count " << tripCount << ") in function \"" << name << "\".\n";
+    }
+
+    return true;
+}
+
+void Function::optimizeLoops(bool unroll) {
+    // Innermost loops first, so that their invariants can continue out
+    // of the enclosing loops.
+    std::vector<Loop> loops = findLoops();
+    std::sort(loops.begin(), loops.end(), [](const Loop &a, const Loop &b) {
+        return a.blockIds.size() < b.blockIds.size();
+    });
+    int hoistedCount = 0;
+    for (const Loop &loop : loops) {
+        hoistedCount += hoistLoopInvariants(loop);
+    }
+
+    int unrolledCount = 0;
+    if (unroll) {
+        // Only innermost loops. Loops change as they're unrolled, so find
+        // them again each time.
+        std::set<uint32_t> triedHeaderIds;
+        while (true) {
+            bool found = false;
+            for (const Loop &loop : findLoops()) {
+                bool isInnermost = true;
+                for (const Loop &other : findLoops()) {
+                    if (other.headerId != loop.headerId &&
+                            loop.blockIds.find(other.headerId) != loop.blockIds.end()) {
+
+                        isInnermost = false;
+                    }
+                }
+                if (isInnermost && triedHeaderIds.insert(loop.headerId).second) {
+                    if (unrollLoop(loop)) {
+                        unrolledCount++;
+                    }
+                    found = true;
+                    break;
                 }
             }
+            if (!found) {
+                break;
+            }
+        }
+
+        // Clean up the copies' exit tests and anything they made redundant.
+        if (unrolledCount > 0) {
+            optimizeSsa();
         }
+    }
 
-        // If we changed, then our predecessors need to update since they
-        // depend on us.
-        if (oldLivein != instruction->livein || oldLiveout != instruction->liveout) {
-            // Our predecessors depend on us.
-            for (Instruction *predInstruction : instruction->pred()) {
-                inst_worklist.insert(predInstruction);
+    if (program->verbose) {
+        log << "Hoisted " << hoistedCount << " loop invariants and unrolled "
+            << unrolledCount << " loops in function \"" << name << "\".\n";
+    }
+}
+
+uint32_t Function::rematerializationBlockFor(uint32_t blockId) const {
+    const Block *block = blocks.at(blockId).get();
+    while (block->loopDepth > 0 && block->idom != NO_BLOCK_ID) {
+        block = blocks.at(block->idom).get();
+    }
+
+    return block->blockId;
+}
+
+std::set<uint32_t> Function::rematerializationBlocks(uint32_t constId) const {
+    std::set<uint32_t> blockIds;
+
+    for (auto &[blockId, block] : blocks) {
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            if (!inst->usesRegister(constId)) {
+                continue;
+            }
+            if (inst->opcode() == RiscVOpPhi) {
+                // Phi operands are needed at the end of the source block.
+                RiscVPhi *phi = dynamic_cast<RiscVPhi *>(inst.get());
+                for (const std::vector<uint32_t> &operandIds : phi->operandIds) {
+                    for (size_t j = 0; j < operandIds.size(); j++) {
+                        if (operandIds[j] == constId) {
+                            blockIds.insert(rematerializationBlockFor(phi->labelIds[j]));
+                        }
+                    }
+                }
+            } else {
+                blockIds.insert(rematerializationBlockFor(blockId));
             }
         }
     }
-    if (PRINT_TIMER_RESULTS || true) {
-        std::cout << "Livein and liveout took " << timer.elapsed() << " seconds.\n";
+
+    return blockIds;
+}
+
+void Function::rematerializeConstant(uint32_t constId) {
+    uint32_t typeId = program->typeIdOf(constId);
+
+    // Load the constant once in each block, before its first use there or
+    // at the end of the block if it's only needed by later blocks.
+    std::map<uint32_t,uint32_t> blockToRegId;
+    for (uint32_t blockId : rematerializationBlocks(constId)) {
+        Block *block = blocks.at(blockId).get();
+        std::shared_ptr<Instruction> before = block->instructions.tail;
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            if (inst->opcode() != RiscVOpPhi && inst->usesRegister(constId)) {
+                before = inst;
+                break;
+            }
+        }
+
+        uint32_t regId = newRegister(typeId);
+        rematerializedConstants[regId] = constId;
+        blockToRegId[blockId] = regId;
+
+        LineInfo lineInfo;
+        block->instructions.insert(std::make_shared<RiscVLoadConst>(
+                    lineInfo, typeId, regId, constId), before);
+    }
+
+    // Rename the uses.
+    for (auto &[blockId, block] : blocks) {
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            if (!inst->usesRegister(constId)) {
+                continue;
+            }
+            if (inst->opcode() == RiscVOpPhi) {
+                RiscVPhi *phi = dynamic_cast<RiscVPhi *>(inst.get());
+                for (std::vector<uint32_t> &operandIds : phi->operandIds) {
+                    for (size_t j = 0; j < operandIds.size(); j++) {
+                        if (operandIds[j] == constId) {
+                            operandIds[j] = blockToRegId.at(rematerializationBlockFor(phi->labelIds[j]));
+                        }
+                    }
+                }
+                phi->recomputeArgs();
+            } else {
+                inst->changeArg(constId, blockToRegId.at(rematerializationBlockFor(blockId)));
+            }
+        }
     }
 }
 
-uint32_t Function::spillIfNecessary(const std::set<uint32_t> &alreadySpilled) {
+void Function::ensureMaxRegisters(const FloatLimitFunction &maxFloatsAcross) {
+    computeLoopDepth();
+
+    // A constant that only needs one load doesn't need a register for the
+    // whole function. Others stay in registers unless we run out, in which
+    // case the spiller weighs the extra loads against their live range.
+    std::set<uint32_t> constIds;
+    for (auto &[_, block] : blocks) {
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            for (uint32_t argId : inst->argIdSet) {
+                if (program->isConstant(argId)) {
+                    constIds.insert(argId);
+                }
+            }
+        }
+    }
     Timer timer;
-    int maxFloatLiveness = 0;
-    Instruction *heaviestInstruction = nullptr;
+    for (uint32_t constId : constIds) {
+        if (rematerializationBlocks(constId).size() == 1) {
+            rematerializeConstant(constId);
+        }
+    }
+    timeReport.add("rematerializeConstants", cleanName, timer.elapsed());
+
+    // Registers we must not spill: those already spilled, and the short-lived
+    // ones loaded from spilled ones.
+    std::set<uint32_t> unspillable;
+
+    // Each round spills enough registers to fix every point of over-pressure.
+    // We only need another round if the reloads themselves push us over.
+    spillCount = 0;
+    maxFloatLiveness = 0;
+    while (true) {
+        timer.reset();
+        computeLiveness();
+        timeReport.add("computeLiveness", cleanName, timer.elapsed());
+        // dumpInstructions(log, "After liveness");
+        timer.reset();
+        bool spilled = spillIfNecessary(unspillable, maxFloatsAcross);
+        timeReport.add("spillIfNecessary", cleanName, timer.elapsed());
+        if (!spilled) {
+            break;
+        }
+    }
+
+    timer.reset();
+    size_t bytesSaved = colorSpillSlots();
+    timeReport.add("colorSpillSlots", cleanName, timer.elapsed());
+    if (bytesSaved > 0) {
+        log << "Sharing spill slots saved " << bytesSaved
+            << " bytes in function " << name << "\n";
+    }
+
+    // What the register allocator will work with.
+    TimeReport::FunctionStats &stats = timeReport.functionStats[cleanName];
+    std::set<uint32_t> regIds;
+    stats.instructions = 0;
+    for (auto &[_, block] : blocks) {
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            stats.instructions++;
+            regIds.insert(inst->resIdSet.begin(), inst->resIdSet.end());
+        }
+    }
+    stats.virtualRegisters = regIds.size();
+    stats.spills = spillCount;
+    stats.maxFloatLiveness = maxFloatLiveness;
+}
+
+// Set of virtual registers, by the dense index assigned in computeLiveness().
+struct RegisterBitSet {
+    std::vector<uint64_t> words;
+
+    RegisterBitSet(size_t size = 0) : words((size + 63)/64) {
+        // Nothing.
+    }
+
+    void insert(size_t index) {
+        words[index/64] |= uint64_t(1) << (index%64);
+    }
+
+    void erase(size_t index) {
+        words[index/64] &= ~(uint64_t(1) << (index%64));
+    }
+
+    // Add all registers of "other".
+    void insertAll(const RegisterBitSet &other) {
+        for (size_t i = 0; i < words.size(); i++) {
+            words[i] |= other.words[i];
+        }
+    }
+
+    // Remove all registers of "other".
+    void eraseAll(const RegisterBitSet &other) {
+        for (size_t i = 0; i < words.size(); i++) {
+            words[i] &= ~other.words[i];
+        }
+    }
+
+    bool operator==(const RegisterBitSet &other) const {
+        return words == other.words;
+    }
+
+    bool operator!=(const RegisterBitSet &other) const {
+        return words != other.words;
+    }
+
+    // Convert to a set of register IDs.
+    std::set<uint32_t> toSet(const std::vector<uint32_t> &indexToRegId) const {
+        std::set<uint32_t> regIds;
+        for (size_t i = 0; i < words.size(); i++) {
+            uint64_t bits = words[i];
+            while (bits != 0) {
+                regIds.insert(indexToRegId[i*64 + __builtin_ctzll(bits)]);
+                bits &= bits - 1;
+            }
+        }
+        return regIds;
+    }
+};
+
+void Function::computeLiveness() {
+    // Give every register a dense index so that sets of them can be bit vectors.
+    // Variables are never in registers, so skip them.
+    std::map<uint32_t,size_t> regIdToIndex;
+    std::vector<uint32_t> indexToRegId;
+    auto addRegister = [this, &regIdToIndex, &indexToRegId](uint32_t regId) {
+        if (!isVariable(regId) &&
+                regIdToIndex.insert({regId, indexToRegId.size()}).second) {
+
+            indexToRegId.push_back(regId);
+        }
+    };
+    for (auto &[_, block] : blocks) {
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            for (uint32_t resId : inst->resIdSet) {
+                addRegister(resId);
+            }
+            for (uint32_t argId : inst->argIdSet) {
+                addRegister(argId);
+            }
+        }
+    }
+    size_t regCount = indexToRegId.size();
+
+    // Per-block summaries: registers defined in the block, registers used
+    // before being defined, and, for phis, the operands used on the edge from
+    // each predecessor. The latter are live out of that predecessor only.
+    struct BlockLiveness {
+        RegisterBitSet def;
+        RegisterBitSet use;
+        std::map<uint32_t,RegisterBitSet> phiUse;
+        RegisterBitSet liveIn;
+        RegisterBitSet liveOut;
+    };
+    std::map<uint32_t,BlockLiveness> blockLiveness;
+
+    for (auto &[blockId, block] : blocks) {
+        BlockLiveness &bl = blockLiveness[blockId];
+        bl.def = RegisterBitSet(regCount);
+        bl.use = RegisterBitSet(regCount);
+        bl.liveIn = RegisterBitSet(regCount);
+        bl.liveOut = RegisterBitSet(regCount);
+
+        for (auto inst = block->instructions.tail; inst; inst = inst->prev) {
+            for (uint32_t resId : inst->resIdSet) {
+                bl.def.insert(regIdToIndex.at(resId));
+                bl.use.erase(regIdToIndex.at(resId));
+            }
+            assert(inst->opcode() != SpvOpPhi); // Should have been replaced.
+            if (inst->opcode() == RiscVOpPhi) {
+                RiscVPhi *phi = dynamic_cast<RiscVPhi *>(inst.get());
+                assert(phi->operandIds.size() == phi->resultIds.size());
+                for (const std::vector<uint32_t> &operandIds : phi->operandIds) {
+                    assert(phi->labelIds.size() == operandIds.size());
+                    for (size_t j = 0; j < operandIds.size(); j++) {
+                        auto [itr, _] = bl.phiUse.insert({phi->labelIds[j], RegisterBitSet(regCount)});
+                        itr->second.insert(regIdToIndex.at(operandIds[j]));
+                    }
+                }
+            } else {
+                for (uint32_t argId : inst->argIdSet) {
+                    auto itr = regIdToIndex.find(argId);
+                    if (itr != regIdToIndex.end()) {
+                        bl.use.insert(itr->second);
+                    }
+                }
+            }
+        }
+    }
+
+    // Visit blocks in post-order so that successors are usually done before
+    // their predecessors, then sweep until nothing changes.
+    std::vector<uint32_t> order;
+    std::set<uint32_t> visited;
+    std::function<void(uint32_t)> visit = [this, &order, &visited, &visit](uint32_t blockId) {
+        if (visited.insert(blockId).second) {
+            for (uint32_t succId : blocks.at(blockId)->succ) {
+                visit(succId);
+            }
+            order.push_back(blockId);
+        }
+    };
+    if (startBlockId != NO_BLOCK_ID) {
+        visit(startBlockId);
+    }
+    for (auto &[blockId, _] : blocks) {
+        visit(blockId);
+    }
+
+    bool changed;
+    do {
+        changed = false;
+        for (uint32_t blockId : order) {
+            BlockLiveness &bl = blockLiveness.at(blockId);
+
+            RegisterBitSet liveOut(regCount);
+            for (uint32_t succId : blocks.at(blockId)->succ) {
+                const BlockLiveness &succ = blockLiveness.at(succId);
+                liveOut.insertAll(succ.liveIn);
+                auto itr = succ.phiUse.find(blockId);
+                if (itr != succ.phiUse.end()) {
+                    liveOut.insertAll(itr->second);
+                }
+            }
+
+            RegisterBitSet liveIn = liveOut;
+            liveIn.eraseAll(bl.def);
+            liveIn.insertAll(bl.use);
+
+            if (liveIn != bl.liveIn) {
+                bl.liveIn = liveIn;
+                changed = true;
+            }
+            bl.liveOut = liveOut;
+        }
+    } while (changed);
+
+    // Derive per-instruction liveness in one backward sweep of each block.
+    for (auto &[blockId, block] : blocks) {
+        const BlockLiveness &bl = blockLiveness.at(blockId);
+        RegisterBitSet live = bl.liveOut;
+
+        for (auto inst = block->instructions.tail; inst; inst = inst->prev) {
+            inst->liveout = live.toSet(indexToRegId);
+            for (uint32_t resId : inst->resIdSet) {
+                live.erase(regIdToIndex.at(resId));
+            }
+
+            inst->livein.clear();
+            if (inst->opcode() == RiscVOpPhi) {
+                // Special handling of Phi instruction, because we must specify
+                // which branch our livein is from. Otherwise all branches will
+                // think they need all inputs, which is incorrect.
+                for (auto &[labelId, phiUse] : bl.phiUse) {
+                    inst->livein[labelId] = phiUse.toSet(indexToRegId);
+                }
+            } else {
+                for (uint32_t argId : inst->argIdSet) {
+                    auto itr = regIdToIndex.find(argId);
+                    if (itr != regIdToIndex.end()) {
+                        live.insert(itr->second);
+                    }
+                }
+            }
+            inst->livein[0] = live.toSet(indexToRegId);
+        }
+    }
+}
+
+std::map<uint32_t,float> Function::computeSpillCosts() {
+    std::map<uint32_t,float> accessCost;
+    std::map<uint32_t,int> rangeLength;
+
+    for (auto &[_, block] : blocks) {
+        float weight = powf(10, block->loopDepth);
+
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            // Each use would need a load. Constants are loaded once per
+            // rematerialization block instead.
+            for (uint32_t argId : inst->argIdSet) {
+                if (!program->isConstant(argId)) {
+                    accessCost[argId] += weight;
+                }
+            }
+            for (uint32_t resId : inst->resIdSet) {
+                accessCost[resId] += weight;
+            }
+            for (uint32_t regId : inst->livein.at(0)) {
+                rangeLength[regId]++;
+            }
+        }
+    }
+
+    for (auto &[regId, _] : rangeLength) {
+        if (program->isConstant(regId)) {
+            accessCost[regId] = rematerializationBlocks(regId).size();
+        }
+    }
+
+    std::map<uint32_t,float> spillCosts;
+    for (auto &[regId, length] : rangeLength) {
+        spillCosts[regId] = accessCost[regId]/length;
+    }
+
+    return spillCosts;
+}
+
+bool Function::spillIfNecessary(std::set<uint32_t> &unspillable,
+        const FloatLimitFunction &maxFloatsAcross) {
+
+    size_t roundMaxFloatLiveness = 0;
+
+    // Live floats at each instruction where there are too many, and how
+    // many of them may stay in registers.
+    struct OverPressure {
+        Instruction *instruction;
+        std::set<uint32_t> liveFloats;
+        size_t maxFloats;
+    };
+    std::vector<OverPressure> overPressure;
 
     for (auto &[_, block] : blocks) {
         for (auto inst = block->instructions.head; inst; inst = inst->next) {
             std::set<uint32_t> liveInts;
             std::set<uint32_t> liveFloats;
             computeLiveSets(inst.get(), liveInts, liveFloats);
-            int floatLiveness = liveFloats.size();
-            if (floatLiveness > maxFloatLiveness) {
-                maxFloatLiveness = floatLiveness;
-                heaviestInstruction = inst.get();
+            roundMaxFloatLiveness = std::max(roundMaxFloatLiveness, liveFloats.size());
+            if (liveFloats.size() > MAX_LIVE_FLOATS) {
+                overPressure.push_back({inst.get(), liveFloats, MAX_LIVE_FLOATS});
             }
             // We don't currently have a problem with too many ints, so ignore
             // them for now.
+
+            // A library call leaves fewer registers for the floats that
+            // live across it.
+            size_t maxFloats = maxFloatsAcross(inst.get());
+            if (maxFloats < MAX_LIVE_FLOATS) {
+                std::set<uint32_t> acrossFloats;
+                for (uint32_t regId : inst->liveout) {
+                    if (inst->resIdSet.find(regId) == inst->resIdSet.end() &&
+                            program->isTypeFloat(program->typeIdOf(regId))) {
+
+                        acrossFloats.insert(regId);
+                    }
+                }
+                if (acrossFloats.size() > maxFloats) {
+                    overPressure.push_back({inst.get(), acrossFloats, maxFloats});
+                }
+            }
         }
     }
 
-    std::cout << "Max float liveness is " << maxFloatLiveness << "\n";
+    log << "Max float liveness is " << roundMaxFloatLiveness << "\n";
+    maxFloatLiveness = std::max(maxFloatLiveness, roundMaxFloatLiveness);
 
-    uint32_t spilledRegId = NO_REGISTER;
-    if (heaviestInstruction != nullptr) {
-        // Recompute these.
-        std::set<uint32_t> liveInts;
-        std::set<uint32_t> liveFloats;
-        computeLiveSets(heaviestInstruction, liveInts, liveFloats);
-        ___count++; // XXX remove.
-        // XXX this is 31 because my swap routine assumes f31 is free.
-        if (liveFloats.size() > 31 && ___count < 200) {
-            spilledRegId = spillVariable(heaviestInstruction, liveFloats, alreadySpilled);
+    if (overPressure.empty()) {
+        return false;
+    }
+
+    // Pick the cheapest victims at each point of over-pressure, counting
+    // the ones already picked for earlier points.
+    std::map<uint32_t,float> spillCosts = computeSpillCosts();
+    std::set<uint32_t> victims;
+    for (auto &[instruction, liveFloats, maxFloats] : overPressure) {
+        size_t liveCount = 0;
+        for (uint32_t regId : liveFloats) {
+            if (victims.find(regId) == victims.end()) {
+                liveCount++;
+            }
+        }
+
+        while (liveCount > maxFloats) {
+            uint32_t victim = NO_REGISTER;
+            for (uint32_t regId : liveFloats) {
+                if (victims.find(regId) == victims.end() &&
+                        unspillable.find(regId) == unspillable.end() &&
+                        (victim == NO_REGISTER || spillCosts.at(regId) < spillCosts.at(victim))) {
+
+                    victim = regId;
+                }
+            }
+            if (victim == NO_REGISTER) {
+                std::cerr << "Have already spilled everything.\n";
+                std::cerr << "Live registers:";
+                for (uint32_t regId : liveFloats) {
+                    std::cerr << " " << regId;
+                }
+                std::cerr << "\n";
+                instruction->dump(std::cerr);
+                exit(EXIT_FAILURE);
+            }
+            victims.insert(victim);
+            liveCount--;
+        }
+    }
+
+    for (uint32_t regId : victims) {
+        spillVariable(regId, unspillable);
+    }
+    spillCount += victims.size();
+
+    return true;
+}
+
+size_t Function::colorSpillSlots() {
+    if (spillSlots.size() < 2) {
+        return 0;
+    }
+
+    // Spill slot accessed by the instruction, and whether it's a store.
+    auto slotAccess = [this](const Instruction *inst, uint32_t &slot, bool &isStore) {
+        if (inst->opcode() == RiscVOpLoad) {
+            slot = dynamic_cast<const RiscVLoad *>(inst)->pointerId();
+            isStore = false;
+        } else if (inst->opcode() == RiscVOpStore) {
+            slot = dynamic_cast<const RiscVStore *>(inst)->pointerId();
+            isStore = true;
+        } else {
+            return false;
+        }
+        return spillSlots.find(slot) != spillSlots.end();
+    };
+
+    // Backward liveness of the slots, like computeLiveness() for registers:
+    // loads use a slot and stores define it. There are few slots, so plain
+    // sets will do.
+    std::map<uint32_t,std::set<uint32_t>> use, def, liveIn, liveOut;
+    for (auto &[blockId, block] : blocks) {
+        for (auto inst = block->instructions.tail; inst; inst = inst->prev) {
+            uint32_t slot;
+            bool isStore;
+            if (slotAccess(inst.get(), slot, isStore)) {
+                if (isStore) {
+                    def[blockId].insert(slot);
+                    use[blockId].erase(slot);
+                } else {
+                    use[blockId].insert(slot);
+                }
+            }
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto &[blockId, block] : blocks) {
+            std::set<uint32_t> out;
+            for (uint32_t succId : block->succ) {
+                out.insert(liveIn[succId].begin(), liveIn[succId].end());
+            }
+            std::set<uint32_t> in = use[blockId];
+            for (uint32_t slot : out) {
+                if (def[blockId].find(slot) == def[blockId].end()) {
+                    in.insert(slot);
+                }
+            }
+            if (in != liveIn[blockId] || out != liveOut[blockId]) {
+                liveIn[blockId] = in;
+                liveOut[blockId] = out;
+                changed = true;
+            }
+        }
+    }
+
+    // A store to a slot interferes with every other slot that's live there.
+    std::map<uint32_t,std::set<uint32_t>> interference;
+    for (auto &[blockId, block] : blocks) {
+        std::set<uint32_t> live = liveOut[blockId];
+        for (auto inst = block->instructions.tail; inst; inst = inst->prev) {
+            uint32_t slot;
+            bool isStore;
+            if (slotAccess(inst.get(), slot, isStore)) {
+                if (isStore) {
+                    live.erase(slot);
+                    for (uint32_t other : live) {
+                        interference[slot].insert(other);
+                        interference[other].insert(slot);
+                    }
+                } else {
+                    live.insert(slot);
+                }
+            }
+        }
+    }
+
+    // Greedily give each slot the first existing slot of the same size
+    // that doesn't interfere with anything already sharing it.
+    std::map<uint32_t,uint32_t> slotMap;
+    std::map<uint32_t,std::set<uint32_t>> sharedBy;
+    for (uint32_t slot : spillSlots) {
+        uint32_t size = newTypeSizes.at(newVariables.at(slot).type);
+        uint32_t target = slot;
+        for (auto &[candidate, members] : sharedBy) {
+            if (newTypeSizes.at(newVariables.at(candidate).type) != size) {
+                continue;
+            }
+            bool conflicts = false;
+            for (uint32_t member : members) {
+                if (interference[slot].find(member) != interference[slot].end()) {
+                    conflicts = true;
+                    break;
+                }
+            }
+            if (!conflicts) {
+                target = candidate;
+                break;
+            }
         }
+        slotMap[slot] = target;
+        sharedBy[target].insert(slot);
     }
 
-    if (PRINT_TIMER_RESULTS) {
-        std::cerr << "Spilling took " << timer.elapsed() << " seconds.\n";
+    // Point loads and stores at the shared slots and drop the others.
+    for (auto &[_, block] : blocks) {
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            uint32_t slot;
+            bool isStore;
+            if (slotAccess(inst.get(), slot, isStore) && slotMap.at(slot) != slot) {
+                inst->changeArg(slot, slotMap.at(slot));
+            }
+        }
     }
 
-    return spilledRegId;
+    size_t bytesSaved = 0;
+    for (auto &[slot, target] : slotMap) {
+        if (target != slot) {
+            bytesSaved += newTypeSizes.at(newVariables.at(slot).type);
+            newVariables.erase(slot);
+            spillSlots.erase(slot);
+        }
+    }
+
+    return bytesSaved;
 }
 
 void Function::computeLiveSets(Instruction *instruction,
@@ -429,36 +1925,20 @@ void Function::computeLiveSets(Instruction *instruction,
     }
 }
 
-uint32_t Function::spillVariable(Instruction *instruction, const std::set<uint32_t> &liveFloats,
-        const std::set<uint32_t> &alreadySpilled) {
+void Function::spillVariable(uint32_t regId, std::set<uint32_t> &unspillable) {
+    unspillable.insert(regId);
 
-    // Pick one randomly. Can later use ComputeWeight or similar to pick a good one.
-    uint32_t regId = NO_REGISTER;
-    for (uint32_t liveRegId : liveFloats) {
-        if (alreadySpilled.find(liveRegId) == alreadySpilled.end()
-                && (regId == NO_REGISTER || liveRegId < regId)) {
-
-            regId = liveRegId;
-        }
-    }
-    if (regId == NO_REGISTER) {
-        std::cerr << "Have already spilled everything.\n";
-        std::cerr << "Live registers:";
-        for (uint32_t regId : liveFloats) {
-            std::cerr << " " << regId;
-        }
-        std::cerr << "\n";
-        std::cerr << "Already spilled registers:";
-        for (uint32_t regId : alreadySpilled) {
-            std::cerr << " " << regId;
-        }
-        std::cerr << "\n";
-        instruction->dump(std::cerr);
-    }
-    assert(regId != NO_REGISTER);
     uint32_t typeId = program->typeIdOf(regId);
-    bool isConstant = program->isConstant(regId);
-    std::cout << "Spilling " << (isConstant ? "constant" : "variable")
+    if (program->isConstant(regId)) {
+        log << "Rematerializing constant " << regId << " of type " << typeId << "\n";
+        rematerializeConstant(regId);
+        return;
+    }
+
+    // Registers loaded from a constant are reloaded from it.
+    auto remat = rematerializedConstants.find(regId);
+    bool isConstant = remat != rematerializedConstants.end();
+    log << "Spilling " << (isConstant ? "constant" : "variable")
         << " " << regId << " of type " << typeId << "\n";
 
     // We may not have a type for the "pointer to variable" that we need, so create one.
@@ -467,63 +1947,85 @@ uint32_t Function::spillVariable(Instruction *instruction, const std::set<uint32
     uint32_t pointerTypeId = 0;
     uint32_t varId = 0;
     if (!isConstant) {
-        pointerTypeId = program->nextReg++;
-        program->types[pointerTypeId] = std::make_shared<TypePointer>(program->types[typeId],
+        pointerTypeId = newId();
+        newTypes[pointerTypeId] = std::make_shared<TypePointer>(program->types.at(typeId),
                 typeId, SpvStorageClassFunction);
-        program->typeSizes[pointerTypeId] = sizeof(uint32_t);
+        newTypeSizes[pointerTypeId] = sizeof(uint32_t);
 
         // Create a new local (function) variable.
-        varId = program->nextReg++;
-        program->variables[varId] = {pointerTypeId, SpvStorageClassFunction,
+        varId = newId();
+        newVariables[varId] = {pointerTypeId, SpvStorageClassFunction,
             NO_INITIALIZER, 0xFFFFFFFF};
+        spillSlots.insert(varId);
     }
 
+    // Make a new register loaded before the instruction.
+    auto makeLoad = [this, typeId, varId, isConstant, remat, &unspillable](
+            Block *block, std::shared_ptr<Instruction> before) {
+
+        uint32_t newRegId = newRegister(typeId);
+        unspillable.insert(newRegId);
+
+        LineInfo lineInfo;
+        std::shared_ptr<Instruction> loadInstruction;
+        if (isConstant) {
+            loadInstruction = std::make_shared<RiscVLoadConst>(
+                    lineInfo, typeId, newRegId, remat->second);
+        } else {
+            loadInstruction = std::make_shared<RiscVLoad>(
+                    lineInfo, typeId, newRegId, varId, NO_MEMORY_ACCESS_SEMANTIC, 0);
+        }
+        block->instructions.insert(loadInstruction, before);
+
+        return newRegId;
+    };
+
     // Find every use.
     bool found = false;
     for (auto &[_, block] : blocks) {
         for (auto inst = block->instructions.head; inst; inst = inst->next) {
-            if (inst->usesRegister(regId)) {
-                found = true;
-
-                // Find a new register name for the use.
-                uint32_t newRegId = program->nextReg++;
-                program->resultTypes[newRegId] = typeId;
-
-                // Add a load instruction before the use.
-                LineInfo lineInfo;
-                std::shared_ptr<Instruction> loadInstruction;
-
-                if (isConstant) {
-                    loadInstruction = std::make_shared<RiscVLoadConst>(
-                            lineInfo, typeId, newRegId, regId);
-                } else {
-                    loadInstruction = std::make_shared<RiscVLoad>(
-                            lineInfo, typeId, newRegId, varId, NO_MEMORY_ACCESS_SEMANTIC, 0);
+            if (!inst->usesRegister(regId)) {
+                continue;
+            }
+            found = true;
+
+            if (inst->opcode() == RiscVOpPhi) {
+                // Load at the end of each source block that passes the register.
+                RiscVPhi *phi = dynamic_cast<RiscVPhi *>(inst.get());
+                for (std::vector<uint32_t> &operandIds : phi->operandIds) {
+                    for (size_t j = 0; j < operandIds.size(); j++) {
+                        if (operandIds[j] == regId) {
+                            Block *source = blocks.at(phi->labelIds[j]).get();
+                            operandIds[j] = makeLoad(source, source->instructions.tail);
+                        }
+                    }
                 }
-
-                // Insert before this instruction.
-                block->instructions.insert(loadInstruction, inst);
-
-                // Rename the use.
-                inst->changeArg(regId, newRegId);
-                // XXX do we need to call recomputeArgs() if this is a RiscVPhi?
-
-                // Mark it as needing new liveness info.
-                inst->needLiveness = true;
+                phi->recomputeArgs();
+            } else {
+                // Load before this instruction and rename the use.
+                inst->changeArg(regId, makeLoad(block.get(), inst));
             }
         }
     }
     assert(found);
 
-    if (!isConstant) {
+    if (isConstant) {
+        // The original load is now dead.
+        for (auto &[_, block] : blocks) {
+            for (auto inst = block->instructions.head; inst; inst = inst->next) {
+                if (inst->affectsRegister(regId)) {
+                    block->instructions.erase(inst);
+                    break;
+                }
+            }
+        }
+        rematerializedConstants.erase(remat);
+    } else {
         // Create the store instruction.
         LineInfo lineInfo;
         std::shared_ptr<Instruction> saveInstruction = std::make_shared<RiscVStore>(
                 lineInfo, varId, regId, NO_MEMORY_ACCESS_SEMANTIC, 0);
 
-        // Mark it as needing new liveness info.
-        saveInstruction->needLiveness = true;
-
         // Find the definition.
         found = false;
         for (auto &[_, block] : blocks) {
@@ -543,6 +2045,4 @@ uint32_t Function::spillVariable(Instruction *instruction, const std::set<uint32
         }
         assert(found);
     }
-
-    return regId;
 }
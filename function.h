@@ -1,15 +1,44 @@
 #ifndef FUNCTION_H
 #define FUNCTION_H
 
+#include <functional>
 #include <string>
 #include <map>
 #include <set>
+#include <sstream>
+#include <vector>
 
 #include "risc-v.h"
+#include "timereport.h"
 
 struct Program;
 struct Block;
 
+// Maximum number of floats that can be live at once. This is 31 because
+// the phi copy swap routine assumes f31 is free.
+static const size_t MAX_LIVE_FLOATS = 31;
+
+// Largest loop, in instructions, that we'll produce by unrolling.
+static const size_t UNROLL_SIZE_BUDGET = 256;
+
+// Float registers that must be free in a loop for it to be unrolled.
+static const size_t UNROLL_PRESSURE_MARGIN = 8;
+
+// Iterations assumed for loops whose trip count isn't known, as in spill costs.
+static const int DEFAULT_TRIP_COUNT = 10;
+
+// Natural loop in the control flow graph.
+struct Loop {
+    // Block that dominates the loop and that back edges go to.
+    uint32_t headerId;
+
+    // All blocks in the loop, including the header.
+    std::set<uint32_t> blockIds;
+
+    // Sources of the back edges.
+    std::set<uint32_t> latchIds;
+};
+
 // Info and blocks in a function.
 struct Function {
     // ID of the function.
@@ -31,6 +60,37 @@ struct Function {
     // Map from label ID to Block object.
     std::map<uint32_t, std::shared_ptr<Block>> blocks;
 
+    // Map from a register loaded by rematerializeConstant() to its constant.
+    std::map<uint32_t, uint32_t> rematerializedConstants;
+
+    // Variables created by spillVariable() to hold spilled registers.
+    std::set<uint32_t> spillSlots;
+
+    // Registers spilled by ensureMaxRegisters(), and the most floats that
+    // were live at once before it spilled any.
+    size_t spillCount = 0;
+    size_t maxFloatLiveness = 0;
+
+    // Trip counts of loops unrolled by unrollLoop(), by header, which
+    // constantTripCount() no longer recognizes.
+    std::map<uint32_t, int64_t> unrolledTripCounts;
+
+    // Passes run by Program::runPerFunction() work on several functions at
+    // once. They allocate IDs from the function's own range [nextId, endId)
+    // and keep the registers, types, and variables they make here until the
+    // Program merges them.
+    uint32_t nextId = 0;
+    uint32_t endId = 0;
+    std::map<uint32_t, uint32_t> newResultTypes;
+    std::map<uint32_t, std::shared_ptr<Type>> newTypes;
+    std::map<uint32_t, size_t> newTypeSizes;
+    std::map<uint32_t, Variable> newVariables;
+
+    // Stage times and messages of those passes, also merged by the Program,
+    // in function order.
+    TimeReport timeReport;
+    std::ostringstream log;
+
     Function(uint32_t id, const std::string &name, uint32_t resultType,
             uint32_t functionControl, uint32_t functionType, Program *program) :
 
@@ -41,40 +101,134 @@ struct Function {
         // Nothing.
     }
 
-    // Compute the dominance graph and immediate dominance tree.
+    // Allocate an ID from the function's range, or a register of the type.
+    uint32_t newId();
+    uint32_t newRegister(uint32_t typeId);
+
+    // Whether the ID is a variable, including those made by passes.
+    bool isVariable(uint32_t id) const;
+
+    // Compute the dominance graph and immediate dominance tree. If verbose,
+    // dump them and the instructions to log.
     void computeDomTree(bool verbose);
 
     // Break up phi loops.
     void phiLifting();
     void phiLiftingForBlock(Block *block, RiscVPhi *phi);
 
-    // Make sure that we don't use more registers than we have in hardware.
-    void ensureMaxRegisters();
-
-    // Compute live in and live out registers for each instruction.
-    void computeLiveness(uint32_t spilledRegId);
-
-    // Spill registers if they won't fit in our hardware registers. Returns
-    // the ID of the spilled register, or NO_REGISTER if nothing was spilled.
-    uint32_t spillIfNecessary(const std::set<uint32_t> &alreadySpilled);
+    // Find the natural loops from the back edges of the dominator tree.
+    // Loops that share a header are merged.
+    std::vector<Loop> findLoops() const;
+
+    // Compute each block's loopDepth from the back edges of the dominator tree.
+    void computeLoopDepth();
+
+    // Return the block outside the loop whose only successor is the header
+    // and that's the header's only predecessor outside the loop, or
+    // NO_BLOCK_ID if there isn't one.
+    uint32_t findPreheader(const Loop &loop) const;
+
+    // The only block in the loop with a successor outside it, or NO_BLOCK_ID.
+    uint32_t findExitingBlock(const Loop &loop) const;
+
+    // Number of iterations of a loop of the form "for (i = a; i < b; i += c)"
+    // with constant a, b, and c, or -1 if it's not of that form.
+    int64_t constantTripCount(const Loop &loop) const;
+
+    // Estimated number of times each block runs per call of the function:
+    // the product of the trip counts of the loops it's in. Both sides of a
+    // branch are assumed to run.
+    std::map<uint32_t,double> estimateBlockExecutions() const;
+
+    // Maximum number of floats live at once in the loop. Needs liveness.
+    size_t loopFloatPressure(const Loop &loop);
+
+    // Move pure operations whose operands don't change in the loop to its
+    // preheader, unless that would keep too many floats live across the
+    // loop. Returns the number of instructions moved.
+    int hoistLoopInvariants(const Loop &loop);
+
+    // Unroll a loop of the form "for (i = a; i < b; i += c)" with constant
+    // a, b, and c, by a factor that divides its trip count, if registers
+    // allow. The exit test is kept only in the first copy. Returns whether
+    // the loop was unrolled.
+    bool unrollLoop(const Loop &loop);
+
+    // Hoist invariants out of loops, innermost first, then optionally
+    // unroll innermost loops.
+    void optimizeLoops(bool unroll);
+
+    // Simplify float arithmetic (division by constants, pow() with small
+    // constant exponents, sqrt(x*x)) and, with fuseMultiplyAdd, fuse
+    // single-use multiplies into the add or subtract that consumes them.
+    // With fastMath, division by any constant becomes multiplication by its
+    // reciprocal, not just when exact.
+    void peepholeFloat(bool fastMath, bool fuseMultiplyAdd);
+
+    // Nearest block that dominates the block (or is the block) and isn't
+    // in a loop. Constants used in the block are loaded there.
+    uint32_t rematerializationBlockFor(uint32_t blockId) const;
+
+    // Blocks where the constant would be loaded by rematerializeConstant().
+    std::set<uint32_t> rematerializationBlocks(uint32_t constId) const;
+
+    // Replace the uses of the constant with registers loaded by RiscVLoadConst
+    // once per rematerialization block, instead of keeping the constant in a
+    // register for the whole function.
+    void rematerializeConstant(uint32_t constId);
+
+    // Scalar SSA cleanup: propagate copies, merge identical operations using
+    // value numbering scoped by the dominator tree, and remove operations
+    // whose results aren't used.
+    void optimizeSsa();
+
+    // Most floats that can be live across each instruction: fewer than
+    // MAX_LIVE_FLOATS across a library call that modifies float registers.
+    typedef std::function<size_t(const Instruction *)> FloatLimitFunction;
+
+    // Make sure that we don't use more registers than we have in hardware,
+    // nor more than are left free across each library call.
+    void ensureMaxRegisters(const FloatLimitFunction &maxFloatsAcross);
+
+    // Compute live in and live out registers for each instruction. This is
+    // done per block on bit vectors, then each block is swept backward to
+    // fill in its instructions.
+    void computeLiveness();
+
+    // Cost of spilling each live register: its uses and definition weighted
+    // by loop depth (for constants, the loads that rematerialize them),
+    // divided by the number of instructions it's live at.
+    std::map<uint32_t,float> computeSpillCosts();
+
+    // Spill the cheapest registers at every instruction where too many floats
+    // are live, or are live across it. Registers in "unspillable" are never
+    // picked; spilled registers and their reloads are added to it. Returns
+    // whether anything was spilled.
+    bool spillIfNecessary(std::set<uint32_t> &unspillable,
+            const FloatLimitFunction &maxFloatsAcross);
+
+    // Make spill slots whose values are never needed at the same time share
+    // memory. A slot is live from its store to its last load. Returns the
+    // number of bytes saved.
+    size_t colorSpillSlots();
 
     // Compute set of live ints and floats at this instruction.
     void computeLiveSets(Instruction *instruction,
             std::set<uint32_t> &liveInts,
             std::set<uint32_t> &liveFloats);
 
-    // Spill one of the variables in the set of live floats at this instruction.
-    // Returns the ID of the spilled variable.
-    uint32_t spillVariable(Instruction *instruction, const std::set<uint32_t> &liveFloats,
-            const std::set<uint32_t> &alreadySpilled);
+    // Spill the register: constants are rematerialized, registers that were
+    // loaded from constants are reloaded before each use, and variables are
+    // also stored to a new local variable after their definition.
+    void spillVariable(uint32_t regId, std::set<uint32_t> &unspillable);
 
     // Take "mainImage(vf4;vf2;" and return "mainImage$v4f$vf2".
     static std::string cleanUpName(std::string name);
 
     // Debug dump.
-    void dumpBlockInfo() const;
-    void dumpGraph(const std::set<uint32_t> &unreached) const;
-    void dumpInstructions(const std::string &description) const;
+    void dumpBlockInfo(std::ostream &out) const;
+    void dumpGraph(std::ostream &out, const std::set<uint32_t> &unreached) const;
+    void dumpInstructions(std::ostream &out, const std::string &description) const;
 };
 
 #endif // FUNCTION_H
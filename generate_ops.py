@@ -262,6 +262,7 @@ def generate_instruction(instruction, opname_prefix, opcode_prefix, clip_prefix,
         opcode_structs_f.write("    virtual void step(Interpreter *interpreter) { interpreter->step%s(*this); }\n" % short_opname)
         opcode_structs_f.write("    virtual uint32_t opcode() const { return %s%s%s; }\n" % (opcode_namespace, opcode_prefix, opname))
         opcode_structs_f.write("    virtual std::string name() const { return \"%s\"; }\n" % opname)
+        opcode_structs_f.write("    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<%s>(*this); }\n" % struct_opname)
         if short_opname in compiled_instructions:
             opcode_structs_f.write("    virtual void emit(Compiler *compiler);\n")
         is_branch = opname in ["OpBranch", "OpBranchConditional", "OpSwitch",
@@ -1,4 +1,12 @@
+#include <fstream>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "image.h"
+#include "util.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -38,3 +46,156 @@ ImagePtr loadImage(std::string filename, bool flipInY)
 
     return image;
 }
+
+// ----------------------------------------------------------------------
+// Preconverted texture cache.
+//
+// Each cache file holds one decoded image, already flipped and in the
+// sampler's layout (FORMAT_R8G8B8A8_UNORM rows, bottom-up as loadImage()
+// leaves them), so it can be mapped and used without any conversion.
+
+const uint32_t TextureCacheMagicExpected = 0x31435441;
+const uint32_t TextureCacheVersion = 2;
+struct TextureCacheHeader
+{
+    // All words are little-endian.
+    uint32_t magic = TextureCacheMagicExpected;     // 'ATC1', Alice texture cache
+    uint32_t version = TextureCacheVersion;         // Bumped when the layout changes.
+    uint32_t format;                                // Image::Format of the pixels.
+    uint32_t width;                                 // In pixels.
+    uint32_t height;
+    uint32_t flipped;                               // Whether rows were flipped in Y.
+    int64_t sourceSize;                             // Of the source file, for staleness.
+    int64_t sourceMtime;
+    // Pixels follow, tightly packed.
+};
+
+// Name of the cache file for this source and these options.
+static std::string getTextureCachePathname(const std::string& filename, bool flipInY, const std::string& cacheDirectory)
+{
+    // FNV-1a of the source pathname.
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(unsigned char c: filename) {
+        hash = (hash ^ c) * 0x100000001b3ull;
+    }
+
+    std::string basename = filename.substr(filename.rfind('/') + 1);
+
+    return cacheDirectory + "/" + basename + "." + to_hex(hash) +
+        (flipInY ? "-f" : "") + ".atc";
+}
+
+// Decode "filename" and write the cache file atomically, so that other
+// processes never see a partial file.
+static void writeTextureCacheFile(const std::string& filename, bool flipInY,
+        const struct stat& sourceStat, const std::string& cachePathname)
+{
+    ImagePtr image = loadImage(filename, flipInY);
+
+    TextureCacheHeader header;
+    header.format = image->format;
+    header.width = image->width;
+    header.height = image->height;
+    header.flipped = flipInY;
+    header.sourceSize = sourceStat.st_size;
+    header.sourceMtime = sourceStat.st_mtime;
+
+    std::string tmpPathname = cachePathname + ".tmp" + std::to_string(getpid());
+    std::ofstream cacheFile(tmpPathname, std::ios::out | std::ios::binary);
+    if(!cacheFile.good()) {
+        std::cerr << "couldn't create texture cache file " << tmpPathname << '\n';
+        exit(EXIT_FAILURE);
+    }
+    cacheFile.write(reinterpret_cast<char *>(&header), sizeof(header));
+    cacheFile.write(reinterpret_cast<char *>(image->storage), image->width * image->height * image->pixelSize);
+    cacheFile.close();
+    if(!cacheFile || rename(tmpPathname.c_str(), cachePathname.c_str()) != 0) {
+        std::cerr << "couldn't write texture cache file " << cachePathname << '\n';
+        unlink(tmpPathname.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Map the cache file and wrap it in an Image. Returns null if the file is
+// missing, of the wrong version, or stale with respect to the source.
+static ImagePtr mapTextureCacheFile(const std::string& cachePathname, bool flipInY,
+        const struct stat& sourceStat)
+{
+    int fd = open(cachePathname.c_str(), O_RDONLY);
+    if(fd == -1) {
+        return nullptr;
+    }
+
+    struct stat cacheStat;
+    if(fstat(fd, &cacheStat) != 0 || size_t(cacheStat.st_size) < sizeof(TextureCacheHeader)) {
+        close(fd);
+        return nullptr;
+    }
+
+    void *address = mmap(nullptr, cacheStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(address == MAP_FAILED) {
+        return nullptr;
+    }
+    size_t mappingSize = cacheStat.st_size;
+    std::shared_ptr<void> mapping(address, [mappingSize](void *p) { munmap(p, mappingSize); });
+
+    const TextureCacheHeader& header = *reinterpret_cast<const TextureCacheHeader *>(address);
+    if(header.magic != TextureCacheMagicExpected ||
+            header.version != TextureCacheVersion ||
+            header.format != Image::FORMAT_R8G8B8A8_UNORM ||
+            header.flipped != uint32_t(flipInY) ||
+            header.sourceSize != sourceStat.st_size ||
+            header.sourceMtime != sourceStat.st_mtime) {
+
+        return nullptr;
+    }
+
+    unsigned char *storage = reinterpret_cast<unsigned char *>(address) + sizeof(TextureCacheHeader);
+    ImagePtr image(new Image(Image::FORMAT_R8G8B8A8_UNORM, Image::DIM_2D,
+                header.width, header.height, storage, mapping));
+
+    // Make sure the file holds all the pixels the header claims.
+    size_t expectedSize = size_t(image->width) * image->height * image->pixelSize;
+    if(sizeof(TextureCacheHeader) + expectedSize > mappingSize) {
+        return nullptr;
+    }
+
+    return image;
+}
+
+ImagePtr loadImageCached(std::string filename, bool flipInY, const std::string& cacheDirectory)
+{
+    // Images already mapped by this process, by cache pathname.
+    static std::mutex mappedImagesMutex;
+    static std::map<std::string, std::weak_ptr<Image>> mappedImages;
+
+    struct stat sourceStat;
+    if(stat(filename.c_str(), &sourceStat) != 0) {
+        std::cerr << "couldn't read image from " << filename << '\n';
+        exit(EXIT_FAILURE);
+    }
+
+    std::string cachePathname = getTextureCachePathname(filename, flipInY, cacheDirectory);
+
+    std::lock_guard<std::mutex> lock(mappedImagesMutex);
+
+    ImagePtr image = mappedImages[cachePathname].lock();
+    if(image) {
+        return image;
+    }
+
+    image = mapTextureCacheFile(cachePathname, flipInY, sourceStat);
+    if(!image) {
+        writeTextureCacheFile(filename, flipInY, sourceStat, cachePathname);
+        image = mapTextureCacheFile(cachePathname, flipInY, sourceStat);
+        if(!image) {
+            std::cerr << "couldn't map texture cache file " << cachePathname << '\n';
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    mappedImages[cachePathname] = image;
+
+    return image;
+}
@@ -46,6 +46,10 @@ struct Image
     uint32_t width, height, depth, slices;
     unsigned char *storage;
 
+    // If set, storage points into this (e.g., a read-only memory-mapped
+    // texture cache file) and isn't ours to delete.
+    std::shared_ptr<void> mapping;
+
     unsigned char *getPixelAddress(int i, int j, int k, int l) const
     {
         return storage + (l * depth * width * height + k * width * height + j * width + i) * pixelSize;
@@ -75,13 +79,30 @@ struct Image
         height(h_),
         depth(1),
         slices(1),
-        storage(new unsigned char [width * height * depth * slices * pixelSize])
+        storage(new unsigned char [width * height * depth * slices * pixelSize]())
+    {
+        assert(dim == DIM_2D);
+    }
+    // Wrap storage owned by "mapping_".
+    Image(Format format_, Dim dim_, uint32_t w_, uint32_t h_,
+            unsigned char *storage_, std::shared_ptr<void> mapping_) :
+        format(format_),
+        pixelSize(getPixelSize(format_)),
+        dim(dim_),
+        width(w_),
+        height(h_),
+        depth(1),
+        slices(1),
+        storage(storage_),
+        mapping(mapping_)
     {
         assert(dim == DIM_2D);
     }
     ~Image()
     {
-        delete[] storage;
+        if(!mapping) {
+            delete[] storage;
+        }
     }
 
     // There's probably a clever C++ way to do this with variadic templates...
@@ -173,6 +194,12 @@ typedef std::shared_ptr<Image> ImagePtr;
 
 ImagePtr loadImage(std::string filename, bool flipInY);
 
+// Like loadImage(), but goes through the preconverted texture cache in
+// "cacheDirectory", decoding and writing the cache file only if it's missing
+// or older than the source. The returned image is memory-mapped read-only and
+// is shared with other loads of the same file in this process.
+ImagePtr loadImageCached(std::string filename, bool flipInY, const std::string& cacheDirectory);
+
 struct Sampler
 {
     enum AddressMode {
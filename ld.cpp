@@ -0,0 +1,62 @@
+// Linker.
+
+#include <iostream>
+#include <string>
+#include <cstring>
+
+#include "linker.h"
+
+void usage(char *progname) {
+    std::cerr << "Usage: " << progname << " [options] file.o ...\n";
+    std::cerr << "Options:\n";
+    std::cerr << "    -v         verbose output\n";
+    std::cerr << "    -o file.o  output executable (default out.o)\n";
+    std::cerr << "    -l file.o  library, only the parts used are linked\n";
+}
+
+int main(int argc, char *argv[]) {
+    bool verbose = false;
+    std::string outPathname = "out.o";
+    Linker linker;
+    bool haveObject = false;
+
+    char *progname = argv[0];
+    argv++; argc--;
+
+    // Parse parameters. Objects and libraries are linked in the order given.
+    while (argc > 0) {
+        if (strcmp(argv[0], "-v") == 0) {
+            verbose = true;
+            argv++; argc--;
+        } else if (strcmp(argv[0], "-o") == 0 || strcmp(argv[0], "-l") == 0) {
+            if (argc < 2) {
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            if (argv[0][1] == 'o') {
+                outPathname = argv[1];
+            } else {
+                linker.load(argv[1], true);
+            }
+            argv += 2; argc -= 2;
+        } else if (argv[0][0] == '-') {
+            usage(progname);
+            exit(EXIT_FAILURE);
+        } else {
+            linker.load(argv[0], false);
+            haveObject = true;
+            argv++; argc--;
+        }
+    }
+
+    if (!haveObject) {
+        usage(progname);
+        exit(EXIT_FAILURE);
+    }
+
+    linker.link();
+    linker.save(outPathname);
+    if (verbose) {
+        linker.dumpStatistics(std::cout);
+    }
+}
@@ -0,0 +1,209 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+// Calling convention for the routines in library.s, shared by the compiler
+// and the emulator.
+//
+// Float arguments are passed in fa0 to fa7 and integer arguments in a0 to a7,
+// each class numbered separately. Results come back the same way (fa0 or a0
+// first). The return address is in ra. A routine may change any register in
+// its clobber set; all others (and sp) are preserved.
+//
+// The clobber sets aren't written down anywhere, they're computed from the
+// source of library.s: each routine clobbers every register written by an
+// instruction reachable from its label, including through calls.
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+// Physical register of the first argument of each class. Floats are 32 to 63.
+static const uint32_t LIBRARY_FIRST_INT_ARG = 10;           // a0
+static const uint32_t LIBRARY_FIRST_FLOAT_ARG = 32 + 10;    // fa0
+
+// Number of registers of each class used for arguments and results.
+static const int LIBRARY_ARG_REGISTER_COUNT = 8;
+
+// Map from routine label (".dot3") to the physical registers it may modify.
+typedef std::map<std::string, std::set<uint32_t>> LibraryClobberMap;
+
+// Returns the physical register (0-63) for an assembly register name
+// ("a0", "ft3", "x12"), or -1 if it's not a register.
+inline int parseLibraryRegister(const std::string &name) {
+    struct Prefix {
+        const char *prefix;
+        int first;
+        int last;
+        int start;
+    };
+    // Same names as the assembler.
+    static const Prefix PREFIXES[] = {
+        { "x", 0, 31, 0 },
+        { "t", 0, 2, 5 },
+        { "s", 0, 1, 8 },
+        { "a", 0, 7, 10 },
+        { "s", 2, 11, 18 },
+        { "t", 3, 6, 28 },
+        { "f", 0, 31, 32 + 0 },
+        { "ft", 0, 7, 32 + 0 },
+        { "fs", 0, 1, 32 + 8 },
+        { "fa", 0, 7, 32 + 10 },
+        { "fs", 2, 11, 32 + 18 },
+        { "ft", 8, 11, 32 + 28 },
+    };
+
+    if (name == "zero") return 0;
+    if (name == "ra") return 1;
+    if (name == "sp") return 2;
+    if (name == "gp") return 3;
+    if (name == "tp") return 4;
+    if (name == "fp") return 8;
+
+    size_t digits = name.find_first_of("0123456789");
+    if (digits == 0 || digits == std::string::npos ||
+            name.find_first_not_of("0123456789", digits) != std::string::npos) {
+
+        return -1;
+    }
+    std::string prefix = name.substr(0, digits);
+    int number = std::stoi(name.substr(digits));
+    for (const Prefix &p : PREFIXES) {
+        if (prefix == p.prefix && number >= p.first && number <= p.last) {
+            return number - p.first + p.start;
+        }
+    }
+
+    return -1;
+}
+
+// Compute the clobber set of every label in the text segment of the
+// assembly source.
+inline LibraryClobberMap computeLibraryClobbers(const std::string &source) {
+    // One run of instructions between labels.
+    struct Chunk {
+        // Registers written in this chunk.
+        std::set<uint32_t> written;
+        // Labels we might continue to: branches, jumps, calls, fall-through.
+        std::set<std::string> next;
+    };
+    std::map<std::string, Chunk> chunks;
+    std::string label;
+    bool inText = true;
+    bool fallsThrough = false;
+
+    std::istringstream in(source);
+    std::string line;
+    while (std::getline(in, line)) {
+        // Strip comment.
+        line = line.substr(0, line.find(';'));
+
+        std::istringstream words(line);
+        std::string op;
+        if (!(words >> op)) {
+            continue;
+        }
+
+        if (op == ".segment") {
+            std::string segment;
+            words >> segment;
+            inText = segment == "text";
+            fallsThrough = false;
+            continue;
+        }
+        if (!inText) {
+            continue;
+        }
+
+        if (op.back() == ':') {
+            std::string newLabel = op.substr(0, op.size() - 1);
+            if (fallsThrough) {
+                chunks[label].next.insert(newLabel);
+            }
+            label = newLabel;
+            chunks[label];
+            fallsThrough = true;
+            if (!(words >> op)) {
+                continue;
+            }
+        }
+        if (op[0] == '.' || label.empty()) {
+            // Directive, or code before any label.
+            continue;
+        }
+
+        // Split operands at commas.
+        std::vector<std::string> operands;
+        std::string rest;
+        std::getline(words, rest);
+        std::istringstream restStream(rest);
+        std::string operand;
+        while (std::getline(restStream, operand, ',')) {
+            size_t begin = operand.find_first_not_of(" \t");
+            size_t end = operand.find_last_not_of(" \t");
+            operands.push_back(begin == std::string::npos ? "" :
+                    operand.substr(begin, end - begin + 1));
+        }
+
+        Chunk &chunk = chunks[label];
+        bool isStore = op == "sw" || op == "sh" || op == "sb" || op == "fsw";
+        bool isBranch = op[0] == 'b';
+        if (!isStore && !isBranch && !operands.empty()) {
+            int reg = parseLibraryRegister(operands[0]);
+            // Writes to x0 are discarded, and sp is always restored.
+            if (reg > 2 || reg == 1) {
+                chunk.written.insert(reg);
+            }
+        }
+        if ((isBranch || op == "jal") && !operands.empty()) {
+            chunk.next.insert(operands.back());
+        }
+
+        // Unconditional jumps and returns don't fall through. Calls do.
+        if ((op == "jalr" || op == "jal") && parseLibraryRegister(operands[0]) == 0) {
+            fallsThrough = false;
+        } else {
+            fallsThrough = true;
+        }
+    }
+
+    // Each label clobbers everything written in the chunks it can reach.
+    LibraryClobberMap clobbers;
+    for (auto &[routine, _] : chunks) {
+        std::set<uint32_t> &routineClobbers = clobbers[routine];
+        std::set<std::string> visited;
+        std::vector<std::string> stack = { routine };
+        while (!stack.empty()) {
+            std::string current = stack.back();
+            stack.pop_back();
+            auto itr = chunks.find(current);
+            if (itr == chunks.end() || !visited.insert(current).second) {
+                continue;
+            }
+            routineClobbers.insert(itr->second.written.begin(), itr->second.written.end());
+            stack.insert(stack.end(), itr->second.next.begin(), itr->second.next.end());
+        }
+    }
+
+    return clobbers;
+}
+
+// Load the library source and compute its clobber sets. Exits on error.
+inline LibraryClobberMap loadLibraryClobbers(const std::string &pathname) {
+    std::ifstream file(pathname);
+    if (!file.good()) {
+        std::cerr << "Error: Can't open library source \"" << pathname << "\".\n";
+        exit(EXIT_FAILURE);
+    }
+    std::stringstream ss;
+    ss << file.rdbuf();
+
+    return computeLibraryClobbers(ss.str());
+}
+
+#endif // LIBRARY_H
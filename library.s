@@ -3,6 +3,13 @@
 ; library.s
 ;
 ; library of math functions
+;
+; Calling convention: float arguments are in fa0-fa7 and integer arguments
+; in a0-a7, each numbered separately, and results are returned the same way.
+; Routines don't save any registers. The compiler computes which registers
+; each routine may change (see library.h) by following fall-through, branches,
+; jumps, and calls from its label, so all of a routine's code must be reachable
+; that way.
 
 .segment data
 
@@ -211,32 +218,17 @@
 .sin:
         ; XXX this is different enough from emulation that it causes substantial visual differences between wetrock and flirt 
 
-        ; save registers
-        sw      a0,-4(sp)
-        sw      a1,-8(sp)
-        sw      a2,-12(sp)
-        sw      a3,-16(sp)
-        sw      a4,-20(sp)
-        sw      a5,-24(sp)
-        fsw     ft0,-28(sp)
-        fsw     ft1,-32(sp)
-        fsw     ft2,-36(sp)
-        fsw     ft3,-40(sp)
-        fsw     ft4,-44(sp)
-        fsw     ft5,-48(sp)
-        fsw     ft6,-52(sp)
-
-        flw     ft0, 0(sp)       ; load first parameter ("x"), doesn't have to be into ft0
+        ; Parameter x is in fa0.
 
         ; .oneOverTwoPi is 1/(2pi)
         ; .sinTableSize is 512.0
         ; .one is 1.0
         ; sinTable_f32 is 513 long
 
-        ; ft2<u> = ft0<x> * ft1<1 / (2 * pi)>
+        ; ft2<u> = fa0<x> * ft1<1 / (2 * pi)>
 	lui	a5,%hi(.oneOverTwoPi)
 	flw	ft1,%lo(.oneOverTwoPi)(a5)
-	fmul.s	ft2,ft0,ft1
+	fmul.s	ft2,fa0,ft1
 
         ; ft3<indexf> = ft2<u> * ft1<tablesize>
 	lui	a5,%hi(.sinTableSize)
@@ -258,10 +250,7 @@
         ; a2<lower> = a1<index> & imm<tablemask>
 	andi	a2,a1,511
 
-        ; a3<upper> = a2<lower> + imm<1>
-        addi     a3,a2,1
-
-        ; ; ft0<result> = table[a2<lower>] * ft4<alpha> + table[a3<upper>] * ft6<beta>
+        ; ; fa0<result> = table[a2<lower>] * ft4<alpha> + table[a2<lower> + 1] * ft6<beta>
         ; a1 = table + a2 * 4
         lui     a5,%hi(sinTable_f32)
         addi    a5,a5,%lo(sinTable_f32)
@@ -278,33 +267,12 @@
         ; ft3 = ft2 * ft6
         fmul.s    ft3,ft2,ft6
 
-        ; ft0 = ft1 * ft4 + ft0
-        ; for the following, would prefer: fmadd.s   ft0,ft1,ft4,ft3
+        ; fa0 = ft1 * ft4 + ft3
+        ; for the following, would prefer: fmadd.s   fa0,ft1,ft4,ft3
         fmul.s  ft2,ft1, ft4
-        fadd.s  ft0, ft2, ft3
-
-        ; XXX debugging - multiply by .5
-	; lui	a5,%hi(.point5)
-	; flw	ft1,%lo(.point5)(a5)
-        ; fmul.s    ft0,ft0,ft1
-
-        fsw     ft0, 0(sp)      ; store return value
-        ; restore registers
-        lw      a0,-4(sp)
-        lw      a1,-8(sp)
-        lw      a2,-12(sp)
-        lw      a3,-16(sp)
-        lw      a4,-20(sp)
-        lw      a5,-24(sp)
-        flw     ft0,-28(sp)
-        flw     ft1,-32(sp)
-        flw     ft2,-36(sp)
-        flw     ft3,-40(sp)
-        flw     ft4,-44(sp)
-        flw     ft5,-48(sp)
-        flw     ft6,-52(sp)
-
-        jalr x0, ra, 0                
+        fadd.s  fa0, ft2, ft3           ; return value
+
+        jalr x0, ra, 0
 
 .segment data
 .sinTableSize:
@@ -960,28 +928,16 @@ atanTable_f32:
 
 .segment text
 .atan_0_1:
-
-        fsw     ft0, -4(sp)
-        fsw     ft1, -8(sp)
-        fsw     ft2, -12(sp)
-        fsw     ft3, -16(sp)
-        fsw     ft4, -20(sp)
-        fsw     ft5, -24(sp)
-        sw     a0, -28(sp)
-        sw     a1, -32(sp)
-        sw     a2, -36(sp)
-
         ; atan_0_1(float z) { }
-        flw     ft0, 0(sp)              ; ft0 = z
+        ; fa0 = z
 
         ; int i = z * TABLE_POW2;
 	lui	a1,%hi(.atanTableSize)  ; a1 = hi part of address of TABLE_POW2
 	flw	ft1,%lo(.atanTableSize)(a1)      ; ft1 = TABLE_POW2
         ; a1 is available after this line
-        fmul.s    ft2, ft0, ft1         ; ft2 = z * TABLE_POW2
+        fmul.s    ft2, fa0, ft1         ; ft2 = z * TABLE_POW2
 	fcvt.w.s        a0,ft2,rdn      ; a0 = ifloor(z * TABLE_POW2)
         ; ft1 is available after this line
-        ; ft0 is available after this line
 
         ; float a = z * TABLE_POW2 - i;
         ; ft3 = a
@@ -1010,46 +966,23 @@ atanTable_f32:
         fsub.s  ft1,ft0,ft3             ; ft1 = 1.0 - a
         fmul.s  ft0,ft4,ft1             ; ft0 = lower * (1.0 - a)
 
-        ; for the following, would prefer: fmadd.s ft1,ft5,ft3,ft0
-        fmul.s  ft2, ft5, ft3 ; ft1 = higher * a + lower * (1.0 - a)
-        fadd.s  ft1, ft2, ft0
+        ; for the following, would prefer: fmadd.s fa0,ft5,ft3,ft0
+        fmul.s  ft2, ft5, ft3 ; fa0 = higher * a + lower * (1.0 - a)
+        fadd.s  fa0, ft2, ft0
 
         ; return f;
-        fsw     ft1, 0(sp)
-
-        ; restore registers
-        flw     ft0, -4(sp)
-        flw     ft1, -8(sp)
-        flw     ft2, -12(sp)
-        flw     ft3, -16(sp)
-        flw     ft4, -20(sp)
-        flw     ft5, -24(sp)
-        lw     a0, -28(sp)
-        lw     a1, -32(sp)
-        lw     a2, -36(sp)
-
         jalr x0, ra, 0
 
 .atan:
-        ; save registers
-        sw      a0, -4(sp)
-        sw      a1, -8(sp)
-        fsw     ft0, -12(sp)
-        fsw     ft1, -16(sp)
-        fsw     ft2, -20(sp)
-        fsw     ft3, -24(sp)
-        fsw     ft4, -28(sp)
-        fsw     ft5, -32(sp)
-        fsw     ft6, -36(sp)
-
-        ; load parameter
-        ; begin using ft0
-        flw     ft0, 0(sp)      ; float atan(float y_x) {}
-
-        addi    sp,sp,-36        ; push saved registers
+        ; float atan(float y_x) {}
+        addi    sp, sp, -4      ; Make room on stack
+        sw      ra, 0(sp)       ; Save return address
+
+        ; Keep y_x in ft6, which .atan_0_1 doesn't touch.
+        fsgnj.s ft6, fa0, fa0
 
         ; begin using ft2
-        fsgnjx.s ft2, ft0, ft0     ; float ft2 = fabs_y_x = fabs(y_x)
+        fsgnjx.s ft2, ft6, ft6     ; float ft2 = fabs_y_x = fabs(y_x)
 
         ; if(fabsf(y_x) > 1.0) {
 	lui	a0,%hi(.one)
@@ -1060,76 +993,39 @@ atanTable_f32:
         ; a1 is available after this line
 
         ;     return copysign(M_PI / 2.0, y_x) + -copysign(brad_atan_0_1(1.0 / fabs(y_x)), y_x);
-        ; begin using ft3
-        fdiv.s  ft3, ft1, ft2
-
-        addi    sp, sp, -8      ; Make room on stack
-        sw      ra, 4(sp)       ; Save return address
-        fsw     ft3, 0(sp)      ; Store parameter
-        ; ft3 is available after this line
-
-        jal     ra, .atan_0_1   
+        fdiv.s  fa0, ft1, ft2   ; Parameter
 
-        ; begin using ft3
-        flw     ft3, 0(sp)      ; Pop result
-        lw      ra, 4(sp)       ; Restore return address
-        addi    sp, sp, 8       ; Restore stack
+        jal     ra, .atan_0_1   ; fa0 = atan_0_1(1.0 / fabs(y_x))
 
 	lui	a0,%hi(.halfPi)
         ; begin using ft4
 	flw	ft4,%lo(.halfPi)(a0)
         ; begin using ft5
-        fsgnj.s   ft5, ft4, ft0
+        fsgnj.s   ft5, ft4, ft6
         ; ft4 is available after this line
 
-        ; begin using ft6
-        fsgnjn.s ft6, ft3, ft0
-        ; ft3 is available after this line
+        ; begin using ft7
+        fsgnjn.s ft7, fa0, ft6
 
-        ; begin using ft4
-        fadd.s  ft4, ft5, ft6
-        ; ft6 is available after this line
+        fadd.s  fa0, ft5, ft7
+        ; ft7 is available after this line
         ; ft5 is available after this line
 
         jal zero, .atan_finish   ; goto .atan_finish
 
 .atan_small_y_x: ; } else {
 
-        addi    sp, sp, -8      ; Make room on stack
-        sw      ra, 4(sp)       ; Save return address
-        fsw     ft2, 0(sp)      ; Store parameter
+        fsgnj.s fa0, ft2, ft2   ; Parameter
         ; ft2 is available after this line
 
-        jal     ra, .atan_0_1   
+        jal     ra, .atan_0_1   ; fa0 = atan_0_1(fabs(y_x))
 
-        ; begin using ft2
-        flw     ft2, 0(sp)      ; Pop result
-        lw      ra, 4(sp)       ; Restore return address
-        addi    sp, sp, 8       ; Restore stack
+        fsgnj.s   fa0, fa0, ft6
+        ; ft6 is available after this line
 
-        ; begin using ft4
-        fsgnj.s   ft4, ft2, ft0
-        ; ft2 is available after this line
-        ; ft0 is available after this line
-        
 .atan_finish:
-
-        addi    sp,sp,36        ; pop saved registers
-
-        ; store return value
-        fsw     ft4, 0(sp)
-        ; ft4 is available after this line
-
-        ; restore registers
-        lw      a0, -4(sp)
-        lw      a1, -8(sp)
-        flw     ft0, -12(sp)
-        flw     ft1, -16(sp)
-        flw     ft2, -20(sp)
-        flw     ft3, -24(sp)
-        flw     ft4, -28(sp)
-        flw     ft5, -32(sp)
-        flw     ft6, -36(sp)
+        lw      ra, 0(sp)       ; Restore return address
+        addi    sp, sp, 4       ; Restore stack
 
         ; return
         jalr x0, ra, 0
@@ -1143,58 +1039,26 @@ atanTable_f32:
         jalr x0, ra, 0
 
 .reflect3:
-        ; Save registers.
-        fsw     ft0, -4(sp)
-        fsw     ft1, -8(sp)
-        fsw     ft2, -12(sp)
-        fsw     ft3, -16(sp)
-        fsw     ft4, -20(sp)
-        fsw     ft5, -24(sp)
-        fsw     ft6, -28(sp)
-        fsw     ft7, -32(sp)
-
-        ; Parameters.
-        flw     ft0, 0(sp)                  ; ix
-        flw     ft1, 4(sp)                  ; iy
-        flw     ft2, 8(sp)                  ; iz
-        flw     ft3, 12(sp)                 ; nx
-        flw     ft4, 16(sp)                 ; ny
-        flw     ft5, 20(sp)                 ; nz
+        ; Parameters i in fa0-fa2, n in fa3-fa5.
 
         ; Dot product of i and n.
-        fmul.s  ft6, ft0, ft3               ; ix*nx
-        fmul.s  ft7, ft1, ft4               ; iy*ny
+        fmul.s  ft6, fa0, fa3               ; ix*nx
+        fmul.s  ft7, fa1, fa4               ; iy*ny
         fadd.s  ft6, ft6, ft7               ; ix*nx + iy*ny
-        fmul.s  ft7, ft2, ft5               ; iz*nz
+        fmul.s  ft7, fa2, fa5               ; iz*nz
         fadd.s  ft6, ft6, ft7               ; ix*nx + iy*ny + iz*nz
 
         ; Double dot product.
         fadd.s  ft6, ft6, ft6
 
-        fmul.s  ft7, ft6, ft3               ; 2*dot*nx
-        fsub.s  ft0, ft0, ft7               ; ix - 2*dot*nx
-        fsw     ft0, 12(sp)
-
-        fmul.s  ft7, ft6, ft4               ; 2*dot*ny
-        fsub.s  ft1, ft1, ft7               ; iy - 2*dot*ny
-        fsw     ft1, 16(sp)
+        fmul.s  ft7, ft6, fa3               ; 2*dot*nx
+        fsub.s  fa0, fa0, ft7               ; ix - 2*dot*nx
 
-        fmul.s  ft7, ft6, ft5               ; 2*dot*nz
-        fsub.s  ft2, ft2, ft7               ; iz - 2*dot*nz
-        fsw     ft2, 20(sp)
+        fmul.s  ft7, ft6, fa4               ; 2*dot*ny
+        fsub.s  fa1, fa1, ft7               ; iy - 2*dot*ny
 
-        ; Restore registers.
-        flw     ft0, -4(sp)
-        flw     ft1, -8(sp)
-        flw     ft2, -12(sp)
-        flw     ft3, -16(sp)
-        flw     ft4, -20(sp)
-        flw     ft5, -24(sp)
-        flw     ft6, -28(sp)
-        flw     ft7, -32(sp)
-
-        ; We took six parameters and return three, so fix up stack.
-        addi    sp, sp, 12
+        fmul.s  ft7, ft6, fa5               ; 2*dot*nz
+        fsub.s  fa2, fa2, ft7               ; iz - 2*dot*nz
 
         ; Return.
         jalr    x0, ra, 0
@@ -1215,124 +1079,64 @@ atanTable_f32:
         ; to detect integer b when a < 0. See "man powf" for a full
         ; list of the special cases.
 
-        ; Save registers.
-        sw      ra, -4(sp)
-        fsw     ft0, -8(sp)
-        fsw     ft1, -12(sp)
-
-        flw     ft0, 0(sp)                  ; Parameter a.
-        flw     ft1, 4(sp)                  ; Parameter b.
+        ; Parameter a is in fa0, b in fa1.
+        addi    sp, sp, -8                  ; Make room on stack.
+        sw      ra, 4(sp)                   ; Save return address.
+        fsw     fa1, 0(sp)                  ; Save parameter b.
 
         ; Compute log2(a).
-        addi    sp, sp, -16                 ; Make room on stack.
-        fsw     ft0, 0(sp)                  ; Store parameter.
         jal     ra, .log2                   ; Call our log2 function.
-        flw     ft0, 0(sp)                  ; Pop result.
 
         ; Multiply by parameter b.
-        fmul.s  ft1, ft1, ft0
+        flw     ft1, 0(sp)
+        fmul.s  fa0, ft1, fa0
 
         ; Compute exp2(b*log2(a)).
-        fsw     ft1, 0(sp)                  ; Store parameter.
         jal     ra, .exp2                   ; Call our exp2 function.
-        flw     ft1, 0(sp)                  ; Pop result.
-        addi    sp, sp, 16                  ; Restore stack.
 
-        ; Return value.
-        fsw     ft1, 4(sp)
-
-        ; Restore registers.
-        lw      ra, -4(sp)
-        flw     ft0, -8(sp)
-        flw     ft1, -12(sp)
-
-        ; We took two parameters and return one, so fix up stack.
-        addi    sp, sp, 4
+        lw      ra, 4(sp)                   ; Restore return address.
+        addi    sp, sp, 8                   ; Restore stack.
 
         ; Return.
         jalr x0, ra, 0
 
 .clamp:
-        ; Save registers.
-        fsw     ft0, -4(sp)
-        fsw     ft1, -8(sp)
-
-        flw     ft0, 0(sp)                  ; Parameter x.
-        flw     ft1, 4(sp)                  ; Parameter minVal.
-        fmax.s  ft0, ft0, ft1               ; max(x, minVal).
-        flw     ft1, 8(sp)                  ; Parameter maxVal.
-        fmin.s  ft0, ft0, ft1               ; min(max(x, minVal), maxVal).
-
-        ; Return value.
-        fsw     ft0, 8(sp)
-
-        ; Restore registers.
-        flw     ft0, -4(sp)
-        flw     ft1, -8(sp)
-
-        ; We took three parameters and return one, so fix up stack.
-        addi    sp, sp, 8
+        ; Parameters x, minVal, and maxVal are in fa0-fa2.
+        fmax.s  fa0, fa0, fa1               ; max(x, minVal).
+        fmin.s  fa0, fa0, fa2               ; min(max(x, minVal), maxVal).
 
         ; Return.
         jalr    x0, ra, 0
 
 .mix:
         ; Mixes between x and y according to a: x*(1.0 - a) + y*a
+        ; Parameters x, y, and a are in fa0-fa2.
 
-        ; Save registers.
-        fsw     ft0, -4(sp)
-        fsw     ft1, -8(sp)
-        fsw     ft2, -16(sp)
-
-        flw     ft1, 4(sp)                  ; Parameter y.
-        flw     ft2, 8(sp)                  ; Parameter a.
-        fmul.s  ft1, ft1, ft2               ; y*a
+        fmul.s  fa1, fa1, fa2               ; y*a
         flw     ft0, .one(zero)             ; 1.0
-        fsub.s  ft2, ft0, ft2               ; 1.0 - a
-        flw     ft0, 0(sp)                  ; Parameter x.
-        fmul.s  ft0, ft0, ft2               ; x*(1.0 - a)
-        fadd.s  ft0, ft0, ft1               ; x*(1.0 - a) + y*a
-
-        ; Return value.
-        fsw     ft0, 8(sp)
-
-        ; Restore registers.
-        flw     ft0, -4(sp)
-        flw     ft1, -8(sp)
-        flw     ft2, -16(sp)
-
-        ; We took three parameters and return one, so fix up stack.
-        addi    sp, sp, 8
+        fsub.s  ft0, ft0, fa2               ; 1.0 - a
+        fmul.s  fa0, fa0, ft0               ; x*(1.0 - a)
+        fadd.s  fa0, fa0, fa1               ; x*(1.0 - a) + y*a
 
         ; Return.
         jalr x0, ra, 0
 
 .smoothstep:
-        ; Save registers.
-        fsw     ft0, -4(sp)
-        fsw     ft1, -8(sp)
-        fsw     ft2, -12(sp)
-        fsw     ft3, -16(sp)
-        fsw     ft4, -20(sp)
-        sw      a0, -24(sp)
-
-        flw     ft0, 0(sp)                  ; Parameter edge0.
-        flw     ft1, 4(sp)                  ; Parameter edge1.
-        flw     ft2, 8(sp)                  ; Parameter x.
-
-        fsub.s  ft3, ft1, ft0               ; edge1 - edge0
+        ; Parameters edge0, edge1, and x are in fa0-fa2.
+
+        fsub.s  ft3, fa1, fa0               ; edge1 - edge0
         ; XXX use fclass.s
         fmv.s.x ft4, zero                   ; 0.0
         feq.s   a0, ft3, ft4                ; edge1 - edge0 == 0.0?
         beq     a0, zero, .smoothstep_not_equal
 
         ; Answer is undefined when edge0 and edge1 are equal.
-        fmv.s.x ft0, zero                   ; 0.0
-        jal     x0, .smoothstep_return
+        fmv.s.x fa0, zero                   ; 0.0
+        jalr    x0, ra, 0
 
 .smoothstep_not_equal:
         ; Compute position of x between edge0 and edge1 in range [0.0,1.0] (unclamped).
-        fsub.s  ft4, ft2, ft0               ; x - edge0
+        fsub.s  ft4, fa2, fa0               ; x - edge0
         fdiv.s  ft4, ft4, ft3               ; t = (x - edge0)/(edge1 - edge0)
 
         ; Clamped to [0.0,1.0].
@@ -1346,22 +1150,7 @@ atanTable_f32:
         flw     ft1, .three(zero)           ; 3
         fsub.s  ft0, ft1, ft0               ; 3 - 2*t
         fmul.s  ft0, ft0, ft4               ; t*(3 - 2*t)
-        fmul.s  ft0, ft0, ft4               ; t*t*(3 - 2*t)
-
-.smoothstep_return:
-        ; Return value.
-        fsw     ft0, 8(sp)
-
-        ; Restore registers.
-        flw     ft0, -4(sp)
-        flw     ft1, -8(sp)
-        flw     ft2, -12(sp)
-        flw     ft3, -16(sp)
-        flw     ft4, -20(sp)
-        lw      a0, -24(sp)
-
-        ; We took three parameters and return one, so fix up stack.
-        addi    sp, sp, 8
+        fmul.s  fa0, ft0, ft4               ; t*t*(3 - 2*t)
 
         ; Return.
         jalr    x0, ra, 0
@@ -1375,23 +1164,12 @@ atanTable_f32:
         jalr x0, ra, 0
 
 .normalize3:
-        ; Save registers.
-        fsw     ft0, -4(sp)
-        fsw     ft1, -8(sp)
-        fsw     ft2, -12(sp)
-        fsw     ft3, -16(sp)
-        fsw     ft4, -20(sp)
-        sw      ra, -24(sp)
-
-        ; Parameters.
-        flw     ft0, 0(sp)                  ; x
-        flw     ft1, 4(sp)                  ; y
-        flw     ft2, 8(sp)                  ; z
-
-        fmul.s  ft3, ft0, ft0               ; x^2
-        fmul.s  ft4, ft1, ft1               ; y^2
+        ; Parameters x, y, and z are in fa0-fa2.
+
+        fmul.s  ft3, fa0, fa0               ; x^2
+        fmul.s  ft4, fa1, fa1               ; y^2
         fadd.s  ft3, ft3, ft4               ; x^2 + y^2
-        fmul.s  ft4, ft2, ft2               ; z^2
+        fmul.s  ft4, fa2, fa2               ; z^2
         fadd.s  ft3, ft3, ft4               ; x^2 + y^2 + z^2
 
         fsqrt.s ft3, ft3
@@ -1401,22 +1179,9 @@ atanTable_f32:
         fdiv.s  ft3, ft4, ft3               ; 1.0/sqrt()
 
         ; Divide vector by length.
-        fmul.s  ft0, ft0, ft3               ; x /= sqrt()
-        fmul.s  ft1, ft1, ft3               ; y /= sqrt()
-        fmul.s  ft2, ft2, ft3               ; z /= sqrt()
-
-        ; Return values.
-        fsw     ft0, 0(sp)
-        fsw     ft1, 4(sp)
-        fsw     ft2, 8(sp)
-
-        ; Restore registers.
-        flw     ft0, -4(sp)
-        flw     ft1, -8(sp)
-        flw     ft2, -12(sp)
-        flw     ft3, -16(sp)
-        flw     ft4, -20(sp)
-        lw      ra, -24(sp)
+        fmul.s  fa0, fa0, ft3               ; x /= sqrt()
+        fmul.s  fa1, fa1, ft3               ; y /= sqrt()
+        fmul.s  fa2, fa2, ft3               ; z /= sqrt()
 
         ; Return.
         jalr    x0, ra, 0
@@ -1434,21 +1199,7 @@ atanTable_f32:
         ; to the library, so make a judgement call that adding 46 more words but only making
         ; .cos 3.6% slower and completely removing the cosine table is a good tradeoff.
 
-        sw      a0,-4(sp)
-        sw      a1,-8(sp)
-        sw      a2,-12(sp)
-        sw      a3,-16(sp)
-        sw      a4,-20(sp)
-        sw      a5,-24(sp)
-        fsw     ft0,-28(sp)
-        fsw     ft1,-32(sp)
-        fsw     ft2,-36(sp)
-        fsw     ft3,-40(sp)
-        fsw     ft4,-44(sp)
-        fsw     ft5,-48(sp)
-        fsw     ft6,-52(sp)
-
-        flw     ft0, 0(sp)       ; load first parameter ("x"), doesn't have to be into ft0
+        ; Parameter x is in fa0.
 
         ; .oneOverTwoPi is 1/(2pi)
         ; .sinTableSize is 512.0
@@ -1459,12 +1210,12 @@ atanTable_f32:
 	lui	a5,%hi(.point25)
 	flw	ft3,%lo(.point25)(a5)
 
-        ; ft2<u> = ft0<x> * ft1<1 / (2 * pi)> + ft3(1/4)
+        ; ft2<u> = fa0<x> * ft1<1 / (2 * pi)> + ft3(1/4)
 	lui	a5,%hi(.oneOverTwoPi)
 	flw	ft1,%lo(.oneOverTwoPi)(a5)
 
-        ; for the following, would prefer: fmadd.s   ft2,ft0,ft1,ft3
-        fmul.s  ft4, ft0, ft1
+        ; for the following, would prefer: fmadd.s   ft2,fa0,ft1,ft3
+        fmul.s  ft4, fa0, ft1
         fadd.s  ft2, ft4, ft3
 
         ; ft3<indexf> = ft2<u> * ft1<tablesize>
@@ -1490,7 +1241,7 @@ atanTable_f32:
         ; a3<upper> = a2<lower> + imm<1>
         addi     a3,a2,1
 
-        ; ft0<result> = table[a2<lower>] * ft4<alpha> + table[a3<upper>] * ft6<beta>
+        ; fa0<result> = table[a2<lower>] * ft4<alpha> + table[a3<upper>] * ft6<beta>
         ; a1 = table + a2 * 4
         lui     a5,%hi(sinTable_f32)
         addi    a5,a5,%lo(sinTable_f32)
@@ -1513,48 +1264,16 @@ atanTable_f32:
         ; ft3 = ft2 * ft6
         fmul.s    ft3,ft2,ft6
 
-        ; ft0 = ft1 * ft4 + ft0
-        ; for the following, would prefer: fmadd.s   ft0,ft1,ft4,ft3
+        ; fa0 = ft1 * ft4 + ft3
+        ; for the following, would prefer: fmadd.s   fa0,ft1,ft4,ft3
         fmul.s  ft2, ft1, ft4
-        fadd.s  ft0, ft2, ft3
-
-        ; XXX debugging - multiply by .5
-	; lui	a5,%hi(.point5)
-	; flw	ft1,%lo(.point5)(a5)
-        ; fmul.s    ft0,ft0,ft1
-
-        fsw     ft0, 0(sp)      ; store return value
-        ; restore registers
-        lw      a0,-4(sp)
-        lw      a1,-8(sp)
-        lw      a2,-12(sp)
-        lw      a3,-16(sp)
-        lw      a4,-20(sp)
-        lw      a5,-24(sp)
-        flw     ft0,-28(sp)
-        flw     ft1,-32(sp)
-        flw     ft2,-36(sp)
-        flw     ft3,-40(sp)
-        flw     ft4,-44(sp)
-        flw     ft5,-48(sp)
-        flw     ft6,-52(sp)
-
-        jalr x0, ra, 0                
+        fadd.s  fa0, ft2, ft3           ; return value
 
-.log2:
-        ; Save registers.
-        sw      a0, -4(sp)
-        sw      a1, -8(sp)
-        sw      a2, -12(sp)
-        fsw     ft0, -16(sp)
-        fsw     ft1, -20(sp)
-        fsw     ft2, -24(sp)
-        fsw     ft3, -28(sp)
-        fsw     ft4, -32(sp)
-        fsw     ft5, -36(sp)
+        jalr x0, ra, 0
 
+.log2:
         ; Fetch parameter.
-        flw     ft0, 0(sp)
+        fsgnj.s ft0, fa0, fa0
 
         ; Check for negative. Log of any negative value is undefined.
         ; XXX Should use fclass.s here.
@@ -1678,32 +1397,14 @@ atanTable_f32:
 
 .log2_ret:
         ; Return value.
-        fsw     ft0, 0(sp)
-
-        ; Restore registers.
-        lw      a0, -4(sp)
-        lw      a1, -8(sp)
-        lw      a2, -12(sp)
-        flw     ft0, -16(sp)
-        flw     ft1, -20(sp)
-        flw     ft2, -24(sp)
-        flw     ft3, -28(sp)
-        flw     ft4, -32(sp)
-        flw     ft5, -36(sp)
+        fsgnj.s fa0, ft0, ft0
 
         ; Return.
         jalr x0, ra, 0
 
 .exp2:
-        ; Save registers.
-        sw      a0, -4(sp)
-        sw      a1, -8(sp)
-        fsw     ft0, -12(sp)
-        fsw     ft1, -16(sp)
-        fsw     ft2, -20(sp)
-
         ; Fetch parameter.
-        flw     ft0, 0(sp)
+        fsgnj.s ft0, fa0, fa0
 
         ; Round to nearest.
         ; XXX rne isn't yet implemented in Verilog. See issue #6.
@@ -1767,80 +1468,28 @@ atanTable_f32:
 
 .exp2_ret:
         ; Return value.
-        fsw     ft0, 0(sp)
-
-        ; Restore registers.
-        lw      a0, -4(sp)
-        lw      a1, -8(sp)
-        flw     ft0, -12(sp)
-        flw     ft1, -16(sp)
-        flw     ft2, -20(sp)
+        fsgnj.s fa0, ft0, ft0
 
         ; Return.
         jalr x0, ra, 0
 
 .exp:
-        ; Save registers.
-        sw      ra, -4(sp)
-        fsw     ft0, -8(sp)
-        fsw     ft1, -12(sp)
-
-        ; Fetch parameter.
-        flw     ft0, 0(sp)
+        ; Parameter x is in fa0.
 
         ; exp(x) = exp2(x*log2(e))
         flw     ft1, .log2_of_e(x0)
-        fmul.s  ft0, ft0, ft1
-
-        addi    sp, sp, -16     ; Make room on stack
-        fsw     ft0, 0(sp)      ; Store parameter
-
-        ; Call our exp2 function.
-        jal     ra, .exp2
+        fmul.s  fa0, fa0, ft1
 
-        flw     ft0, 0(sp)      ; Pop result
-        addi    sp, sp, 16      ; Restore stack
-
-        ; Return value.
-        fsw     ft0, 0(sp)
-
-        ; Restore registers.
-        lw      ra, -4(sp)
-        flw     ft0, -8(sp)
-        flw     ft1, -12(sp)
-
-        ; Return.
-        jalr    x0, ra, 0
+        ; Tail call to our exp2 function, which returns to our caller.
+        jal     x0, .exp2
 
 .mod:
-        ; save registers
-        fsw     ft0,-4(sp)
-        fsw     ft1,-8(sp)
-        fsw     ft2,-12(sp)
-        fsw     ft3,-16(sp)
-        fsw     ft4,-20(sp)
-        sw     a0,-24(sp)
-
-        flw     ft0, 0(sp)              ; ft0 = x = popf()
-        flw     ft1, 4(sp)              ; ft1 = y = popf()
-        fdiv.s  ft2, ft0, ft1, rdn      ; ft2 = t1 = x/y;
+        ; Parameters x and y are in fa0 and fa1.
+        fdiv.s  ft2, fa0, fa1, rdn      ; ft2 = t1 = x/y;
 	fcvt.w.s a0,ft2,rdn             ; a0 = i = floori(t1)
         fcvt.s.w ft4,a0,rne             ; ft4 = q = floorf(i)
-        fmul.s  ft3, ft4, ft1           ; ft3 = t2 = q*y
-        fsub.s  ft1, ft0, ft3           ; ft1 = r = x - t2 = x - q*y
-
-        fsw     ft1, 4(sp)             ; pushf(r)
-
-        ; restore registers
-        flw     ft0,-4(sp)
-        flw     ft1,-8(sp)
-        flw     ft2,-12(sp)
-        flw     ft3,-16(sp)
-        flw     ft4,-20(sp)
-        lw     a0,-24(sp)
-
-        ; set stack pointer as if pops and pushes had occured
-        addi    sp, sp, 4
+        fmul.s  ft3, ft4, fa1           ; ft3 = t2 = q*y
+        fsub.s  fa0, fa0, ft3           ; fa0 = r = x - t2 = x - q*y
 
         jalr x0, ra, 0
 
@@ -1857,185 +1506,83 @@ atanTable_f32:
         jalr x0, ra, 0
 
 .length2:
-        ; save registers
-        fsw     ft0,-4(sp)
-        fsw     ft1,-8(sp)
-        fsw     ft2,-12(sp)
-        fsw     ft3,-16(sp)
-
-        flw     ft0, 0(sp)              ; ft0 = x = popf()
-        fmul.s  ft1, ft0, ft0           ; ft1 = x * x
-        flw     ft3, 4(sp)              ; ft3 = y = popf()
-
-        ; for the following, would prefer: fmadd.s ft2, ft3, ft3, ft1
-        fmul.s  ft0, ft3, ft3; ; ft2 = x * x + y * y
-        fadd.s  ft2, ft0, ft1
-
-        fsqrt.s ft0, ft2                ; ft0 = d = sqrtf(x * x + y * y)
-
-        fsw     ft0, 4(sp)             ; pushf(d) 
+        ; Parameters x and y are in fa0 and fa1.
+        fmul.s  ft1, fa0, fa0           ; ft1 = x * x
 
-        ; restore registers
-        flw     ft0,-4(sp)
-        flw     ft1,-8(sp)
-        flw     ft2,-12(sp)
-        flw     ft3,-16(sp)
+        ; for the following, would prefer: fmadd.s ft2, fa1, fa1, ft1
+        fmul.s  ft0, fa1, fa1           ; ft2 = x * x + y * y
+        fadd.s  ft2, ft0, ft1
 
-        ; set stack pointer as if pops and pushes had occured
-        addi    sp, sp, 4
+        fsqrt.s fa0, ft2                ; fa0 = d = sqrtf(x * x + y * y)
 
         jalr x0, ra, 0
 
 .length3:
-        ; save registers
-        fsw     ft0,-4(sp)
-        fsw     ft1,-8(sp)
-        fsw     ft2,-12(sp)
-        fsw     ft3,-16(sp)
-
-        flw     ft0, 0(sp)              ; ft0 = x = popf()
-        fmul.s  ft1, ft0, ft0           ; ft1 = x * x
-        flw     ft3, 4(sp)              ; ft3 = y = popf()
-
-        ; for the following, would prefer: fmadd.s ft2, ft3, ft3, ft1
-        fmul.s  ft0, ft3, ft3 ; ft2 = x * x + y * y
-        fadd.s  ft2, ft0, ft1
+        ; Parameters x, y, and z are in fa0-fa2.
+        fmul.s  ft1, fa0, fa0           ; ft1 = x * x
 
-        flw     ft0, 8(sp)              ; ft0 = z = popf()
+        ; for the following, would prefer: fmadd.s ft2, fa1, fa1, ft1
+        fmul.s  ft0, fa1, fa1           ; ft2 = x * x + y * y
+        fadd.s  ft2, ft0, ft1
 
-        ; for the following, would prefer: fmadd.s ft1, ft0, ft0, ft2
-        fmul.s  ft3, ft0, ft0 ; ft1 = x * x + y * y + z * z
+        ; for the following, would prefer: fmadd.s ft1, fa2, fa2, ft2
+        fmul.s  ft3, fa2, fa2           ; ft1 = x * x + y * y + z * z
         fadd.s  ft1, ft3, ft2
 
-        fsqrt.s ft3, ft1                ; ft0 = d = sqrtf(x * x + y * y + z * z)
-
-        fsw     ft3, 8(sp)             ; pushf(d) 
-
-        ; restore registers
-        flw     ft0,-4(sp)
-        flw     ft1,-8(sp)
-        flw     ft2,-12(sp)
-        flw     ft3,-16(sp)
-
-        ; set stack pointer as if pops and pushes had occured
-        addi    sp, sp, 8
+        fsqrt.s fa0, ft1                ; fa0 = d = sqrtf(x * x + y * y + z * z)
 
         jalr x0, ra, 0
 
 .length4:
-        ; save registers
-        fsw     ft0,-4(sp)
-        fsw     ft1,-8(sp)
-        fsw     ft2,-12(sp)
-        fsw     ft3,-16(sp)
-
-        flw     ft0, 0(sp)              ; ft0 = x = popf()
-        fmul.s  ft1, ft0, ft0           ; ft1 = x * x
-        flw     ft3, 4(sp)              ; ft3 = y = popf()
-
-        ; for the following, would prefer: fmadd.s ft2, ft3, ft3, ft1
-        fmul.s  ft0, ft3, ft3 ; ft2 = x * x + y * y
-        fadd.s  ft2, ft0, ft1
+        ; Parameters x, y, z, and w are in fa0-fa3.
+        fmul.s  ft1, fa0, fa0           ; ft1 = x * x
 
-        flw     ft0, 8(sp)              ; ft0 = z = popf()
+        ; for the following, would prefer: fmadd.s ft2, fa1, fa1, ft1
+        fmul.s  ft0, fa1, fa1           ; ft2 = x * x + y * y
+        fadd.s  ft2, ft0, ft1
 
-        ; for the following, would prefer: fmadd.s ft1, ft0, ft0, ft2
-        fmul.s  ft3, ft0, ft0 ; ft1 = x * x + y * y + z * z
+        ; for the following, would prefer: fmadd.s ft1, fa2, fa2, ft2
+        fmul.s  ft3, fa2, fa2           ; ft1 = x * x + y * y + z * z
         fadd.s  ft1, ft3, ft2
 
-        flw     ft3, 12(sp)             ; ft3 = w = popf()
-
-        ; for the following, would prefer: fmadd.s ft2, ft3, ft3, ft1
-        fmul.s  ft0, ft3, ft3 ; ft2 = x * x + y * y + z * z + w * w
+        ; for the following, would prefer: fmadd.s ft2, fa3, fa3, ft1
+        fmul.s  ft0, fa3, fa3           ; ft2 = x * x + y * y + z * z + w * w
         fadd.s  ft2, ft0, ft1
 
-        fsqrt.s ft0, ft2                ; ft0 = d = sqrtf(x * x + y * y + z * z + w * w)
-
-        fsw     ft0, 12(sp)             ; pushf(d) 
-
-        ; restore registers
-        flw     ft0,-4(sp)
-        flw     ft1,-8(sp)
-        flw     ft2,-12(sp)
-        flw     ft3,-16(sp)
-
-        ; set stack pointer as if pops and pushes had occured
-        addi    sp, sp, 12
+        fsqrt.s fa0, ft2                ; fa0 = d = sqrtf(x * x + y * y + z * z + w * w)
 
         jalr    x0, ra, 0                  ; return;
 
 .fract:
-        ; save registers
-        sw      a0, -4(sp)
-        fsw     ft0, -8(sp)
-        fsw     ft1, -12(sp)
-        fsw     ft2, -16(sp)
-
-        flw      ft0, 0(sp)      ; a0 = x
+        ; Parameter x is in fa0.
 
-        ; a0<wholei> = ifloorf(ft0<x>)
-	fcvt.w.s a0,ft0,rdn
+        ; a0<wholei> = ifloorf(fa0<x>)
+	fcvt.w.s a0,fa0,rdn
 
-        ; ft1<fract> = ft0<x> - ft1<float(wholei)>
+        ; fa0<fract> = fa0<x> - ft1<float(wholei)>
         fcvt.s.w ft1,a0,rtz
-	fsub.s	ft2,ft0,ft1
-
-        fsw      ft2, 0(sp)     ; return(x)
-
-        ; restore registers
-        lw      a0, -4(sp)
-        flw     ft0, -8(sp)
-        flw     ft1, -12(sp)
-        flw     ft2, -16(sp)
+	fsub.s	fa0,fa0,ft1
 
         jalr x0, ra, 0
 
 .cross:
-        ; Save registers.
-        fsw     ft0, -4(sp)
-        fsw     ft1, -8(sp)
-        fsw     ft2, -12(sp)
-        fsw     ft3, -16(sp)
-        fsw     ft4, -20(sp)
-        fsw     ft5, -24(sp)
-        fsw     ft6, -28(sp)
-        fsw     ft7, -32(sp)
-
-        ; Parameters.
-        flw     ft0, 0(sp)                  ; v1[0]
-        flw     ft1, 4(sp)                  ; v1[1]
-        flw     ft2, 8(sp)                  ; v1[2]
-        flw     ft3, 12(sp)                 ; v2[0]
-        flw     ft4, 16(sp)                 ; v2[1]
-        flw     ft5, 20(sp)                 ; v2[2]
-
-        fmul.s  ft6, ft1, ft5               ; v1[1]*v2[2]
-        fmul.s  ft7, ft4, ft2               ; v2[1]*v1[2]
-        fsub.s  ft6, ft6, ft7               ; v1[1]*v2[2] - v2[1]*v1[2]
-        fsw     ft6, 12(sp)                 ; Store cross[0]
-
-        fmul.s  ft6, ft2, ft3               ; v1[2]*v2[0]
-        fmul.s  ft7, ft5, ft0               ; v2[2]*v1[0]
-        fsub.s  ft6, ft6, ft7               ; v1[2]*v2[0] - v2[2]*v1[0]
-        fsw     ft6, 16(sp)                 ; Store cross[1]
-
-        fmul.s  ft6, ft0, ft4               ; v1[0]*v2[1]
-        fmul.s  ft7, ft3, ft1               ; v2[0]*v1[1]
-        fsub.s  ft6, ft6, ft7               ; v1[0]*v2[1] - v2[0]*v1[1]
-        fsw     ft6, 20(sp)                 ; Store cross[2]
-
-        ; Restore registers.
-        flw     ft0, -4(sp)
-        flw     ft1, -8(sp)
-        flw     ft2, -12(sp)
-        flw     ft3, -16(sp)
-        flw     ft4, -20(sp)
-        flw     ft5, -24(sp)
-        flw     ft6, -28(sp)
-        flw     ft7, -32(sp)
-
-        ; We took six parameters and return three, so fix up stack.
-        addi    sp, sp, 12
+        ; Parameters v1 in fa0-fa2, v2 in fa3-fa5.
+
+        fmul.s  ft6, fa1, fa5               ; v1[1]*v2[2]
+        fmul.s  ft7, fa4, fa2               ; v2[1]*v1[2]
+        fsub.s  ft0, ft6, ft7               ; cross[0] = v1[1]*v2[2] - v2[1]*v1[2]
+
+        fmul.s  ft6, fa2, fa3               ; v1[2]*v2[0]
+        fmul.s  ft7, fa5, fa0               ; v2[2]*v1[0]
+        fsub.s  ft1, ft6, ft7               ; cross[1] = v1[2]*v2[0] - v2[2]*v1[0]
+
+        fmul.s  ft6, fa0, fa4               ; v1[0]*v2[1]
+        fmul.s  ft7, fa3, fa1               ; v2[0]*v1[1]
+        fsub.s  fa2, ft6, ft7               ; cross[2] = v1[0]*v2[1] - v2[0]*v1[1]
+
+        ; Return values.
+        fsgnj.s fa0, ft0, ft0
+        fsgnj.s fa1, ft1, ft1
 
         ; Return.
         jalr    x0, ra, 0
@@ -2077,77 +1624,42 @@ atanTable_f32:
         jalr x0, ra, 0
 
 .atan2:
-        ; save registers
-        fsw     ft0, -4(sp)
-        fsw     ft1, -8(sp)
-        fsw     ft2, -12(sp)
-        fsw     ft3, -16(sp)
-        fsw     ft4, -20(sp)
-        fsw     ft5, -24(sp)
-        sw      a0, -28(sp)
-        sw      a1, -32(sp)
-
-        flw     ft1, 0(sp)      ; ft1 = y
-        flw     ft0, 4(sp)      ; ft0 = x
-        addi    sp,sp,-32        ; push saved registers
+        ; Parameters y and x are in fa0 and fa1.
+        addi    sp, sp, -8      ; Make room on stack
+        sw      ra, 4(sp)       ; Save return address
+        fsw     fa0, 0(sp)      ; Save y
 
-        fdiv.s          ft3, ft1, ft0   ; z = y / x
+        fdiv.s          ft3, fa0, fa1   ; z = y / x
 
         fcvt.s.w        ft2,zero,rtz    ; ft2 = 0.0
-        flt.s           a1,ft0,ft2      ; a1 = (x < 0)
+        flt.s           a1,fa1,ft2      ; a1 = (x < 0)
         bne             a1,zero,.atan2_neg_x     ; if(x < 0) goto .atan2_neg_x;
 
-        addi    sp, sp, -8      ; Make room on stack
-        sw      ra, 4(sp)       ; Save return address
-        fsw     ft3, 0(sp)      ; Store parameter
+        fsgnj.s fa0, ft3, ft3   ; Parameter z
 
-        jal     ra, .atan       ; ft0 = a = atan(z)     ; XXX OPT could restore regs and jump to .atan
-
-        flw     ft0, 0(sp)      ; Pop result
-        lw      ra, 4(sp)       ; Restore return address
-        addi    sp, sp, 8       ; Restore stack
+        jal     ra, .atan       ; fa0 = a = atan(z)
 
         jal zero, .atan2_finish   ; goto .atan2_finish
 
 .atan2_neg_x:
         ; x < 0
 
-        fsgnjn.s ft4, ft3, ft1  ; float z2 = copysign(z, -y);
+        fsgnjn.s fa0, ft3, fa0  ; float z2 = copysign(z, -y);
 
-        addi    sp, sp, -8      ; Make room on stack
-        sw      ra, 4(sp)       ; Save return address
-        fsw     ft4, 0(sp)      ; Store parameter
-
-        jal     ra, .atan       ; ft0 = a = atan(z2)
-
-        flw     ft4, 0(sp)      ; Pop result
-        lw      ra, 4(sp)       ; Restore return address
-        addi    sp, sp, 8       ; Restore stack
+        jal     ra, .atan       ; fa0 = atan(z2)
 
-        fsgnjn.s ft2, ft4, ft1  ; float a = copysign(brad_atan(z2), -y);
+        flw     ft1, 0(sp)      ; ft1 = y
+        fsgnjn.s ft2, fa0, ft1  ; float a = copysign(brad_atan(z2), -y);
 
 	lui	a0,%hi(.pi)
 	flw	ft5,%lo(.pi)(a0)        ; float pi = 3.14159
 
         fsgnj.s ft3, ft5, ft1   ; sign_y_pi = copysign(pi, y)
-        fadd.s  ft0, ft3, ft2   ; v = copysign(M_PI, y) + a;
+        fadd.s  fa0, ft3, ft2   ; v = copysign(M_PI, y) + a;
 
 .atan2_finish:
-
-        addi    sp,sp,32        ; pop saved registers
-        fsw     ft0, 4(sp)      ; store return value
-
-        ; restore registers
-        flw     ft0, -4(sp)
-        flw     ft1, -8(sp)
-        flw     ft2, -12(sp)
-        flw     ft3, -16(sp)
-        flw     ft4, -20(sp)
-        flw     ft5, -24(sp)
-        lw      a0, -28(sp)
-        lw      a1, -32(sp)
-
-        addi    sp, sp, 4       ; We took two parameters and return one, so fix up stack
+        lw      ra, 4(sp)       ; Restore return address
+        addi    sp, sp, 8       ; Restore stack
 
         jalr x0, ra, 0
 
@@ -2176,54 +1688,20 @@ atanTable_f32:
         jalr x0, ra, 0
 
 .distance3:
-        ; Save registers.
-        fsw     ft0, -4(sp)
-        fsw     ft1, -8(sp)
-        fsw     ft2, -12(sp)
-        fsw     ft3, -16(sp)
-        fsw     ft4, -20(sp)
-        fsw     ft5, -24(sp)
-        fsw     ft6, -28(sp)
-        fsw     ft7, -32(sp)
-        sw      ra, -36(sp)
-
-        ; Parameters.
-        flw     ft0, 0(sp)                  ; x1
-        flw     ft1, 4(sp)                  ; y1
-        flw     ft2, 8(sp)                  ; z1
-        flw     ft3, 12(sp)                 ; x2
-        flw     ft4, 16(sp)                 ; y2
-        flw     ft5, 20(sp)                 ; z2
-
-        fsub.s  ft6, ft0, ft3               ; x2 - x1
+        ; Parameters p1 in fa0-fa2, p2 in fa3-fa5.
+
+        fsub.s  ft6, fa0, fa3               ; x2 - x1
         fmul.s  ft7, ft6, ft6               ; (x2 - x1)^2
 
-        fsub.s  ft6, ft1, ft4               ; y2 - y1
+        fsub.s  ft6, fa1, fa4               ; y2 - y1
         fmul.s  ft6, ft6, ft6               ; (y2 - y1)^2
         fadd.s  ft7, ft7, ft6               ; (x2 - x1)^2 + (y2 - y1)^2
 
-        fsub.s  ft6, ft2, ft5               ; z2 - z1
+        fsub.s  ft6, fa2, fa5               ; z2 - z1
         fmul.s  ft6, ft6, ft6               ; (z2 - z1)^2
         fadd.s  ft7, ft7, ft6               ; (x2 - x1)^2 + (y2 - y1)^2 + (z2 - z1)^2
 
-        fsqrt.s ft0, ft7
-
-        ; Return value.
-        fsw     ft0, 20(sp)
-
-        ; Restore registers.
-        flw     ft0, -4(sp)
-        flw     ft1, -8(sp)
-        flw     ft2, -12(sp)
-        flw     ft3, -16(sp)
-        flw     ft4, -20(sp)
-        flw     ft5, -24(sp)
-        flw     ft6, -28(sp)
-        flw     ft7, -32(sp)
-        lw      ra, -36(sp)
-
-        ; We took six parameters and return one, so fix up stack.
-        addi    sp, sp, 20
+        fsqrt.s fa0, ft7
 
         ; Return.
         jalr    x0, ra, 0
@@ -2233,163 +1711,55 @@ atanTable_f32:
         jalr x0, ra, 0
 
 .floor:
-        ; save registers
-        sw      a0, -4(sp)
-        fsw     ft0, -8(sp)
-        fsw     ft1, -12(sp)
-
-        flw      ft0, 0(sp)      ; a0 = x
+        ; Parameter x is in fa0.
 
-        ; a0<wholei> = ifloorf(ft0<x>)
-	fcvt.w.s a0,ft0,rdn
+        ; a0<wholei> = ifloorf(fa0<x>)
+	fcvt.w.s a0,fa0,rdn
 
         ; convert back to float.
-        fcvt.s.w ft1,a0,rtz
-
-        fsw      ft1, 0(sp)     ; return(fract)
-
-        ; restore registers
-        lw      a0, -4(sp)
-        flw     ft0, -8(sp)
-        flw     ft1, -12(sp)
+        fcvt.s.w fa0,a0,rtz
 
         jalr x0, ra, 0
 
 .step:
-        sw      a0, -4(sp)
-        fsw     ft0, -8(sp)
-        fsw     ft1, -12(sp)
-        fsw     ft2, -16(sp)
-
-        ; float edge = popf();
-        flw      ft0, 0(sp)      ; ft0 = edge = pop()
-
-        ; float x = popf();
-        flw      ft1, 4(sp)      ; ft1 = x = pop()
+        ; Parameters edge and x are in fa0 and fa1.
 
         ; float y = (x < edge) ? 0.0f : 1.0f;
-        fle.s     a0, ft0, ft1
+        fle.s     a0, fa0, fa1
 
-        fcvt.s.w ft2,a0,rtz
-
-        ; pushf(y);
-        fsw     ft2, 4(sp)
-
-        lw      a0, -4(sp)
-        flw     ft0, -8(sp)
-        flw     ft1, -12(sp)
-        flw     ft2, -16(sp)
-
-        addi    sp, sp, 4       ; We took two parameters and return one, so fix up stack
+        fcvt.s.w fa0,a0,rtz
 
         jalr x0, ra, 0
 
 .dot1:
-        ; save registers
-        fsw     ft0, -4(sp)
-        fsw     ft1, -8(sp)
-
-        flw     ft0, 0(sp)      ; x1
-        flw     ft1, 8(sp)      ; x2
-        fmul.s  ft0, ft0, ft1   ; x1*x2
-
-        fsw     ft0, 8(sp)      ; return value
-
-        ; restore registers
-        flw     ft0, -4(sp)
-        flw     ft1, -8(sp)
-
-        addi    sp, sp, 4       ; we took two parameters and return one, so fix up stack
+        fmul.s  fa0, fa0, fa1   ; x1*x2
         jalr    x0, ra, 0       ; return
 
 .dot2:
-        ; save registers
-        fsw     ft0, -4(sp)
-        fsw     ft1, -8(sp)
-        fsw     ft2, -12(sp)
-
-        flw     ft0, 0(sp)      ; x1
-        flw     ft1, 8(sp)      ; x2
-        fmul.s  ft2, ft0, ft1   ; x1*x2
-
-        flw     ft0, 4(sp)      ; y1
-        flw     ft1, 12(sp)     ; y2
-        fmul.s  ft0, ft0, ft1   ; y1*y2
-
-        fadd.s  ft2, ft0, ft2   ; x1*x2 + y1*y2
-        fsw     ft2, 12(sp)     ; return value
-
-        ; restore registers
-        flw     ft0, -4(sp)
-        flw     ft1, -8(sp)
-        flw     ft2, -12(sp)
-
-        addi    sp, sp, 12      ; we took four parameters and return one, so fix up stack
+        ; Parameters v1 in fa0-fa1, v2 in fa2-fa3.
+        fmul.s  ft0, fa0, fa2   ; x1*x2
+        fmul.s  ft1, fa1, fa3   ; y1*y2
+        fadd.s  fa0, ft0, ft1   ; x1*x2 + y1*y2
         jalr    x0, ra, 0       ; return
 
 .dot3:
-        ; save registers
-        fsw     ft0, -4(sp)
-        fsw     ft1, -8(sp)
-        fsw     ft2, -12(sp)
-
-        flw     ft0, 0(sp)      ; x1
-        flw     ft1, 12(sp)     ; x2
-        fmul.s  ft2, ft0, ft1   ; x1*x2
-
-        flw     ft0, 4(sp)      ; y1
-        flw     ft1, 16(sp)     ; y2
-        fmul.s  ft0, ft0, ft1   ; y1*y2
-        fadd.s  ft2, ft0, ft2   ; x1*x2 + y1*y2
-
-        flw     ft0, 8(sp)      ; z1
-        flw     ft1, 20(sp)     ; z2
-        fmul.s  ft0, ft0, ft1   ; z1*z2
-        fadd.s  ft2, ft0, ft2   ; x1*x2 + y1*y2 + z1*z2
-
-        fsw     ft2, 20(sp)     ; return value
-
-        ; restore registers
-        flw     ft0, -4(sp)
-        flw     ft1, -8(sp)
-        flw     ft2, -12(sp)
-
-        addi    sp, sp, 20      ; we took six parameters and return one, so fix up stack
+        ; Parameters v1 in fa0-fa2, v2 in fa3-fa5.
+        fmul.s  ft0, fa0, fa3   ; x1*x2
+        fmul.s  ft1, fa1, fa4   ; y1*y2
+        fadd.s  ft0, ft0, ft1   ; x1*x2 + y1*y2
+        fmul.s  ft1, fa2, fa5   ; z1*z2
+        fadd.s  fa0, ft0, ft1   ; x1*x2 + y1*y2 + z1*z2
         jalr    x0, ra, 0       ; return
 
 .dot4:
-        ; save registers
-        fsw     ft0, -4(sp)
-        fsw     ft1, -8(sp)
-        fsw     ft2, -12(sp)
-
-        flw     ft0, 0(sp)      ; x1
-        flw     ft1, 16(sp)     ; x2
-        fmul.s  ft2, ft0, ft1   ; x1*x2
-
-        flw     ft0, 4(sp)      ; y1
-        flw     ft1, 20(sp)     ; y2
-        fmul.s  ft0, ft0, ft1   ; y1*y2
-        fadd.s  ft2, ft0, ft2   ; x1*x2 + y1*y2
-
-        flw     ft0, 8(sp)      ; z1
-        flw     ft1, 24(sp)     ; z2
-        fmul.s  ft0, ft0, ft1   ; z1*z2
-        fadd.s  ft2, ft0, ft2   ; x1*x2 + y1*y2 + z1*z2
-
-        flw     ft0, 12(sp)     ; w1
-        flw     ft1, 28(sp)     ; w2
-        fmul.s  ft0, ft0, ft1   ; w1*w2
-        fadd.s  ft2, ft0, ft2   ; x1*x2 + y1*y2 + z1*z2 + w1*w2
-
-        fsw     ft2, 28(sp)     ; return value
-
-        ; restore registers
-        flw     ft0, -4(sp)
-        flw     ft1, -8(sp)
-        flw     ft2, -12(sp)
-
-        addi    sp, sp, 28      ; we took eight parameters and return one, so fix up stack
+        ; Parameters v1 in fa0-fa3, v2 in fa4-fa7.
+        fmul.s  ft0, fa0, fa4   ; x1*x2
+        fmul.s  ft1, fa1, fa5   ; y1*y2
+        fadd.s  ft0, ft0, ft1   ; x1*x2 + y1*y2
+        fmul.s  ft1, fa2, fa6   ; z1*z2
+        fadd.s  ft0, ft0, ft1   ; x1*x2 + y1*y2 + z1*z2
+        fmul.s  ft1, fa3, fa7   ; w1*w2
+        fadd.s  fa0, ft0, ft1   ; x1*x2 + y1*y2 + z1*z2 + w1*w2
         jalr    x0, ra, 0       ; return
 
 .any1:
@@ -2398,75 +1768,21 @@ atanTable_f32:
         jalr x0, ra, 0
 
 .any2:
-        sw      a0, -4(sp)
-        sw      a1, -8(sp)
-        sw      a2, -12(sp)
-
-        lw a0, 0(sp)    ; a
-        lw a1, 4(sp)    ; b
-        or a2, a0, a1  ; c = a || b
-        sw a2, 4(sp)    ; return(c)
-
-        ; restore registers
-        lw      a0, -4(sp)
-        lw      a1, -8(sp)
-        lw      a2, -12(sp)
-
-        addi    sp, sp, 4       ; We took two parameters and return one, so fix up stack
+        ; Parameters are in a0 and a1.
+        or a0, a0, a1   ; a || b
         jalr x0, ra, 0
 
 .any3:
-        ; save registers
-        sw      a0, -4(sp)
-        sw      a1, -8(sp)
-        sw      a2, -12(sp)
-        sw      a3, -16(sp)
-        sw      a4, -20(sp)
-
-        lw a0, 0(sp)    ; a
-        lw a1, 4(sp)    ; b
-        lw a2, 8(sp)    ; c
-        or a4, a0, a1  ; e = a || b
-        or a0, a2, a4  ; f = c || e
-        sw a0, 8(sp)    ; return(f)
-
-        ; restore registers
-        lw      a0, -4(sp)
-        lw      a1, -8(sp)
-        lw      a2, -12(sp)
-        lw      a3, -16(sp)
-        lw      a4, -20(sp)
-
-        addi    sp, sp, 8       ; We took three parameters and return one, so fix up stack
+        ; Parameters are in a0-a2.
+        or a0, a0, a1   ; a || b
+        or a0, a0, a2   ; a || b || c
         jalr x0, ra, 0
 
 .any4:
-        ; save registers
-        sw      a0, -4(sp)
-        sw      a1, -8(sp)
-        sw      a2, -12(sp)
-        sw      a3, -16(sp)
-        sw      a4, -20(sp)
-        sw      a5, -24(sp)
-
-        lw a0, 0(sp)    ; a
-        lw a1, 4(sp)    ; b
-        lw a2, 8(sp)    ; c
-        lw a3, 12(sp)   ; d
-        or a4, a0, a1  ; e = a || b
-        or a5, a2, a3  ; f = c || d
-        or a0, a4, a5  ; g = e || f
-        sw a0, 12(sp)   ; return(g)
-
-        ; restore registers
-        lw      a0, -4(sp)
-        lw      a1, -8(sp)
-        lw      a2, -12(sp)
-        lw      a3, -16(sp)
-        lw      a4, -20(sp)
-        lw      a5, -24(sp)
-
-        addi    sp, sp, 12      ; We took four parameters and return one, so fix up stack
+        ; Parameters are in a0-a3.
+        or a0, a0, a1   ; a || b
+        or a2, a2, a3   ; c || d
+        or a0, a0, a2   ; a || b || c || d
         jalr x0, ra, 0
 
 .all1:
@@ -2475,75 +1791,21 @@ atanTable_f32:
         jalr x0, ra, 0
 
 .all2:
-        sw      a0, -4(sp)
-        sw      a1, -8(sp)
-        sw      a2, -12(sp)
-
-        lw a0, 0(sp)    ; a
-        lw a1, 4(sp)    ; b
-        and a2, a0, a1  ; c = a && b
-        sw a2, 4(sp)    ; return(c)
-
-        ; restore registers
-        lw      a0, -4(sp)
-        lw      a1, -8(sp)
-        lw      a2, -12(sp)
-
-        addi    sp, sp, 4       ; We took two parameters and return one, so fix up stack
+        ; Parameters are in a0 and a1.
+        and a0, a0, a1  ; a && b
         jalr x0, ra, 0
 
 .all3:
-        ; save registers
-        sw      a0, -4(sp)
-        sw      a1, -8(sp)
-        sw      a2, -12(sp)
-        sw      a3, -16(sp)
-        sw      a4, -20(sp)
-
-        lw a0, 0(sp)    ; a
-        lw a1, 4(sp)    ; b
-        lw a2, 8(sp)    ; c
-        and a4, a0, a1  ; e = a && b
-        and a0, a2, a4  ; f = c && e
-        sw a0, 8(sp)    ; return(f)
-
-        ; restore registers
-        lw      a0, -4(sp)
-        lw      a1, -8(sp)
-        lw      a2, -12(sp)
-        lw      a3, -16(sp)
-        lw      a4, -20(sp)
-
-        addi    sp, sp, 8       ; We took three parameters and return one, so fix up stack
+        ; Parameters are in a0-a2.
+        and a0, a0, a1  ; a && b
+        and a0, a0, a2  ; a && b && c
         jalr x0, ra, 0
 
 .all4:
-        ; save registers
-        sw      a0, -4(sp)
-        sw      a1, -8(sp)
-        sw      a2, -12(sp)
-        sw      a3, -16(sp)
-        sw      a4, -20(sp)
-        sw      a5, -24(sp)
-
-        lw a0, 0(sp)    ; a
-        lw a1, 4(sp)    ; b
-        lw a2, 8(sp)    ; c
-        lw a3, 12(sp)   ; d
-        and a4, a0, a1  ; e = a && b
-        and a5, a2, a3  ; f = c && d
-        and a0, a4, a5  ; g = e && f
-        sw a0, 12(sp)   ; return(g)
-
-        ; restore registers
-        lw      a0, -4(sp)
-        lw      a1, -8(sp)
-        lw      a2, -12(sp)
-        lw      a3, -16(sp)
-        lw      a4, -20(sp)
-        lw      a5, -24(sp)
-
-        addi    sp, sp, 12      ; We took four parameters and return one, so fix up stack
+        ; Parameters are in a0-a3.
+        and a0, a0, a1  ; a && b
+        and a2, a2, a3  ; c && d
+        and a0, a0, a2  ; a && b && c && d
         jalr x0, ra, 0
 
 .mainLoop:
@@ -0,0 +1,363 @@
+#ifndef LINKER_H
+#define LINKER_H
+
+// Linker of RunHeader3 relocatable objects into a RunHeader2 executable,
+// shared by the "ld" tool and the compiler.
+//
+// Objects are cut into sections at their labels. All sections of normal
+// objects are kept. Sections of libraries are only kept if they're reachable
+// from kept sections, through a relocation or by falling through, so a
+// shader only carries the routines and tables it uses.
+//
+// Data sections that are accessed with absolute 12-bit offsets ("label(x0)")
+// are placed first, so that they stay within reach of those offsets.
+
+#include <assert.h>
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "objectfile.h"
+
+class Linker {
+private:
+    struct Input {
+        RelocatableObject object;
+        std::string pathname;
+        bool isLibrary;
+
+        // Section that starts at each (inDataSegment, address).
+        std::map<std::pair<bool,uint32_t>,size_t> sectionByStart;
+
+        // Relocations of each section.
+        std::vector<std::vector<size_t>> sectionRelocations;
+
+        // Whether each section is kept, whether it must be in the small-data
+        // area, and its address in the output.
+        std::vector<bool> keep;
+        std::vector<bool> smallData;
+        std::vector<uint32_t> newAddress;
+    };
+
+    std::vector<Input> inputs;
+
+    // Map from defined symbol to its input and index in that input's symbols.
+    std::map<std::string,std::pair<size_t,size_t>> definitions;
+
+    // Output.
+    std::vector<uint32_t> text;
+    std::vector<uint32_t> data;
+    std::map<std::string,std::pair<uint32_t,bool>> symbols;
+
+public:
+    // Add an object. If it's a library, only the sections that are
+    // referenced will be linked. The pathname is used in messages.
+    void addObject(const RelocatableObject &object, const std::string &pathname, bool isLibrary) {
+        Input input;
+        input.object = object;
+        input.pathname = pathname;
+        input.isLibrary = isLibrary;
+
+        for (size_t i = 0; i < object.sections.size(); i++) {
+            auto &section = object.sections[i];
+            input.sectionByStart[std::make_pair(section.inDataSegment, section.address)] = i;
+        }
+
+        input.sectionRelocations.resize(object.sections.size());
+        for (size_t i = 0; i < object.relocations.size(); i++) {
+            auto &relocation = object.relocations[i];
+            input.sectionRelocations[sectionAt(input, relocation.inDataSegment, relocation.address)]
+                .push_back(i);
+        }
+
+        input.keep.resize(object.sections.size(), false);
+        input.smallData.resize(object.sections.size(), false);
+        input.newAddress.resize(object.sections.size(), 0);
+
+        for (size_t i = 0; i < object.symbols.size(); i++) {
+            auto &symbol = object.symbols[i];
+            if (!symbol.undefined) {
+                auto itr = definitions.find(symbol.name);
+                if (itr != definitions.end()) {
+                    std::cerr << pathname << ": symbol \"" << symbol.name
+                        << "\" is already defined in " << inputs[itr->second.first].pathname << "\n";
+                    exit(EXIT_FAILURE);
+                }
+                definitions[symbol.name] = std::make_pair(inputs.size(), i);
+            }
+        }
+
+        inputs.push_back(input);
+    }
+
+    // Read a RunHeader3 object file and add it.
+    void load(const std::string &pathname, bool isLibrary) {
+        std::ifstream file(pathname, std::ios::in | std::ios::binary);
+        if (!file.good()) {
+            std::cerr << "Can't open file \"" << pathname << "\".\n";
+            exit(EXIT_FAILURE);
+        }
+
+        RelocatableObject object;
+        if (!ReadRelocatable(file, object)) {
+            std::cerr << "Can't read relocatable object \"" << pathname << "\".\n";
+            exit(EXIT_FAILURE);
+        }
+
+        addObject(object, pathname, isLibrary);
+    }
+
+    // Pick the sections to keep, lay them out, and apply the relocations.
+    void link() {
+        markSections();
+        markSmallData();
+
+        // Lay out kept sections in their original order, text and data
+        // separately, with small data before the rest of the data.
+        text.clear();
+        data.clear();
+        for (bool smallPass : {true, false}) {
+            for (auto &input : inputs) {
+                auto &object = input.object;
+
+                for (size_t i = 0; i < object.sections.size(); i++) {
+                    auto &section = object.sections[i];
+                    bool small = !section.inDataSegment || input.smallData[i];
+                    if (input.keep[i] && small == smallPass) {
+                        std::vector<uint32_t> &out = section.inDataSegment ? data : text;
+                        const std::vector<uint32_t> &in = section.inDataSegment ? object.data : object.text;
+
+                        input.newAddress[i] = out.size()*4;
+                        out.insert(out.end(), in.begin() + section.address/4,
+                                in.begin() + (section.address + section.size)/4);
+                    }
+                }
+            }
+        }
+
+        // Symbols of the kept sections.
+        symbols.clear();
+        for (auto &input : inputs) {
+            for (auto &symbol : input.object.symbols) {
+                if (!symbol.undefined) {
+                    size_t section = sectionAt(input, symbol.inDataSegment, symbol.address);
+                    if (input.keep[section]) {
+                        symbols[symbol.name] = std::make_pair(
+                                newAddressOf(input, section, symbol.address), symbol.inDataSegment);
+                    }
+                }
+            }
+        }
+
+        // Patch every reference.
+        for (auto &input : inputs) {
+            auto &object = input.object;
+
+            for (size_t i = 0; i < object.sections.size(); i++) {
+                if (!input.keep[i]) {
+                    continue;
+                }
+
+                for (size_t r : input.sectionRelocations[i]) {
+                    auto &relocation = object.relocations[r];
+                    const std::string &name = object.symbols[relocation.symbol].name;
+
+                    uint32_t address = newAddressOf(input, i, relocation.address);
+                    int64_t value = relocationFunctionValue(relocation.function,
+                            int64_t(symbols.at(name).first) + relocation.addend);
+
+                    // Branches and jumps are PC-relative.
+                    int bits = 32;
+                    switch (relocation.format) {
+                        case RELOC_I:
+                        case RELOC_S:
+                            bits = relocation.function == RELOC_LO ? 13 : 12;
+                            break;
+
+                        case RELOC_SB:
+                            value -= address;
+                            bits = 13;
+                            break;
+
+                        case RELOC_UJ:
+                            value -= address;
+                            bits = 21;
+                            break;
+
+                        case RELOC_WORD:
+                        case RELOC_U:
+                            break;
+                    }
+
+                    if (bits < 32) {
+                        int32_t limit = 1 << (bits - 1);
+                        if (value < 0 ? -value > limit : value >= limit) {
+                            std::cerr << input.pathname << ": warning: value " << value
+                                << " of reference to \"" << name << "\" at 0x" << std::hex
+                                << address << std::dec << " does not fit in " << bits << " bits\n";
+                        }
+                    }
+
+                    std::vector<uint32_t> &out = relocation.inDataSegment ? data : text;
+                    out[address/4] = relocateWord(out[address/4], relocation.format, value);
+                }
+            }
+        }
+    }
+
+    // Save the executable.
+    void save(const std::string &outPathname) {
+        std::ofstream outFile(outPathname, std::ios::out | std::ios::binary);
+        if (!outFile.good()) {
+            std::cerr << "Can't open file \"" << outPathname << "\".\n";
+            exit(EXIT_FAILURE);
+        }
+
+        write(outFile);
+        outFile.close();
+    }
+
+    // Write the executable in RunHeader2 format.
+    void write(std::ostream &outFile) {
+        RunHeader2 header;
+        header.initialPC = 0;
+        header.symbolCount = symbols.size();
+        header.textByteCount = text.size()*4;
+        header.dataByteCount = data.size()*4;
+        outFile.write(reinterpret_cast<char *>(&header), sizeof(header));
+
+        for (auto &[symbol, location] : symbols) {
+            uint32_t address = location.first;
+            uint32_t inDataSegment = location.second;
+            uint32_t strsize = symbol.size() + 1;
+            outFile.write(reinterpret_cast<char *>(&address), sizeof(address));
+            outFile.write(reinterpret_cast<char *>(&inDataSegment), sizeof(inDataSegment));
+            outFile.write(reinterpret_cast<char *>(&strsize), sizeof(strsize));
+            outFile.write(symbol.c_str(), strsize);
+        }
+
+        outFile.write(reinterpret_cast<char *>(text.data()), text.size()*4);
+        outFile.write(reinterpret_cast<char *>(data.data()), data.size()*4);
+    }
+
+    // Print how much of each library was kept.
+    void dumpStatistics(std::ostream &out) const {
+        for (auto &input : inputs) {
+            if (!input.isLibrary) {
+                continue;
+            }
+
+            uint32_t keptBytes[2] = {0, 0};
+            for (size_t i = 0; i < input.object.sections.size(); i++) {
+                auto &section = input.object.sections[i];
+                if (input.keep[i]) {
+                    keptBytes[section.inDataSegment] += section.size;
+                }
+            }
+
+            out << "Linked " << keptBytes[0] << " of " << input.object.text.size()*4
+                << " text bytes and " << keptBytes[1] << " of " << input.object.data.size()*4
+                << " data bytes from " << input.pathname << ".\n";
+        }
+    }
+
+private:
+    // Index of the section that contains the address. A label at the end
+    // of a segment has its own empty section.
+    static size_t sectionAt(const Input &input, bool inDataSegment, uint32_t address) {
+        auto itr = input.sectionByStart.upper_bound(std::make_pair(inDataSegment, address));
+        assert(itr != input.sectionByStart.begin());
+        --itr;
+        assert(itr->first.first == inDataSegment);
+        return itr->second;
+    }
+
+    // Output address of an address in a kept section.
+    static uint32_t newAddressOf(const Input &input, size_t section, uint32_t address) {
+        return input.newAddress[section] + address - input.object.sections[section].address;
+    }
+
+    // Mark the kept data sections that are referenced with absolute 12-bit offsets.
+    void markSmallData() {
+        for (auto &input : inputs) {
+            std::fill(input.smallData.begin(), input.smallData.end(), false);
+        }
+
+        for (auto &input : inputs) {
+            for (auto &relocation : input.object.relocations) {
+                if (isSmallDataRelocation(relocation.format, relocation.function) &&
+                        input.keep[sectionAt(input, relocation.inDataSegment, relocation.address)]) {
+
+                    auto [definingInput, symbolIndex] =
+                        definitions.at(input.object.symbols[relocation.symbol].name);
+                    Input &target = inputs[definingInput];
+                    auto &symbol = target.object.symbols[symbolIndex];
+                    if (symbol.inDataSegment) {
+                        target.smallData[sectionAt(target, true, symbol.address)] = true;
+                    }
+                }
+            }
+        }
+    }
+
+    // Mark the sections to keep: everything in normal objects and whatever
+    // they reach in libraries.
+    void markSections() {
+        std::vector<std::pair<size_t,size_t>> worklist;
+
+        for (size_t i = 0; i < inputs.size(); i++) {
+            auto &input = inputs[i];
+            std::fill(input.keep.begin(), input.keep.end(), false);
+            if (!input.isLibrary) {
+                for (size_t j = 0; j < input.keep.size(); j++) {
+                    input.keep[j] = true;
+                    worklist.push_back(std::make_pair(i, j));
+                }
+            }
+        }
+
+        auto reach = [this, &worklist](size_t i, size_t j) {
+            if (!inputs[i].keep[j]) {
+                inputs[i].keep[j] = true;
+                worklist.push_back(std::make_pair(i, j));
+            }
+        };
+
+        while (!worklist.empty()) {
+            auto [i, j] = worklist.back();
+            worklist.pop_back();
+            auto &input = inputs[i];
+            auto &object = input.object;
+            auto &section = object.sections[j];
+
+            // Execution continues into the next section of the segment.
+            if (section.fallsThrough && j + 1 < object.sections.size() &&
+                    object.sections[j + 1].inDataSegment == section.inDataSegment) {
+
+                reach(i, j + 1);
+            }
+
+            // Sections of referenced symbols.
+            for (size_t r : input.sectionRelocations[j]) {
+                const std::string &name = object.symbols[object.relocations[r].symbol].name;
+
+                auto itr = definitions.find(name);
+                if (itr == definitions.end()) {
+                    std::cerr << input.pathname << ": undefined symbol \"" << name << "\"\n";
+                    exit(EXIT_FAILURE);
+                }
+
+                auto [definingInput, symbolIndex] = itr->second;
+                auto &symbol = inputs[definingInput].object.symbols[symbolIndex];
+                reach(definingInput, sectionAt(inputs[definingInput], symbol.inDataSegment, symbol.address));
+            }
+        }
+    }
+};
+
+#endif // LINKER_H
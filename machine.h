@@ -0,0 +1,141 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+// Timing of the shader core, used by the compiler to schedule instructions.
+//
+// These mirror the localparams of gpu/shadercore/ShaderCore.v in its default
+// configuration (the OpenCores FPU rather than the Altera IP blocks). The
+// core waits in STATE_FP_WAIT for the whole latency of a float operation,
+// so today the order of instructions doesn't change the cycle count. We
+// model a core that issues one instruction per cycle and only stalls when
+// an operand isn't ready yet, which is what a pipelined core will do.
+
+#include <string>
+
+#include "risc-v.h"
+#include "GLSL.std.450.h"
+
+static const int FP_ADD_SUB_LATENCY = 4;
+static const int FP_MULTIPLY_LATENCY = 4;
+static const int FP_DIVIDE_LATENCY = 4;
+static const int FP_SQRT_LATENCY = 28;
+static const int FP_FLOAT_TO_INT_LATENCY = 6;
+static const int FP_INT_TO_FLOAT_LATENCY = 4;
+
+// STATE_LOAD and STATE_LOAD2.
+static const int LOAD_LATENCY = 2;
+
+// Integer operations retire in the cycle after they issue.
+static const int INTEGER_LATENCY = 1;
+
+// fsgnj.s, fsgnjn.s, and fsgnjx.s don't wait in STATE_FP_WAIT.
+static const int SIGN_INJECTION_LATENCY = 0;
+
+// Number of cycles after an instruction issues that its result can be used.
+inline int instructionLatency(const Instruction *instruction) {
+    switch (instruction->opcode()) {
+        case SpvOpFAdd:
+        case SpvOpFSub:
+            return FP_ADD_SUB_LATENCY;
+
+        case SpvOpFMul:
+            return FP_MULTIPLY_LATENCY;
+
+        case SpvOpFDiv:
+            return FP_DIVIDE_LATENCY;
+
+        case 0x10000 | GLSLstd450Sqrt:
+            return FP_SQRT_LATENCY;
+
+        case SpvOpConvertFToS:
+        case RiscVOpFloorToInt:
+            return FP_FLOAT_TO_INT_LATENCY;
+
+        case SpvOpConvertSToF:
+            return FP_INT_TO_FLOAT_LATENCY;
+
+        // The core counts compares and min/max as float-to-int conversions.
+        case SpvOpFOrdEqual:
+        case SpvOpFOrdNotEqual:
+        case SpvOpFOrdLessThan:
+        case SpvOpFOrdLessThanEqual:
+        case SpvOpFOrdGreaterThan:
+        case SpvOpFOrdGreaterThanEqual:
+        case 0x10000 | GLSLstd450FMin:
+        case 0x10000 | GLSLstd450FMax:
+            return FP_FLOAT_TO_INT_LATENCY;
+
+        // Sign injection doesn't go through the float unit, so its result
+        // is ready when it issues.
+        case SpvOpFNegate:
+        case 0x10000 | GLSLstd450FAbs:
+            return SIGN_INJECTION_LATENCY;
+
+        case SpvOpLoad:
+        case RiscVOpLoad:
+        case RiscVOpLoadConst:
+            return LOAD_LATENCY;
+
+        default:
+            return INTEGER_LATENCY;
+    }
+}
+
+// Cycles the current core spends on each instruction, used to estimate how
+// long compiled code takes. Every instruction goes through STATE_FETCH,
+// STATE_FETCH2, STATE_DECODE, STATE_EXECUTE, and STATE_RETIRE, and then:
+//
+//     Loads spend STATE_LOAD and STATE_LOAD2.
+//     Stores spend STATE_STORE. Stores to SDRAM wait in STATE_STORE_REQUEST
+//         and STATE_STORE_STALL too, but only the library's mainLoop does those.
+//     Float operations wait in STATE_FP_WAIT for their latency. Sign
+//         injection and moves don't wait.
+//
+// The core decodes the fused multiply-adds but doesn't execute them: they
+// don't wait for the float unit and write back the adder's result.
+static const int CORE_INSTRUCTION_CYCLES = 5;
+static const int CORE_LOAD_CYCLES = 2;
+static const int CORE_STORE_CYCLES = 1;
+
+// Whether the core executes the instruction with this mnemonic correctly.
+inline bool isExecutedByCore(const std::string &mnemonic) {
+    return mnemonic != "fmadd.s" && mnemonic != "fmsub.s" &&
+        mnemonic != "fnmsub.s" && mnemonic != "fnmadd.s";
+}
+
+// Cycles the core spends on the instruction with this mnemonic, or 0 for
+// assembler directives and instructions it doesn't execute.
+inline int instructionCycles(const std::string &mnemonic) {
+    if (mnemonic.empty() || mnemonic[0] == '.' || !isExecutedByCore(mnemonic)) {
+        return 0;
+    }
+
+    int cycles = CORE_INSTRUCTION_CYCLES;
+    if (mnemonic == "lb" || mnemonic == "lh" || mnemonic == "lw" ||
+            mnemonic == "lbu" || mnemonic == "lhu" || mnemonic == "flw") {
+
+        cycles += CORE_LOAD_CYCLES;
+    } else if (mnemonic == "sb" || mnemonic == "sh" || mnemonic == "sw" || mnemonic == "fsw") {
+        cycles += CORE_STORE_CYCLES;
+    } else if (mnemonic == "fadd.s" || mnemonic == "fsub.s") {
+        cycles += FP_ADD_SUB_LATENCY;
+    } else if (mnemonic == "fmul.s") {
+        cycles += FP_MULTIPLY_LATENCY;
+    } else if (mnemonic == "fdiv.s") {
+        cycles += FP_DIVIDE_LATENCY;
+    } else if (mnemonic == "fsqrt.s") {
+        cycles += FP_SQRT_LATENCY;
+    } else if (mnemonic == "fcvt.w.s" || mnemonic == "fcvt.wu.s" ||
+            mnemonic == "feq.s" || mnemonic == "flt.s" || mnemonic == "fle.s" ||
+            mnemonic == "fmin.s" || mnemonic == "fmax.s") {
+
+        // The core counts compares and min/max as float-to-int conversions.
+        cycles += FP_FLOAT_TO_INT_LATENCY;
+    } else if (mnemonic == "fcvt.s.w" || mnemonic == "fcvt.s.wu") {
+        cycles += FP_INT_TO_FLOAT_LATENCY;
+    }
+
+    return cycles;
+}
+
+#endif // MACHINE_H
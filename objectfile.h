@@ -1,9 +1,13 @@
+#ifndef OBJECTFILE_H
+#define OBJECTFILE_H
+
 #include <fstream>
 #include <iostream>
 #include <cstdint>
 #include <vector>
 #include <map>
 #include <string>
+#include <cstring>
 
 #include "util.h"
 
@@ -42,8 +46,321 @@ struct RunHeader2
     // Data bytes follow. Bytes are loaded at 0 in data memory.
 };
 
-bool ReadBinary(std::ifstream& binaryFile, RunHeader2& header, SymbolTable& text_symbols, SymbolTable& data_symbols, std::vector<uint8_t>& text_bytes, std::vector<uint8_t>& data_bytes)
+const uint32_t RunHeader3MagicExpected = 0x31354c43;
+struct RunHeader3
+{
+    // All words are little-endian. This is a relocatable object, to be linked
+    // into a RunHeader2 executable. Both segments are assembled at address 0.
+    uint32_t magic = RunHeader3MagicExpected;       // 'AL53', version 3 of Alice 5 header
+    uint32_t symbolCount;                           // Number of symbols (see below).
+    uint32_t relocationCount;                       // Number of relocations (see below).
+    uint32_t sectionCount;                          // Number of sections (see below).
+    uint32_t textByteCount;                         // Number of bytes of text (code).
+    uint32_t dataByteCount;                         // Number of bytes of data.
+    // symbolCount symbols follow that are of the following layout:
+    //       uint32_t address
+    //       uint32_t flags: SYMBOL_IN_DATA_SEGMENT, SYMBOL_UNDEFINED
+    //       uint32_t stringLength: including nul.
+    //       stringLength bytes for symbol name including nul
+    // relocationCount relocations follow, six words each:
+    //       uint32_t address of the word to patch
+    //       uint32_t inDataSegment: if true, word is in data segment; else in text
+    //       uint32_t format: RelocationFormat
+    //       uint32_t function: RelocationFunction
+    //       uint32_t symbol: index into the symbols above
+    //       int32_t addend: added to the symbol's address
+    // sectionCount sections follow, four words each:
+    //       uint32_t address
+    //       uint32_t inDataSegment: if true, in data segment; else in text
+    //       uint32_t size in bytes
+    //       uint32_t fallsThrough: if true, execution can continue into the next section
+    // Program bytes follow.
+    // Data bytes follow.
+};
+
+// Flags of RunHeader3 symbols.
+const uint32_t SYMBOL_IN_DATA_SEGMENT = 0x1;
+const uint32_t SYMBOL_UNDEFINED = 0x2;
+
+// Immediate field that a relocation patches.
+enum RelocationFormat {
+    RELOC_WORD,         // Whole data word.
+    RELOC_I,            // I-type immediate, bits 20 to 31.
+    RELOC_S,            // S-type immediate, split between rd and funct7.
+    RELOC_SB,           // Branch offset, PC-relative.
+    RELOC_U,            // Upper immediate, bits 12 to 31.
+    RELOC_UJ,           // Jump offset, PC-relative.
+};
+
+// Assembler function applied to the symbol's address plus addend.
+enum RelocationFunction {
+    RELOC_NONE,
+    RELOC_HI,           // %hi()
+    RELOC_LO,           // %lo()
+};
+
+// Apply the function to the value. %lo() is the lower 12 bits. %hi() is the
+// upper 20 bits, plus one if bit 11 is set, since the %lo() value will be
+// sign-extended and added to it.
+inline int64_t relocationFunctionValue(RelocationFunction function, int64_t value)
+{
+    switch (function) {
+        case RELOC_NONE:
+            return value;
+
+        case RELOC_HI:
+            if ((value & 0x00000800) != 0) {
+                value += 0x00001000;
+            }
+            return value >> 12;
+
+        case RELOC_LO:
+            return value & 0x00000FFF;
+    }
+
+    return value;
+}
+
+// Whether the relocation is an absolute 12-bit offset, as in "label(x0)",
+// which only reaches the first 2 KiB of the segment.
+inline bool isSmallDataRelocation(RelocationFormat format, RelocationFunction function)
+{
+    return (format == RELOC_I || format == RELOC_S) && function == RELOC_NONE;
+}
+
+// In-memory form of a RunHeader3 object.
+struct RelocatableObject {
+    struct Symbol {
+        std::string name;
+        uint32_t address;
+        bool inDataSegment;
+        bool undefined;
+    };
+
+    struct Relocation {
+        uint32_t address;
+        bool inDataSegment;
+        RelocationFormat format;
+        RelocationFunction function;
+        uint32_t symbol;
+        int32_t addend;
+    };
+
+    // Run of words that starts at a label and ends at the next one. The
+    // linker keeps or drops whole sections.
+    struct Section {
+        uint32_t address;
+        bool inDataSegment;
+        uint32_t size;
+        bool fallsThrough;
+    };
+
+    std::vector<Symbol> symbols;
+    std::vector<Relocation> relocations;
+    std::vector<Section> sections;
+    std::vector<uint32_t> text;
+    std::vector<uint32_t> data;
+};
+
+// Replace the immediate of the word with the value, encoded for the format.
+inline uint32_t relocateWord(uint32_t word, RelocationFormat format, int32_t value)
+{
+    switch (format) {
+        case RELOC_WORD:
+            return value;
+
+        case RELOC_I:
+            return (word & 0x000FFFFF)
+                | (value & 0xFFF) << 20;
+
+        case RELOC_S:
+            return (word & 0x01FFF07F)
+                | (value & 0x1F) << 7
+                | ((value >> 5) & 0x7F) << 25;
+
+        case RELOC_SB:
+            return (word & 0x01FFF07F)
+                | ((value >> 11) & 0x1) << 7
+                | (value & 0x1E) << 7
+                | ((value >> 5) & 0x3F) << 25
+                | ((value >> 12) & 0x1) << 31;
+
+        case RELOC_U:
+            return (word & 0x00000FFF)
+                | value << 12;
+
+        case RELOC_UJ:
+            return (word & 0x00000FFF)
+                | ((value >> 12) & 0xFF) << 12
+                | ((value >> 11) & 0x1) << 20
+                | ((value >> 1) & 0x3FF) << 21
+                | ((value >> 20) & 0x1) << 31;
+    }
+
+    return word;
+}
+
+inline void WriteRelocatable(std::ostream& outFile, const RelocatableObject& object)
+{
+    auto writeWord = [&outFile](uint32_t word) {
+        outFile.write(reinterpret_cast<char *>(&word), sizeof(word));
+    };
+
+    RunHeader3 header;
+    header.symbolCount = object.symbols.size();
+    header.relocationCount = object.relocations.size();
+    header.sectionCount = object.sections.size();
+    header.textByteCount = object.text.size()*4;
+    header.dataByteCount = object.data.size()*4;
+    outFile.write(reinterpret_cast<char *>(&header), sizeof(header));
+
+    for(auto& symbol: object.symbols) {
+        writeWord(symbol.address);
+        writeWord((symbol.inDataSegment ? SYMBOL_IN_DATA_SEGMENT : 0) |
+                (symbol.undefined ? SYMBOL_UNDEFINED : 0));
+        writeWord(symbol.name.size() + 1);
+        outFile.write(symbol.name.c_str(), symbol.name.size() + 1);
+    }
+
+    for(auto& relocation: object.relocations) {
+        writeWord(relocation.address);
+        writeWord(relocation.inDataSegment);
+        writeWord(relocation.format);
+        writeWord(relocation.function);
+        writeWord(relocation.symbol);
+        writeWord(relocation.addend);
+    }
+
+    for(auto& section: object.sections) {
+        writeWord(section.address);
+        writeWord(section.inDataSegment);
+        writeWord(section.size);
+        writeWord(section.fallsThrough);
+    }
+
+    for(uint32_t word: object.text) {
+        writeWord(word);
+    }
+    for(uint32_t word: object.data) {
+        writeWord(word);
+    }
+}
+
+inline bool ReadRelocatable(std::istream& binaryFile, RelocatableObject& object)
 {
+    RunHeader3 header;
+    binaryFile.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if(!binaryFile) {
+        std::cerr << "ReadRelocatable : failed to read header, only " << binaryFile.gcount() << " bytes read\n";
+        return false;
+    }
+
+    if(header.magic != RunHeader3MagicExpected) {
+        std::cerr << "ReadRelocatable : magic read did not match magic expected for RunHeader3: " << to_hex(header.magic) << " instead of " << to_hex(RunHeader3MagicExpected) << "\n";
+        return false;
+    }
+
+    for(uint32_t i = 0; i < header.symbolCount; i++) {
+        uint32_t symbolData[3];
+
+        binaryFile.read(reinterpret_cast<char*>(symbolData), sizeof(symbolData));
+        if(!binaryFile) {
+            std::cerr << "ReadRelocatable : failed to read address and length for symbol " << i << "\n";
+            return false;
+        }
+
+        std::vector<char> name(symbolData[2]);
+        binaryFile.read(name.data(), name.size());
+        if(!binaryFile || name.empty()) {
+            std::cerr << "ReadRelocatable : failed to read string for symbol " << i << "\n";
+            return false;
+        }
+
+        object.symbols.push_back(RelocatableObject::Symbol{
+            std::string(name.data()), symbolData[0],
+            (symbolData[1] & SYMBOL_IN_DATA_SEGMENT) != 0,
+            (symbolData[1] & SYMBOL_UNDEFINED) != 0});
+    }
+
+    for(uint32_t i = 0; i < header.relocationCount; i++) {
+        uint32_t relocationData[6];
+
+        binaryFile.read(reinterpret_cast<char*>(relocationData), sizeof(relocationData));
+        if(!binaryFile || relocationData[4] >= header.symbolCount) {
+            std::cerr << "ReadRelocatable : failed to read relocation " << i << "\n";
+            return false;
+        }
+
+        object.relocations.push_back(RelocatableObject::Relocation{
+            relocationData[0], relocationData[1] != 0,
+            static_cast<RelocationFormat>(relocationData[2]),
+            static_cast<RelocationFunction>(relocationData[3]),
+            relocationData[4], static_cast<int32_t>(relocationData[5])});
+    }
+
+    for(uint32_t i = 0; i < header.sectionCount; i++) {
+        uint32_t sectionData[4];
+
+        binaryFile.read(reinterpret_cast<char*>(sectionData), sizeof(sectionData));
+        if(!binaryFile) {
+            std::cerr << "ReadRelocatable : failed to read section " << i << "\n";
+            return false;
+        }
+
+        object.sections.push_back(RelocatableObject::Section{
+            sectionData[0], sectionData[1] != 0, sectionData[2], sectionData[3] != 0});
+    }
+
+    object.text.resize(header.textByteCount/4);
+    binaryFile.read(reinterpret_cast<char*>(object.text.data()), object.text.size()*4);
+    if(!binaryFile) {
+        std::cerr << "ReadRelocatable : failed to read text bytes, only " << binaryFile.gcount() << " bytes read\n";
+        return false;
+    }
+
+    object.data.resize(header.dataByteCount/4);
+    binaryFile.read(reinterpret_cast<char*>(object.data.data()), object.data.size()*4);
+    if(!binaryFile) {
+        std::cerr << "ReadRelocatable : failed to read data bytes, only " << binaryFile.gcount() << " bytes read\n";
+        return false;
+    }
+
+    return true;
+}
+
+// Reads a RunHeader2 executable. A RunHeader3 object is also accepted and
+// loaded as-is at 0, without applying its relocations, which is enough for
+// testing a library on its own.
+inline bool ReadBinary(std::ifstream& binaryFile, RunHeader2& header, SymbolTable& text_symbols, SymbolTable& data_symbols, std::vector<uint8_t>& text_bytes, std::vector<uint8_t>& data_bytes)
+{
+    std::streampos start = binaryFile.tellg();
+    uint32_t magic;
+    binaryFile.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    binaryFile.seekg(start);
+    if(binaryFile && magic == RunHeader3MagicExpected) {
+        RelocatableObject object;
+        if(!ReadRelocatable(binaryFile, object)) {
+            return false;
+        }
+
+        header.initialPC = 0;
+        header.symbolCount = 0;
+        for(auto& symbol: object.symbols) {
+            if(!symbol.undefined) {
+                (symbol.inDataSegment ? data_symbols : text_symbols)[symbol.name] = symbol.address;
+                header.symbolCount++;
+            }
+        }
+        header.textByteCount = object.text.size()*4;
+        header.dataByteCount = object.data.size()*4;
+        text_bytes.resize(header.textByteCount);
+        memcpy(text_bytes.data(), object.text.data(), header.textByteCount);
+        data_bytes.resize(header.dataByteCount);
+        memcpy(data_bytes.data(), object.data.data(), header.dataByteCount);
+
+        return true;
+    }
+
     // TODO: dangerous because of struct packing?
     binaryFile.read(reinterpret_cast<char*>(&header), sizeof(header));
     if(!binaryFile) {
@@ -102,3 +419,5 @@ bool ReadBinary(std::ifstream& binaryFile, RunHeader2& header, SymbolTable& text
 
     return true;
 }
+
+#endif // OBJECTFILE_H
@@ -1,4 +1,6 @@
+#include <atomic>
 #include <iomanip>
+#include <thread>
 
 #include "program.h"
 #include "risc-v.h"
@@ -183,8 +185,11 @@ void Program::postParse() {
 }
 
 void Program::prepareForCompile() {
+    Timer timer;
+
     // Replace phis with ours.
     replacePhi();
+    timeReport.add("replacePhi", "", timer.elapsed());
 
     // Compute successor and predecessor blocks.
     for (auto& [functionId, function] : functions) {
@@ -199,22 +204,124 @@ void Program::prepareForCompile() {
     }
 
     // Break loops by renaming variables in phi instructions.
-    for (auto &[_, function] : functions) {
+    runPerFunction("phiLifting", [](Function *function) {
         function->phiLifting();
-    }
+    });
 
     // Compute the dominance tree for blocks.
-    for (auto &[_, function] : functions) {
+    runPerFunction("computeDomTree", [this](Function *function) {
         function->computeDomTree(verbose);
-    }
+    });
 
     // Convert vector instructions to scalar instructions.
+    timer.reset();
     expandVectors();
+    timeReport.add("expandVectors", "", timer.elapsed());
+
+    // Replace small library calls with inline code.
+    if (!forceLibraryCalls) {
+        timer.reset();
+        inlineLibraryCalls();
+        timeReport.add("inlineLibraryCalls", "", timer.elapsed());
+    }
+
+    // Simplify float arithmetic and fuse multiply-adds. This adds constants
+    // to the program, so it isn't run in parallel.
+    for (auto &[_, function] : functions) {
+        timer.reset();
+        function->peepholeFloat(fastMath, fuseMultiplyAdd);
+        timeReport.add("peepholeFloat", function->cleanName, timer.elapsed());
+    }
+
+    // Remove the copies, duplicate and dead code left by scalarizing.
+    runPerFunction("optimizeSsa", [](Function *function) {
+        function->optimizeSsa();
+    });
+
+    // Hoist loop invariants and unroll loops.
+    runPerFunction("optimizeLoops", [this](Function *function) {
+        function->optimizeLoops(unrollLoops);
+    });
 
-    // Compute liveness and spill variables.
+    // The compiler selects instructions, then computes liveness and spills.
+}
+
+void Program::runPerFunction(const std::string &stageName,
+        const std::function<void(Function *)> &pass) {
+
+    // The first function's range starts where serial allocation would.
+    idRangeBase = nextReg;
+    idRangeOwners.clear();
     for (auto &[_, function] : functions) {
-        function->ensureMaxRegisters();
+        if (idRangeBase + (idRangeOwners.size() + 1)*uint64_t(FUNCTION_ID_RANGE) > UINT32_MAX) {
+            std::cerr << "Error: Out of IDs for per-function passes.\n";
+            exit(EXIT_FAILURE);
+        }
+        function->nextId = idRangeBase + idRangeOwners.size()*FUNCTION_ID_RANGE;
+        function->endId = function->nextId + FUNCTION_ID_RANGE;
+        idRangeOwners.push_back(function.get());
     }
+
+    // Each thread takes the next function that nobody has started.
+    std::atomic<size_t> nextFunction(0);
+    auto worker = [this, &stageName, &pass, &nextFunction]() {
+        for (size_t i = nextFunction++; i < idRangeOwners.size(); i = nextFunction++) {
+            Function *function = idRangeOwners[i];
+            Timer timer;
+            pass(function);
+            if (!stageName.empty()) {
+                function->timeReport.add(stageName, function->cleanName, timer.elapsed());
+            }
+        }
+    };
+    size_t workerCount = std::min(idRangeOwners.size(), size_t(std::max(threadCount, 1)));
+    if (workerCount <= 1) {
+        worker();
+    } else {
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < workerCount; t++) {
+            threads.emplace_back(worker);
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+    }
+
+    // Merge in function order. The next serial ID follows the last one used,
+    // leaving the unused ends of the other ranges as gaps (see
+    // FUNCTION_ID_RANGE).
+    for (Function *function : idRangeOwners) {
+        if (function->nextId > function->endId - FUNCTION_ID_RANGE) {
+            nextReg = function->nextId;
+        }
+        resultTypes.insert(function->newResultTypes.begin(), function->newResultTypes.end());
+        types.insert(function->newTypes.begin(), function->newTypes.end());
+        typeSizes.insert(function->newTypeSizes.begin(), function->newTypeSizes.end());
+        variables.insert(function->newVariables.begin(), function->newVariables.end());
+        timeReport.merge(function->timeReport);
+        std::cout << function->log.str();
+
+        function->nextId = 0;
+        function->endId = 0;
+        function->newResultTypes.clear();
+        function->newTypes.clear();
+        function->newTypeSizes.clear();
+        function->newVariables.clear();
+        function->timeReport = TimeReport();
+        function->log.str("");
+    }
+    idRangeOwners.clear();
+}
+
+uint32_t Program::pendingTypeIdOf(uint32_t id) const {
+    if (id < idRangeBase || (id - idRangeBase)/FUNCTION_ID_RANGE >= idRangeOwners.size()) {
+        return 0;
+    }
+
+    // Only the function's own thread makes or asks about its registers.
+    const Function *function = idRangeOwners[(id - idRangeBase)/FUNCTION_ID_RANGE];
+    auto itr = function->newResultTypes.find(id);
+    return itr == function->newResultTypes.end() ? 0 : itr->second;
 }
 
 void Program::replacePhi() {
@@ -1056,3 +1163,304 @@ void Program::expandVectorsInBlock(Block *block) {
     newList.swap(block->instructions);
 }
 
+// Inline expansions at most this long are about as small as the call they
+// replace (passing arguments, the jal, getting results), so always do them.
+static const size_t INLINE_ALWAYS_SIZE = 4;
+
+// Number of extra instructions we're willing to add to each function to
+// inline the larger expansions. Calls in the deepest loops go first.
+static const size_t INLINE_GROWTH_BUDGET = 256;
+
+void Program::inlineLibraryCalls() {
+    for (auto &[_, function] : functions) {
+        inlineLibraryCallsInFunction(function.get());
+    }
+}
+
+void Program::inlineLibraryCallsInFunction(Function *function) {
+    struct Candidate {
+        int loopDepth;
+        size_t size;
+        Instruction *instruction;
+    };
+    std::vector<Candidate> candidates;
+
+    function->computeLoopDepth();
+    for (auto &[_, block] : function->blocks) {
+        for (auto inst = block->instructions.head; inst; inst = inst->next) {
+            size_t size = inlineSizeOf(inst.get());
+            if (size > 0) {
+                candidates.push_back({block->loopDepth, size, inst.get()});
+            }
+        }
+    }
+
+    // Deepest loops first, then smallest expansions.
+    std::stable_sort(candidates.begin(), candidates.end(),
+            [](const Candidate &a, const Candidate &b) {
+                return a.loopDepth != b.loopDepth ? a.loopDepth > b.loopDepth : a.size < b.size;
+            });
+    std::set<Instruction *> inlined;
+    size_t budget = INLINE_GROWTH_BUDGET;
+    for (auto &candidate : candidates) {
+        if (candidate.size <= INLINE_ALWAYS_SIZE) {
+            inlined.insert(candidate.instruction);
+        } else if (candidate.size - 1 <= budget) {
+            budget -= candidate.size - 1;
+            inlined.insert(candidate.instruction);
+        }
+    }
+
+    for (auto &[_, block] : function->blocks) {
+        InstructionList newList(block.get());
+
+        std::shared_ptr<Instruction> nextInst;
+        for (auto inst = block->instructions.head; inst; inst = nextInst) {
+            nextInst = inst->next;
+
+            if (inlined.find(inst.get()) != inlined.end()) {
+                expandLibraryCall(inst.get(), newList);
+            } else {
+                newList.push_back(inst);
+            }
+        }
+
+        newList.swap(block->instructions);
+    }
+
+    if (verbose) {
+        std::cout << "Inlined " << inlined.size() << " of " << candidates.size()
+            << " library calls in function \"" << function->name << "\".\n";
+    }
+}
+
+size_t Program::inlineSizeOf(const Instruction *instruction) const {
+    size_t argCount = instruction->argIdList.size();
+
+    // Size of an n-component dot product.
+    auto dotSize = [this](size_t n) {
+        return fuseMultiplyAdd ? n : 2*n - 1;
+    };
+
+    switch (instruction->opcode()) {
+        case RiscVOpDot:
+            return dotSize(argCount/2);
+
+        case RiscVOpLength:
+            return argCount == 1 ? 1 : dotSize(argCount) + 1;
+
+        case RiscVOpDistance:
+            return argCount/2 == 1 ? 2 : argCount/2 + dotSize(argCount/2) + 1;
+
+        case RiscVOpNormalize:
+            // The one-component version is sign(), leave it to the library.
+            return argCount == 1 ? 0 : dotSize(argCount) + 2 + argCount;
+
+        case RiscVOpAll:
+        case RiscVOpAny:
+            return argCount == 1 ? 1 : argCount - 1;
+
+        case 0x10000 | GLSLstd450FMix:
+            return fuseMultiplyAdd ? 2 : 3;
+
+        case 0x10000 | GLSLstd450FClamp:
+        case 0x10000 | GLSLstd450Step:
+        case 0x10000 | GLSLstd450Floor:
+            return 2;
+
+        case 0x10000 | GLSLstd450Fract:
+            return 3;
+
+        default:
+            return 0;
+    }
+}
+
+void Program::addMultiplyAdd(const LineInfo &lineInfo, uint32_t type, uint32_t resultId,
+        uint32_t mul1Id, uint32_t mul2Id, uint32_t addId, InstructionList &newList) {
+
+    if (fuseMultiplyAdd) {
+        newList.push_back(std::make_shared<RiscVFmadd>(lineInfo, type, resultId, mul1Id, mul2Id, addId));
+    } else {
+        uint32_t product = newRegister(type);
+        newList.push_back(std::make_shared<InsnFMul>(lineInfo, type, product, mul1Id, mul2Id));
+        newList.push_back(std::make_shared<InsnFAdd>(lineInfo, type, resultId, product, addId));
+    }
+}
+
+void Program::expandLibraryCall(Instruction *instruction, InstructionList &newList) {
+    const LineInfo &lineInfo = instruction->lineInfo;
+    const std::vector<uint32_t> &args = instruction->argIdList;
+    const std::vector<uint32_t> &results = instruction->resIdList;
+    uint32_t type = typeIdOf(results[0]);
+
+    // Dot product of a[0..n) and b[0..n) into resultId.
+    auto addDot = [this, &lineInfo, &newList, type](uint32_t resultId,
+            const uint32_t *a, const uint32_t *b, size_t n) {
+
+        uint32_t sum = n == 1 ? resultId : newRegister(type);
+        newList.push_back(std::make_shared<InsnFMul>(lineInfo, type, sum, a[0], b[0]));
+        for (size_t i = 1; i < n; i++) {
+            uint32_t newSum = i == n - 1 ? resultId : newRegister(type);
+            addMultiplyAdd(lineInfo, type, newSum, a[i], b[i], sum, newList);
+            sum = newSum;
+        }
+    };
+
+    // Length of the n-vector v into resultId.
+    auto addLength = [this, &lineInfo, &newList, type, &addDot](uint32_t resultId,
+            const uint32_t *v, size_t n) {
+
+        if (n == 1) {
+            newList.push_back(std::make_shared<InsnGLSLstd450FAbs>(lineInfo, type, resultId, v[0]));
+        } else {
+            uint32_t squared = newRegister(type);
+            addDot(squared, v, v, n);
+            newList.push_back(std::make_shared<InsnGLSLstd450Sqrt>(lineInfo, type, resultId, squared));
+        }
+    };
+
+    switch (instruction->opcode()) {
+        case RiscVOpDot: {
+            size_t n = args.size()/2;
+            addDot(results[0], &args[0], &args[n], n);
+            break;
+        }
+
+        case RiscVOpLength:
+            addLength(results[0], &args[0], args.size());
+            break;
+
+        case RiscVOpDistance: {
+            size_t n = args.size()/2;
+            std::vector<uint32_t> difference;
+            for (size_t i = 0; i < n; i++) {
+                difference.push_back(newRegister(type));
+                newList.push_back(std::make_shared<InsnFSub>(lineInfo, type,
+                            difference[i], args[i], args[n + i]));
+            }
+            addLength(results[0], &difference[0], n);
+            break;
+        }
+
+        case RiscVOpNormalize: {
+            // One division and a multiply per component.
+            size_t n = args.size();
+            uint32_t length = newRegister(type);
+            uint32_t reciprocal = newRegister(type);
+            addLength(length, &args[0], n);
+            newList.push_back(std::make_shared<InsnFDiv>(lineInfo, type,
+                        reciprocal, getFloatConstant(type, 1.0f), length));
+            for (size_t i = 0; i < n; i++) {
+                newList.push_back(std::make_shared<InsnFMul>(lineInfo, type,
+                            results[i], args[i], reciprocal));
+            }
+            break;
+        }
+
+        case RiscVOpAll:
+        case RiscVOpAny: {
+            bool isAll = instruction->opcode() == RiscVOpAll;
+            if (args.size() == 1) {
+                newList.push_back(std::make_shared<InsnCopyObject>(lineInfo, type, results[0], args[0]));
+                break;
+            }
+            uint32_t value = args[0];
+            for (size_t i = 1; i < args.size(); i++) {
+                uint32_t newValue = i == args.size() - 1 ? results[0] : newRegister(type);
+                if (isAll) {
+                    newList.push_back(std::make_shared<InsnLogicalAnd>(lineInfo, type, newValue, value, args[i]));
+                } else {
+                    newList.push_back(std::make_shared<InsnLogicalOr>(lineInfo, type, newValue, value, args[i]));
+                }
+                value = newValue;
+            }
+            break;
+        }
+
+        case 0x10000 | GLSLstd450FClamp: {
+            // min(max(x, minVal), maxVal)
+            uint32_t atLeastMin = newRegister(type);
+            newList.push_back(std::make_shared<InsnGLSLstd450FMax>(lineInfo, type, atLeastMin, args[0], args[1]));
+            newList.push_back(std::make_shared<InsnGLSLstd450FMin>(lineInfo, type, results[0], atLeastMin, args[2]));
+            break;
+        }
+
+        case 0x10000 | GLSLstd450FMix: {
+            // (y - x)*a + x
+            uint32_t difference = newRegister(type);
+            newList.push_back(std::make_shared<InsnFSub>(lineInfo, type, difference, args[1], args[0]));
+            addMultiplyAdd(lineInfo, type, results[0], difference, args[2], args[0], newList);
+            break;
+        }
+
+        case 0x10000 | GLSLstd450Step: {
+            // edge <= x ? 1.0 : 0.0
+            uint32_t isAtLeastEdge = newRegister(getScalarType(SpvOpTypeBool));
+            newList.push_back(std::make_shared<InsnFOrdLessThanEqual>(lineInfo,
+                        typeIdOf(isAtLeastEdge), isAtLeastEdge, args[0], args[1]));
+            newList.push_back(std::make_shared<InsnConvertSToF>(lineInfo, type, results[0], isAtLeastEdge));
+            break;
+        }
+
+        case 0x10000 | GLSLstd450Floor:
+        case 0x10000 | GLSLstd450Fract: {
+            bool isFloor = instruction->opcode() == (0x10000 | GLSLstd450Floor);
+            uint32_t whole = newRegister(getScalarType(SpvOpTypeInt));
+            newList.push_back(std::make_shared<RiscVFloorToInt>(lineInfo, typeIdOf(whole), whole, args[0]));
+            if (isFloor) {
+                newList.push_back(std::make_shared<InsnConvertSToF>(lineInfo, type, results[0], whole));
+            } else {
+                uint32_t floor = newRegister(type);
+                newList.push_back(std::make_shared<InsnConvertSToF>(lineInfo, type, floor, whole));
+                newList.push_back(std::make_shared<InsnFSub>(lineInfo, type, results[0], args[0], floor));
+            }
+            break;
+        }
+
+        default:
+            std::cerr << "Error: Can't inline " << instruction->name() << ".\n";
+            exit(EXIT_FAILURE);
+    }
+}
+
+uint32_t Program::newRegister(uint32_t type) {
+    uint32_t id = nextReg++;
+    assert(resultTypes.find(id) == resultTypes.end());
+    resultTypes[id] = type;
+
+    return id;
+}
+
+uint32_t Program::getScalarType(uint32_t op) {
+    for (auto &[id, type] : types) {
+        if (type->op() == op) {
+            return id;
+        }
+    }
+
+    uint32_t id = nextReg++;
+    if (op == SpvOpTypeInt) {
+        types[id] = std::make_shared<TypeInt>(32, 1);
+    } else {
+        assert(op == SpvOpTypeBool);
+        types[id] = std::make_shared<TypeBool>();
+    }
+    typeSizes[id] = types[id]->size;
+
+    return id;
+}
+
+uint32_t Program::getFloatConstant(uint32_t type, float value) {
+    for (auto &[id, constant] : constants) {
+        if (constant.type == type && *reinterpret_cast<float *>(constant.data) == value) {
+            return id;
+        }
+    }
+
+    uint32_t id = nextReg++;
+    Register &constant = allocConstantObject(id, type);
+    *reinterpret_cast<float *>(constant.data) = value;
+
+    return id;
+}
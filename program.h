@@ -1,6 +1,7 @@
 #ifndef PROGRAM_H
 #define PROGRAM_H
 
+#include <functional>
 #include <string>
 #include <map>
 #include <set>
@@ -21,6 +22,7 @@
 #include "basic_types.h"
 #include "image.h"
 #include "timer.h"
+#include "timereport.h"
 
 // List of shared instruction pointers.
 #include "opcode_structs.h"
@@ -118,6 +120,39 @@ struct Program
     using RegIndex = std::pair<uint32_t,int>;
     std::map<RegIndex,uint32_t> vec2scalar;
 
+    // Always call library.s for built-ins like dot() and clamp(), instead of
+    // expanding them inline.
+    bool forceLibraryCalls = false;
+
+    // Allow float optimizations that change results slightly, such as
+    // replacing division by any constant with multiplication.
+    bool fastMath = false;
+
+    // Fuse multiplies and adds into fmadd.s and its variants. The emulator
+    // executes these, but the Verilog core doesn't.
+    bool fuseMultiplyAdd = false;
+
+    // Unroll loops with constant trip counts when registers allow.
+    bool unrollLoops = false;
+
+    // Time spent in each stage of building and compiling the program.
+    TimeReport timeReport;
+
+    // Threads used by runPerFunction().
+    int threadCount = 1;
+
+    // While runPerFunction() runs a pass, function i allocates IDs from the
+    // range starting at idRangeBase + i*FUNCTION_ID_RANGE. Ranges are fixed
+    // by function order, not handed out as they fill, so that IDs (and so
+    // the output) don't depend on thread timing. The unused ends of the
+    // ranges are left as gaps in the ID space: compacting them would mean
+    // renumbering every instruction, and nothing is indexed densely by ID.
+    // Each pass uses at most one range per function, so 32-bit IDs allow
+    // about 4000 function-passes.
+    static const uint32_t FUNCTION_ID_RANGE = 1 << 20;
+    uint32_t idRangeBase = 0;
+    std::vector<Function *> idRangeOwners;
+
     SampledImage sampledImages[16];
 
     // Only valid while parsing:
@@ -161,10 +196,19 @@ struct Program
             return itr2->second.type;
         }
 
+        // Look for results made by a pass that's still running.
+        if (!idRangeOwners.empty()) {
+            return pendingTypeIdOf(id);
+        }
+
         // Not found. Should probably look in variables, etc.
         return 0;
     }
 
+    // Type ID of a register made by the function whose range the ID is in,
+    // or 0 if not found.
+    uint32_t pendingTypeIdOf(uint32_t id) const;
+
     // Returns whether this register is a constant.
     bool isConstant(uint32_t regId) const {
         return constants.find(regId) != constants.end();
@@ -286,6 +330,14 @@ struct Program
     // Create data structures that compiler will use.
     void prepareForCompile();
 
+    // Run the pass on every function, spread over threadCount threads.
+    // Functions only share the Program's maps for reading, so each gets its
+    // own range of IDs and keeps what it makes until the pass is done on all
+    // of them. These are then merged, and messages printed, in function
+    // order, so the output doesn't depend on the number of threads. Each
+    // function's time is recorded under the stage name, if it's not empty.
+    void runPerFunction(const std::string &stageName, const std::function<void(Function *)> &pass);
+
     // Return the scalar for the vector register's index.
     uint32_t scalarize(uint32_t vreg, int i, uint32_t subtype, uint32_t scalarReg = 0,
             bool mustExist = false);
@@ -305,6 +357,33 @@ struct Program
     void expandVectorsInBlockTree(Block *block);
     void expandVectorsInBlock(Block *block);
 
+    // Expand calls to small library routines (dot, clamp, etc.) into
+    // straight-line instructions, unless forceLibraryCalls is set.
+    void inlineLibraryCalls();
+    void inlineLibraryCallsInFunction(Function *function);
+
+    // Number of instructions that inlining this library call would
+    // produce, or 0 if it's not one we can inline.
+    size_t inlineSizeOf(const Instruction *instruction) const;
+
+    // Append the inline expansion of the library call to the list.
+    void expandLibraryCall(Instruction *instruction, InstructionList &newList);
+
+    // Append mul1Id*mul2Id + addId into resultId to the list, as one fmadd.s
+    // if fuseMultiplyAdd is set.
+    void addMultiplyAdd(const LineInfo &lineInfo, uint32_t type, uint32_t resultId,
+            uint32_t mul1Id, uint32_t mul2Id, uint32_t addId, InstructionList &newList);
+
+    // Make a new virtual register of the given type.
+    uint32_t newRegister(uint32_t type);
+
+    // Return a scalar type with the specified op (SpvOpTypeInt or
+    // SpvOpTypeBool), adding one if the program doesn't have it.
+    uint32_t getScalarType(uint32_t op);
+
+    // Return a float constant with the value, adding one if necessary.
+    uint32_t getFloatConstant(uint32_t type, float value);
+
     // Compute livein and liveout registers for each line.
     void computeLiveness();
 
@@ -20,6 +20,10 @@ enum {
     RiscVOpAny,
     RiscVOpDistance,
     RiscVOpPhi,
+    RiscVOpFmadd,
+    RiscVOpFloorToInt,
+    RiscVOpSlti,
+    RiscVOpBranch,
 };
 
 // "addi" instruction.
@@ -35,6 +39,24 @@ struct RiscVAddi : public Instruction {
     virtual void step(Interpreter *interpreter) { assert(false); }
     virtual uint32_t opcode() const { return RiscVOpAddi; }
     virtual std::string name() const { return "addi"; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVAddi>(*this); }
+    virtual void emit(Compiler *compiler);
+};
+
+// "slti" instruction.
+struct RiscVSlti : public Instruction {
+    RiscVSlti(const LineInfo& lineInfo, uint32_t type, uint32_t resultId, uint32_t rs1, uint32_t imm) : Instruction(lineInfo), type(type), imm(imm) {
+        addResult(resultId);
+        addParameter(rs1);
+    }
+    uint32_t type; // result type
+    uint32_t resultId() const { return resIdList[0]; } // SSA register for result value
+    uint32_t rs1() const { return argIdList[0]; } // operand from register
+    uint32_t imm; // 12-bit immediate
+    virtual void step(Interpreter *interpreter) { assert(false); }
+    virtual uint32_t opcode() const { return RiscVOpSlti; }
+    virtual std::string name() const { return "slti"; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVSlti>(*this); }
     virtual void emit(Compiler *compiler);
 };
 
@@ -52,6 +74,7 @@ struct RiscVLoad : public Instruction {
     virtual void step(Interpreter *interpreter) { assert(false); }
     virtual uint32_t opcode() const { return RiscVOpLoad; }
     virtual std::string name() const { return "load"; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVLoad>(*this); }
     virtual void emit(Compiler *compiler);
 };
 
@@ -67,6 +90,7 @@ struct RiscVLoadConst : public Instruction {
     virtual void step(Interpreter *interpreter) { assert(false); }
     virtual uint32_t opcode() const { return RiscVOpLoadConst; }
     virtual std::string name() const { return "loadconst"; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVLoadConst>(*this); }
     virtual void emit(Compiler *compiler);
 };
 
@@ -83,6 +107,7 @@ struct RiscVStore : public Instruction {
     virtual void step(Interpreter *interpreter) { assert(false); }
     virtual uint32_t opcode() const { return RiscVOpStore; }
     virtual std::string name() const { return "store"; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVStore>(*this); }
     virtual void emit(Compiler *compiler);
 };
 
@@ -121,6 +146,7 @@ struct RiscVCross : public Instruction {
     virtual void step(Interpreter *interpreter) { assert(false); }
     virtual uint32_t opcode() const { return RiscVOpCross; }
     virtual std::string name() const { return "cross"; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVCross>(*this); }
     virtual void emit(Compiler *compiler);
 };
 
@@ -137,6 +163,7 @@ struct RiscVLength : public Instruction {
     virtual void step(Interpreter *interpreter) { assert(false); }
     virtual uint32_t opcode() const { return RiscVOpLength; }
     virtual std::string name() const { return "length"; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVLength>(*this); }
     virtual void emit(Compiler *compiler);
 };
 
@@ -154,6 +181,7 @@ struct RiscVReflect : public Instruction {
     virtual void step(Interpreter *interpreter) { assert(false); }
     virtual uint32_t opcode() const { return RiscVOpReflect; }
     virtual std::string name() const { return "reflect"; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVReflect>(*this); }
     virtual void emit(Compiler *compiler);
 };
 
@@ -171,6 +199,7 @@ struct RiscVNormalize : public Instruction {
     virtual void step(Interpreter *interpreter) { assert(false); }
     virtual uint32_t opcode() const { return RiscVOpNormalize; }
     virtual std::string name() const { return "normalize"; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVNormalize>(*this); }
     virtual void emit(Compiler *compiler);
 };
 
@@ -190,6 +219,7 @@ struct RiscVDot : public Instruction {
     virtual void step(Interpreter *interpreter) { assert(false); }
     virtual uint32_t opcode() const { return RiscVOpDot; }
     virtual std::string name() const { return "dot"; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVDot>(*this); }
     virtual void emit(Compiler *compiler);
 };
 
@@ -206,6 +236,7 @@ struct RiscVAll : public Instruction {
     virtual void step(Interpreter *interpreter) { assert(false); }
     virtual uint32_t opcode() const { return RiscVOpAll; }
     virtual std::string name() const { return "all"; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVAll>(*this); }
     virtual void emit(Compiler *compiler);
 };
 
@@ -222,6 +253,7 @@ struct RiscVAny : public Instruction {
     virtual void step(Interpreter *interpreter) { assert(false); }
     virtual uint32_t opcode() const { return RiscVOpAny; }
     virtual std::string name() const { return "any"; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVAny>(*this); }
     virtual void emit(Compiler *compiler);
 };
 
@@ -241,6 +273,87 @@ struct RiscVDistance : public Instruction {
     virtual void step(Interpreter *interpreter) { assert(false); }
     virtual uint32_t opcode() const { return RiscVOpDistance; }
     virtual std::string name() const { return "distance"; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVDistance>(*this); }
+    virtual void emit(Compiler *compiler);
+};
+
+// Fused multiply-add instruction: result = mul1*mul2 + add. The product
+// and the addend can each be negated, giving fmsub, fnmsub, and fnmadd.
+struct RiscVFmadd : public Instruction {
+    RiscVFmadd(const LineInfo& lineInfo, uint32_t type, uint32_t resultId, uint32_t mul1Id, uint32_t mul2Id, uint32_t addId,
+            bool negateProduct = false, bool negateAddend = false)
+        : Instruction(lineInfo), type(type), negateProduct(negateProduct), negateAddend(negateAddend) {
+
+        addResult(resultId);
+        addParameter(mul1Id);
+        addParameter(mul2Id);
+        addParameter(addId);
+    }
+    uint32_t type; // result type
+    bool negateProduct;
+    bool negateAddend;
+    uint32_t resultId() const { return resIdList[0]; } // SSA register for result value
+    uint32_t mul1Id() const { return argIdList[0]; } // operand from register
+    uint32_t mul2Id() const { return argIdList[1]; } // operand from register
+    uint32_t addId() const { return argIdList[2]; } // operand from register
+    virtual void step(Interpreter *interpreter) { assert(false); }
+    virtual uint32_t opcode() const { return RiscVOpFmadd; }
+    virtual std::string name() const {
+        return negateProduct
+            ? (negateAddend ? "fnmadd" : "fnmsub")
+            : (negateAddend ? "fmsub" : "fmadd");
+    }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVFmadd>(*this); }
+    virtual void emit(Compiler *compiler);
+};
+
+// Convert float to int, rounding toward negative infinity.
+struct RiscVFloorToInt : public Instruction {
+    RiscVFloorToInt(const LineInfo& lineInfo, uint32_t type, uint32_t resultId, uint32_t xId) : Instruction(lineInfo), type(type) {
+        addResult(resultId);
+        addParameter(xId);
+    }
+    uint32_t type; // result type
+    uint32_t resultId() const { return resIdList[0]; } // SSA register for result value
+    uint32_t xId() const { return argIdList[0]; } // operand from register
+    virtual void step(Interpreter *interpreter) { assert(false); }
+    virtual uint32_t opcode() const { return RiscVOpFloorToInt; }
+    virtual std::string name() const { return "floortoint"; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVFloorToInt>(*this); }
+    virtual void emit(Compiler *compiler);
+};
+
+// Conditional branch on the comparison of two integer registers ("blt",
+// "bge", "beq", or "bne"), replacing a compare and an OpBranchConditional.
+// An operand of 0 means x0 and isn't a parameter.
+struct RiscVBranch : public Instruction {
+    RiscVBranch(const LineInfo& lineInfo, const std::string &branchOp, uint32_t rs1, uint32_t rs2,
+            uint32_t trueLabelId, uint32_t falseLabelId)
+        : Instruction(lineInfo), branchOp(branchOp), rs1IsZero(rs1 == 0), rs2IsZero(rs2 == 0),
+          trueLabelId(trueLabelId), falseLabelId(falseLabelId) {
+
+        if (!rs1IsZero) {
+            addParameter(rs1);
+        }
+        if (!rs2IsZero) {
+            addParameter(rs2);
+        }
+        targetLabelIds.insert(trueLabelId);
+        targetLabelIds.insert(falseLabelId);
+    }
+    std::string branchOp; // Taken to trueLabelId if the comparison holds.
+    bool rs1IsZero;
+    bool rs2IsZero;
+    uint32_t rs1() const { return rs1IsZero ? 0 : argIdList[0]; } // operand from register
+    uint32_t rs2() const { return rs2IsZero ? 0 : argIdList[rs1IsZero ? 0 : 1]; } // operand from register
+    uint32_t trueLabelId;
+    uint32_t falseLabelId;
+    virtual void step(Interpreter *interpreter) { assert(false); }
+    virtual uint32_t opcode() const { return RiscVOpBranch; }
+    virtual std::string name() const { return branchOp; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVBranch>(*this); }
+    virtual bool isBranch() const { return true; }
+    virtual bool isTermination() const { return true; }
     virtual void emit(Compiler *compiler);
 };
 
@@ -256,6 +369,7 @@ struct RiscVPhi : public Instruction {
     virtual void step(Interpreter *interpreter) { assert(false); }
     virtual uint32_t opcode() const { return RiscVOpPhi; }
     virtual std::string name() const { return "phi"; }
+    virtual std::shared_ptr<Instruction> clone() const { return std::make_shared<RiscVPhi>(*this); }
     virtual void emit(Compiler *compiler);
 
     // Return the label index for the specified source block ID, or -1 if not found.
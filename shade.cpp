@@ -3,11 +3,15 @@
 #include <functional>
 #include <set>
 #include <cstdio>
+#include <cmath>
 #include <fstream>
 #include <chrono>
 #include <thread>
 #include <algorithm>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <sstream>
 #include <iomanip>
 #include <memory>
@@ -36,6 +40,9 @@
 #include "shadertoy.h"
 #include "timer.h"
 #include "compiler.h"
+#include "json.hpp"
+
+using json = nlohmann::json;
 
 #define DEFAULT_WIDTH (640/2)
 #define DEFAULT_HEIGHT (360/2)
@@ -45,7 +52,8 @@
 // Enable this to check if our virtual registers are being initialized properly.
 #define CHECK_REGISTER_ACCESS
 
-static const char *DEFAULT_ASSEMBLY_PATHNAME = "out.s";
+static const char *DEFAULT_OUTPUT_PATHNAME = "out.o";
+static const char *TIME_REPORT_PATHNAME = "time-report.json";
 
 // -----------------------------------------------------------------------------------
 
@@ -59,6 +67,11 @@ void RiscVAddi::emit(Compiler *compiler)
     compiler->emitBinaryImmOp("addi", resultId(), rs1(), imm);
 }
 
+void RiscVSlti::emit(Compiler *compiler)
+{
+    compiler->emitBinaryImmOp("slti", resultId(), rs1(), imm);
+}
+
 void RiscVLoad::emit(Compiler *compiler)
 {
     std::ostringstream ss;
@@ -72,11 +85,7 @@ void RiscVLoad::emit(Compiler *compiler)
     assert(!compiler->pgm->isConstant(pointerId())); // Use RiscVLoadConst.
     if (compiler->asRegister(pointerId()) == nullptr) {
         // It's a variable reference.
-        ss << compiler->getVariableName(pointerId());
-        if (offset != 0) {
-            ss << "+" << offset;
-        }
-        ss << "(x0)";
+        ss << compiler->dataOperand(compiler->getVariableName(pointerId()), offset);
     } else {
         // It's a register reference.
         ss << offset << "(" << compiler->reg(pointerId()) << ")";
@@ -87,18 +96,19 @@ void RiscVLoad::emit(Compiler *compiler)
 
 void RiscVLoadConst::emit(Compiler *compiler)
 {
-    std::ostringstream ss;
     std::ostringstream ssc;
-
-    if (compiler->isRegFloat(resultId())) {
-        ss << "flw ";
-    } else {
-        ss << "lw ";
-    }
-    ss << compiler->reg(resultId()) << ", " << ".C" << constId << "(x0)";
     ssc << "r" << resultId() << " = constant r" << constId;
 
-    compiler->emit(ss.str(), ssc.str());
+    // Integers and simple floats are built in the register instead of loaded.
+    // Floats go through a free integer register, which we must have found
+    // room for when laying out the data.
+    std::string scratch;
+    if (compiler->hasScratchRegister(this)) {
+        scratch = compiler->findScratchRegister(this);
+        assert(!scratch.empty());
+    }
+    compiler->emitLoadConstant(compiler->reg(resultId()), compiler->isRegFloat(resultId()),
+            constId, scratch, ssc.str());
 }
 
 void RiscVStore::emit(Compiler *compiler)
@@ -112,11 +122,7 @@ void RiscVStore::emit(Compiler *compiler)
     ss1 << compiler->reg(objectId()) << ", ";
     if (compiler->asRegister(pointerId()) == nullptr) {
         // It's a variable reference.
-        ss1 << compiler->getVariableName(pointerId());
-        if (offset != 0) {
-            ss1 << "+" << offset;
-        }
-        ss1 << "(x0)";
+        ss1 << compiler->dataOperand(compiler->getVariableName(pointerId()), offset);
     } else {
         // It's a register reference.
         ss1 << offset << "(" << compiler->reg(pointerId()) << ")";
@@ -128,29 +134,7 @@ void RiscVStore::emit(Compiler *compiler)
 
 void RiscVCross::emit(Compiler *compiler)
 {
-    compiler->emit("addi sp, sp, -28", "Make room on stack");
-    compiler->emit("sw ra, 24(sp)", "Save return address");
-
-    for (int i = argIdList.size() - 1; i >= 0; i--) {
-        std::ostringstream ss;
-        ss << "fsw " << compiler->reg(argIdList[i]) << ", " << (i*4) << "(sp)";
-        std::ostringstream ssc;
-        ssc << "Push parameter r" << argIdList[i];
-        compiler->emit(ss.str(), ssc.str());
-    }
-
-    compiler->emit("jal ra, .cross", "Call routine");
-
-    for (size_t i = 0; i < resIdList.size(); i++) {
-        std::ostringstream ss;
-        ss << "flw " << compiler->reg(resIdList[i]) << ", " << (i*4) << "(sp)";
-        std::ostringstream ssc;
-        ssc << "Pop result r" << resIdList[i];
-        compiler->emit(ss.str(), ssc.str());
-    }
-
-    compiler->emit("lw ra, 12(sp)", "Restore return address");
-    compiler->emit("addi sp, sp, 16", "Restore stack");
+    compiler->emitCall(".cross", resIdList, argIdList);
 }
 
 void RiscVLength::emit(Compiler *compiler)
@@ -230,6 +214,29 @@ void RiscVAny::emit(Compiler *compiler)
     compiler->emitCall(functionName.str(), resIdList, argIdList);
 }
 
+void RiscVFmadd::emit(Compiler *compiler)
+{
+    std::ostringstream ss1;
+    ss1 << name() << ".s " << compiler->reg(resultId())
+        << ", " << compiler->reg(mul1Id())
+        << ", " << compiler->reg(mul2Id())
+        << ", " << compiler->reg(addId());
+    std::ostringstream ss2;
+    ss2 << "r" << resultId() << " = " << (negateProduct ? "-" : "")
+        << "r" << mul1Id() << "*r" << mul2Id()
+        << (negateAddend ? " - r" : " + r") << addId();
+    compiler->emit(ss1.str(), ss2.str());
+}
+
+void RiscVFloorToInt::emit(Compiler *compiler)
+{
+    std::ostringstream ss1;
+    ss1 << "fcvt.w.s " << compiler->reg(resultId()) << ", " << compiler->reg(xId()) << ", rdn";
+    std::ostringstream ss2;
+    ss2 << "r" << resultId() << " = floor(r" << xId() << ")";
+    compiler->emit(ss1.str(), ss2.str());
+}
+
 // -----------------------------------------------------------------------------------
 
 void Instruction::emit(Compiler *compiler)
@@ -269,16 +276,9 @@ void InsnFNegate::emit(Compiler *compiler)
 
 void InsnIAdd::emit(Compiler *compiler)
 {
-    uint32_t intValue;
-    if (compiler->asIntegerConstant(operand1Id(), intValue)) {
-        // XXX Verify that immediate fits in 12 bits.
-        compiler->emitBinaryImmOp("addi", resultId(), operand2Id(), intValue);
-    } else if (compiler->asIntegerConstant(operand2Id(), intValue)) {
-        // XXX Verify that immediate fits in 12 bits.
-        compiler->emitBinaryImmOp("addi", resultId(), operand1Id(), intValue);
-    } else {
-        compiler->emitBinaryOp("add", resultId(), operand1Id(), operand2Id());
-    }
+    // Small constants were turned into RiscVAddi by transformInstructions(),
+    // any constant left here doesn't fit in an immediate.
+    compiler->emitBinaryOp("add", resultId(), operand1Id(), operand2Id());
 }
 
 void InsnIEqual::emit(Compiler *compiler)
@@ -394,14 +394,16 @@ void InsnBranch::emit(Compiler *compiler)
     // See if we need to emit any copies for Phis at our target.
     compiler->emitPhiCopy(this, targetLabelId);
 
-    std::ostringstream ss;
-    ss << "jal x0, block" << targetLabelId;
-    compiler->emit(ss.str(), "");
+    if (targetLabelId != compiler->nextBlockId) {
+        std::ostringstream ss;
+        ss << "jal x0, block" << targetLabelId;
+        compiler->emit(ss.str(), "");
+    }
 }
 
 void InsnReturn::emit(Compiler *compiler)
 {
-    compiler->emit("jalr x0, ra, 0", "");
+    compiler->emitReturn();
 }
 
 void InsnReturnValue::emit(Compiler *compiler)
@@ -411,7 +413,7 @@ void InsnReturnValue::emit(Compiler *compiler)
     std::ostringstream ss2;
     ss2 << "return " << valueId();
     compiler->emit(ss1.str(), ss2.str());
-    compiler->emit("jalr x0, ra, 0", "");
+    compiler->emitReturn();
 }
 
 void InsnPhi::emit(Compiler *compiler)
@@ -456,25 +458,20 @@ void InsnFOrdGreaterThan::emit(Compiler *compiler)
 
 void InsnBranchConditional::emit(Compiler *compiler)
 {
-    std::string localLabel = compiler->makeLocalLabel();
-
-    std::ostringstream ss1;
-    ss1 << "beq " << compiler->reg(conditionId())
-        << ", x0, " << localLabel;
     std::ostringstream ssid;
     ssid << "r" << conditionId();
-    compiler->emit(ss1.str(), ssid.str());
-    // True path.
-    compiler->emitPhiCopy(this, trueLabelId);
-    std::ostringstream ss2;
-    ss2 << "jal x0, block" << trueLabelId;
-    compiler->emit(ss2.str(), "");
-    // False path.
-    compiler->emitLabel(localLabel);
-    compiler->emitPhiCopy(this, falseLabelId);
-    std::ostringstream ss3;
-    ss3 << "jal x0, block" << falseLabelId;
-    compiler->emit(ss3.str(), "");
+    compiler->emitConditionalBranch(this, "bne", compiler->reg(conditionId()), "x0",
+            ssid.str(), trueLabelId, falseLabelId);
+}
+
+void RiscVBranch::emit(Compiler *compiler)
+{
+    std::ostringstream ssc;
+    ssc << "r" << rs1() << " " << branchOp << " r" << rs2();
+    compiler->emitConditionalBranch(this, branchOp,
+            rs1IsZero ? "x0" : compiler->reg(rs1()),
+            rs2IsZero ? "x0" : compiler->reg(rs2()),
+            ssc.str(), trueLabelId, falseLabelId);
 }
 
 void InsnAccessChain::emit(Compiler *compiler)
@@ -531,11 +528,18 @@ void InsnAccessChain::emit(Compiler *compiler)
         }
 
         // Add to base.
-        {
+        std::string label = compiler->getVariableName(baseId());
+        if (compiler->farData.find(label) == compiler->farData.end()) {
             std::ostringstream ss;
             ss << "addi " << compiler->reg(resultId()) << ", "
-                << compiler->reg(resultId()) << ", "
-                << compiler->getVariableName(baseId());
+                << compiler->reg(resultId()) << ", " << label;
+            compiler->emit(ss.str(), "Add to variable location");
+        } else {
+            compiler->emit("lui gp, %hi(" + label + ")", "Outside small data");
+            compiler->emit("addi gp, gp, %lo(" + label + ")", "");
+            std::ostringstream ss;
+            ss << "add " << compiler->reg(resultId()) << ", "
+                << compiler->reg(resultId()) << ", gp";
             compiler->emit(ss.str(), "Add to variable location");
         }
     } else {
@@ -547,10 +551,19 @@ void InsnAccessChain::emit(Compiler *compiler)
             exit(EXIT_FAILURE);
         }
 
+        std::string label = compiler->notEmptyLabel(name->second);
         std::ostringstream ss;
-        ss << "addi " << compiler->reg(resultId()) << ", x0, "
-            << compiler->notEmptyLabel(name->second) << "+" << offset;
-        compiler->emit(ss.str(), "");
+        if (compiler->farData.find(label) == compiler->farData.end()) {
+            ss << "addi " << compiler->reg(resultId()) << ", x0, " << label << "+" << offset;
+            compiler->emit(ss.str(), "");
+        } else {
+            ss << "lui " << compiler->reg(resultId()) << ", %hi(" << label << "+" << offset << ")";
+            compiler->emit(ss.str(), "Outside small data");
+            ss.str("");
+            ss << "addi " << compiler->reg(resultId()) << ", " << compiler->reg(resultId())
+                << ", %lo(" << label << "+" << offset << ")";
+            compiler->emit(ss.str(), "");
+        }
     }
 }
 
@@ -736,9 +749,29 @@ void usage(const char* progname)
     printf("\t-n        Compile and load shader, but do not shade an image\n");
     printf("\t-S        show the disassembly of the SPIR-V code\n");
     printf("\t-c        compile to our own ISA\n");
+    printf("\t--greedy-ra  use the greedy register allocator instead of graph coloring\n");
+    printf("\t--no-inline  always call the library for built-ins like dot() and clamp()\n");
+    printf("\t--fast-math  allow float optimizations that slightly change results\n");
+    printf("\t--fused-madd  use fmadd.s and its variants, which the Verilog core doesn't execute\n");
+    printf("\t--unroll  unroll loops with constant trip counts\n");
+    printf("\t--schedule  reorder instructions to hide float latencies\n");
+    printf("\t--time-report  print the time of each stage and IR statistics, and write them to %s\n", TIME_REPORT_PATHNAME);
     printf("\t--json    input file is a ShaderToy JSON file\n");
     printf("\t--term    draw output image on terminal (in addition to file)\n");
-    printf("\t-o out.s  output assembly pathname [%s]\n", DEFAULT_ASSEMBLY_PATHNAME);
+    printf("\t--progressive  write coarse previews of the image while shading it\n");
+    printf("\t--aa T N  take up to N extra samples in pixels differing from a neighbor by more than T\n");
+    printf("\t-o out.o  output object pathname, or assembly if it ends in .s [%s]\n", DEFAULT_OUTPUT_PATHNAME);
+    printf("\t--texcache DIR  keep preconverted textures in DIR\n");
+    printf("\t--libdir DIR  read library.s and library.o from DIR [directory of %s]\n", progname);
+}
+
+// Directory part of the program's pathname, which is where "make" leaves
+// the library. If it has none the program was found on the PATH, and we
+// can only guess the current directory.
+std::string getProgramDirectory(const char* progname)
+{
+    const char *slash = strrchr(progname, '/');
+    return slash == nullptr ? "." : std::string(progname, slash - progname);
 }
 
 const std::string shaderPreambleFilename = "preamble.frag";
@@ -747,10 +780,9 @@ const std::string shaderEpilogueFilename = "epilogue.frag";
 // Number of rows still left to shade (for progress report).
 static std::atomic_int rowsLeft;
 
-// Render rows starting at "startRow" every "skip".
-void render(ShaderToyRenderPass* pass, int startRow, int skip, int frameNumber, float when)
+// Set the uniforms of "pass" for this frame.
+void setupInterpreter(Interpreter &interpreter, ShaderToyRenderPass* pass, int frameNumber, float when)
 {
-    Interpreter interpreter(&pass->pgm);
     ImagePtr output = pass->outputs[0].sampledImage.image;
 
     interpreter.set("iResolution", v3float {static_cast<float>(output->width), static_cast<float>(output->height), 1.0f});
@@ -771,19 +803,393 @@ void render(ShaderToyRenderPass* pass, int startRow, int skip, int frameNumber,
         float h = static_cast<float>(image->height);
         interpreter.set("iChannelResolution[" + std::to_string(input.channelNumber) + "]", v3float{w, h, 0});
     }
+}
+
+// Pixel strides of the levels of a progressive render, coarsest first.
+static const std::vector<uint32_t> PROGRESSIVE_STEPS = {8, 4, 2, 1};
+
+// Render row "y" of the pass's output, shading every "step"th pixel. If
+// "refine" is true, the pixels of the previous level (twice the step) have
+// already been shaded and are skipped.
+void renderRow(Interpreter &interpreter, ShaderToyRenderPass* pass, uint32_t y, uint32_t step, bool refine)
+{
+    ImagePtr output = pass->outputs[0].sampledImage.image;
+
+    uint32_t firstX = 0;
+    uint32_t strideX = step;
+    if(refine && y % (step*2) == 0) {
+        firstX = step;
+        strideX = step*2;
+    }
 
     // This loop acts like a rasterizer fixed function block.  Maybe it should
     // set inputs and read outputs also.
+    for(uint32_t x = firstX; x < output->width; x += strideX) {
+        v4float color;
+        output->get(x, output->height - 1 - y, color);
+        eval(interpreter, x + 0.5f, y + 0.5f, color);
+        output->set(x, output->height - 1 - y, color);
+    }
+
+    rowsLeft--;
+}
+
+// Return a copy of "image" where every pixel takes the value of the
+// shaded pixel at the start of its "step" by "step" cell.
+ImagePtr fillPreview(ImagePtr image, uint32_t step)
+{
+    ImagePtr preview(new Image(image->format, Image::DIM_2D, image->width, image->height));
+
+    for(uint32_t y = 0; y < image->height; y++) {
+        for(uint32_t x = 0; x < image->width; x++) {
+            // Copy raw pixels; a round trip through v4float may not be exact.
+            const unsigned char *s = image->getPixelAddress(x - x % step, image->height - 1 - (y - y % step));
+            std::copy(s, s + image->pixelSize, preview->getPixelAddress(x, image->height - 1 - y));
+        }
+    }
+
+    return preview;
+}
+
+// State shared by the workers shading one frame of the render graph. A pass
+// is ready once all of its predecessors have been shaded; the rows of ready
+// passes all go into one queue, so independent passes shade concurrently.
+// The progressive pass, if any, is shaded one level of PROGRESSIVE_STEPS at
+// a time, calling levelShaded with a preview after each level but the last.
+struct RenderGraphFrame
+{
+    struct Row {
+        size_t passIndex;
+        uint32_t y;
+        uint32_t step;
+        bool refine;
+    };
+
+    // Copy of a finished level, numbered in the order the levels finished.
+    struct Preview {
+        ImagePtr image;
+        uint32_t sequence;
+    };
+
+    const std::vector<ShaderToyRenderPassPtr>& passes;
+    std::vector<std::set<size_t>> successors;
+    int frameNumber;
+    float when;
+    size_t progressivePass;     // passes.size() if none.
+    std::function<void(ImagePtr preview)> levelShaded;
+    Timer timer;
+
+    // Previews are written without the mutex held, so they may finish
+    // writing out of order. Only previews newer than the last one written
+    // are written. Protected by previewMutex.
+    std::mutex previewMutex;
+    uint32_t previewsWritten;
+
+    // Everything below is protected by the mutex.
+    std::mutex mutex;
+    std::condition_variable rowsReady;
+    std::deque<Row> rowQueue;
+    std::vector<size_t> predecessorsLeft;
+    std::vector<size_t> levelInPass;
+    std::vector<uint32_t> rowsLeftInPass;       // In the current level.
+    size_t passesLeft;
+    std::vector<double> startTime;
+    std::vector<double> endTime;
+    uint32_t previewsMade;
+
+    RenderGraphFrame(const std::vector<ShaderToyRenderPassPtr>& passes_,
+            const std::vector<std::set<size_t>>& predecessors, int frameNumber_, float when_,
+            size_t progressivePass_, std::function<void(ImagePtr)> levelShaded_) :
+        passes(passes_),
+        successors(passes_.size()),
+        frameNumber(frameNumber_),
+        when(when_),
+        progressivePass(progressivePass_),
+        levelShaded(levelShaded_),
+        previewsWritten(0),
+        predecessorsLeft(passes_.size()),
+        levelInPass(passes_.size()),
+        rowsLeftInPass(passes_.size()),
+        passesLeft(passes_.size()),
+        startTime(passes_.size()),
+        endTime(passes_.size()),
+        previewsMade(0)
+    {
+        for(size_t i = 0; i < passes.size(); i++) {
+            predecessorsLeft[i] = predecessors[i].size();
+            for(size_t p: predecessors[i]) {
+                successors[p].insert(i);
+            }
+        }
+
+        for(size_t i = 0; i < passes.size(); i++) {
+            if(predecessorsLeft[i] == 0) {
+                startPass(i);
+            }
+        }
+    }
+
+    // Number of levels the pass is shaded in.
+    size_t getLevelCount(size_t passIndex) const
+    {
+        return passIndex == progressivePass ? PROGRESSIVE_STEPS.size() : 1;
+    }
+
+    // Pixel stride of the pass's current level.
+    uint32_t getStep(size_t passIndex) const
+    {
+        return passIndex == progressivePass ? PROGRESSIVE_STEPS[levelInPass[passIndex]] : 1;
+    }
+
+    // Queue all rows of the pass's current level. Mutex must be held.
+    void startLevel(size_t passIndex)
+    {
+        uint32_t height = passes[passIndex]->outputs[0].sampledImage.image->height;
+        uint32_t step = getStep(passIndex);
+        bool refine = levelInPass[passIndex] > 0;
+
+        rowsLeftInPass[passIndex] = 0;
+        for(uint32_t y = 0; y < height; y += step) {
+            rowQueue.push_back({passIndex, y, step, refine});
+            rowsLeftInPass[passIndex]++;
+        }
+        rowsReady.notify_all();
+    }
+
+    // Mutex must be held.
+    void startPass(size_t passIndex)
+    {
+        startTime[passIndex] = timer.elapsed();
+        startLevel(passIndex);
+    }
+
+    // Record that a row has been shaded, starting the next level or any
+    // passes that were waiting on this one. Mutex must be held. Returns a
+    // copy of the level to pass to writePreview() if it finished a level
+    // other than the pass's last, and a null image otherwise. The copy is
+    // made before the next level starts shading into the image.
+    Preview finishRow(size_t passIndex)
+    {
+        if(--rowsLeftInPass[passIndex] > 0) {
+            return {nullptr, 0};
+        }
+
+        if(levelInPass[passIndex] + 1 < getLevelCount(passIndex)) {
+            ImagePtr image = passes[passIndex]->outputs[0].sampledImage.image;
+            Preview preview = {fillPreview(image, getStep(passIndex)), ++previewsMade};
+            levelInPass[passIndex]++;
+            startLevel(passIndex);
+            return preview;
+        }
+
+        endTime[passIndex] = timer.elapsed();
+        passesLeft--;
+        for(size_t s: successors[passIndex]) {
+            if(--predecessorsLeft[s] == 0) {
+                startPass(s);
+            }
+        }
+        if(passesLeft == 0) {
+            rowsReady.notify_all();
+        }
+
+        return {nullptr, 0};
+    }
+
+    // Write a preview returned by finishRow(), unless a later one has
+    // already been written. Mutex must not be held. The final image is
+    // written after the workers have been joined, so no preview can
+    // overwrite it.
+    void writePreview(const Preview &preview)
+    {
+        std::lock_guard<std::mutex> lock(previewMutex);
+        if(preview.sequence > previewsWritten) {
+            levelShaded(preview.image);
+            previewsWritten = preview.sequence;
+        }
+    }
+
+    // Total number of rows, over all levels, that will be shaded.
+    uint32_t getTotalRowCount() const
+    {
+        uint32_t count = 0;
+        for(size_t i = 0; i < passes.size(); i++) {
+            uint32_t height = passes[i]->outputs[0].sampledImage.image->height;
+            if(i == progressivePass) {
+                for(uint32_t step: PROGRESSIVE_STEPS) {
+                    count += (height + step - 1) / step;
+                }
+            } else {
+                count += height;
+            }
+        }
+        return count;
+    }
+};
+
+// Worker thread: shade rows from the queue until every pass is done.
+void renderGraphWorker(RenderGraphFrame* frame)
+{
+    // Interpreters for the passes this worker has shaded rows of.
+    std::map<size_t, std::unique_ptr<Interpreter>> interpreters;
+
+    while(true) {
+        RenderGraphFrame::Row row;
+
+        {
+            std::unique_lock<std::mutex> lock(frame->mutex);
+            frame->rowsReady.wait(lock, [frame]() {
+                return !frame->rowQueue.empty() || frame->passesLeft == 0;
+            });
+            if(frame->rowQueue.empty()) {
+                break;
+            }
+            row = frame->rowQueue.front();
+            frame->rowQueue.pop_front();
+        }
+
+        ShaderToyRenderPass* pass = frame->passes[row.passIndex].get();
+        std::unique_ptr<Interpreter>& interpreter = interpreters[row.passIndex];
+        if(!interpreter) {
+            interpreter.reset(new Interpreter(&pass->pgm));
+            setupInterpreter(*interpreter, pass, frame->frameNumber, frame->when);
+        }
+
+        renderRow(*interpreter, pass, row.y, row.step, row.refine);
+
+        RenderGraphFrame::Preview preview;
+        {
+            std::lock_guard<std::mutex> lock(frame->mutex);
+            preview = frame->finishRow(row.passIndex);
+        }
+        if(preview.image) {
+            frame->writePreview(preview);
+        }
+    }
+}
+
+// Return which pixels of "image" differ from a 4-neighbor by more than
+// "threshold" in any color channel, indexed by y*width + x.
+std::vector<bool> findEdgePixels(ImagePtr image, float threshold)
+{
+    std::vector<bool> edges(image->width * image->height);
+
+    for(uint32_t y = 0; y < image->height; y++) {
+        for(uint32_t x = 0; x < image->width; x++) {
+            v4float color;
+            image->get(x, y, color);
+
+            static const int neighbors[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+            for(auto [dx, dy]: neighbors) {
+                if((x == 0 && dx < 0) || (x + 1 == image->width && dx > 0) ||
+                        (y == 0 && dy < 0) || (y + 1 == image->height && dy > 0)) {
+                    continue;
+                }
+
+                v4float neighbor;
+                image->get(x + dx, y + dy, neighbor);
+                for(int c = 0; c < 3; c++) {
+                    if(fabsf(color[c] - neighbor[c]) > threshold) {
+                        edges[(image->height - 1 - y) * image->width + x] = true;
+                    }
+                }
+            }
+        }
+    }
+
+    return edges;
+}
+
+// Deterministic pseudo-random number in [0,1) for jittering samples.
+static float sampleJitter(uint32_t x, uint32_t y, uint32_t i)
+{
+    uint32_t h = x * 0x8da6b343 ^ y * 0xd8163841 ^ i * 0xcb1ab31f;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6d;
+    h ^= h >> 12;
+    return (h >> 8) / float(1 << 24);
+}
+
+// Shade rows starting at "startRow" every "skip", taking "strata"-squared
+// extra jittered samples, one per stratum, for each pixel marked in "edges".
+// The pixel becomes the mean of its original sample and the extra ones.
+void supersampleRows(ShaderToyRenderPass* pass, int startRow, int skip, int frameNumber, float when,
+        const std::vector<bool>* edges, int strata, std::atomic_long* extraSamples)
+{
+    Interpreter interpreter(&pass->pgm);
+    setupInterpreter(interpreter, pass, frameNumber, when);
+    ImagePtr output = pass->outputs[0].sampledImage.image;
+
     for(uint32_t y = startRow; y < output->height; y += skip) {
         for(uint32_t x = 0; x < output->width; x++) {
-            v4float color;
-            output->get(x, output->height - 1 - y, color);
-            eval(interpreter, x + 0.5f, y + 0.5f, color);
-            output->set(x, output->height - 1 - y, color);
+            if(!(*edges)[y * output->width + x]) {
+                continue;
+            }
+
+            v4float original;
+            output->get(x, output->height - 1 - y, original);
+            v4float sum = original;
+
+            for(int j = 0; j < strata; j++) {
+                for(int i = 0; i < strata; i++) {
+                    uint32_t sampleIndex = j * strata + i;
+                    float u = (i + sampleJitter(x, y, sampleIndex*2)) / strata;
+                    float v = (j + sampleJitter(x, y, sampleIndex*2 + 1)) / strata;
+                    v4float color = original;
+                    eval(interpreter, x + u, y + v, color);
+                    for(int c = 0; c < 4; c++) {
+                        sum[c] += color[c];
+                    }
+                }
+            }
+
+            for(int c = 0; c < 4; c++) {
+                sum[c] /= 1 + strata*strata;
+            }
+            output->set(x, output->height - 1 - y, sum);
+            *extraSamples += strata*strata;
         }
+    }
+}
 
-        rowsLeft--;
+// Print per-pass timing and the critical path through the render graph.
+// Passes are in dependency order, so a single forward sweep finds, for each
+// pass, the longest chain of pass times ending with it.
+void printRenderGraphStats(const RenderGraphFrame& frame, const std::vector<std::set<size_t>>& predecessors)
+{
+    size_t count = frame.passes.size();
+    std::vector<double> pathTime(count);
+    std::vector<size_t> pathPrevious(count, count);
+    double totalPassTime = 0;
+    size_t last = 0;
+
+    for(size_t i = 0; i < count; i++) {
+        ImagePtr image = frame.passes[i]->outputs[0].sampledImage.image;
+        double elapsedSeconds = frame.endTime[i] - frame.startTime[i];
+        std::cerr << "Shading pass " << frame.passes[i]->name << " took " << elapsedSeconds << " seconds ("
+            << long(image->width*image->height/elapsedSeconds) << " pixels per second), started at "
+            << frame.startTime[i] << "\n";
+
+        for(size_t p: predecessors[i]) {
+            if(pathPrevious[i] == count || pathTime[p] > pathTime[pathPrevious[i]]) {
+                pathPrevious[i] = p;
+            }
+        }
+        pathTime[i] = elapsedSeconds + (pathPrevious[i] == count ? 0 : pathTime[pathPrevious[i]]);
+        totalPassTime += elapsedSeconds;
+        if(pathTime[i] > pathTime[last]) {
+            last = i;
+        }
     }
+
+    std::string path;
+    for(size_t i = last; i != count; i = pathPrevious[i]) {
+        path = frame.passes[i]->name + (path.empty() ? "" : " -> ") + path;
+    }
+
+    double frameSeconds = *std::max_element(frame.endTime.begin(), frame.endTime.end());
+    std::cerr << "Frame took " << frameSeconds << " seconds, sum of passes " << totalPassTime
+        << " seconds, critical path " << pathTime[last] << " seconds (" << path << ")\n";
 }
 
 // Thread to show progress to the user.
@@ -882,7 +1288,6 @@ bool createSPIRVFromSources(const std::vector<ShaderSource>& sources, bool debug
 
 void optimizeSPIRV(spv_target_env targetEnv, std::vector<uint32_t>& spirv)
 {
-    Timer timer;
     spvtools::Optimizer optimizer(targetEnv);
     optimizer.SetMessageConsumer(earwigMessageConsumer);
     optimizer.RegisterPerformancePasses();
@@ -892,16 +1297,15 @@ void optimizeSPIRV(spv_target_env targetEnv, std::vector<uint32_t>& spirv)
     if (!success) {
         std::cout << "Warning: Optimizer failed.\n";
     }
-    if (PRINT_TIMER_RESULTS) {
-        std::cerr << "Optimizing took " << timer.elapsed() << " seconds.\n";
-    }
 }
 
 bool createProgram(const std::vector<ShaderSource>& sources, bool debug, bool optimize, bool disassemble, Program& program)
 {
     std::vector<uint32_t> spirv;
 
+    Timer timer;
     bool result = createSPIRVFromSources(sources, debug, optimize, spirv);
+    program.timeReport.add("glslang", "", timer.elapsed());
     if(!result) {
         return result;
     }
@@ -914,7 +1318,9 @@ bool createProgram(const std::vector<ShaderSource>& sources, bool debug, bool op
             /// spv::Disassemble(std::cout, spirv);
         }
 
+        timer.reset();
         optimizeSPIRV(targetEnv, spirv);
+        program.timeReport.add("spirv-opt", "", timer.elapsed());
     }
 
     if(disassemble) {
@@ -928,19 +1334,17 @@ bool createProgram(const std::vector<ShaderSource>& sources, bool debug, bool op
     }
 
     spv_context context = spvContextCreate(targetEnv);
+    timer.reset();
     spvBinaryParse(context, &program, spirv.data(), spirv.size(), Program::handleHeader, Program::handleInstruction, nullptr);
+    program.timeReport.add("spvBinaryParse", "", timer.elapsed());
 
     if (program.hasUnimplemented) {
         return false;
     }
 
-    {
-        Timer timer;
-        program.postParse();
-        if (PRINT_TIMER_RESULTS) {
-            std::cerr << "Post-parse took " << timer.elapsed() << " seconds.\n";
-        }
-    }
+    timer.reset();
+    program.postParse();
+    program.timeReport.add("postParse", "", timer.elapsed());
 
     return true;
 }
@@ -970,6 +1374,65 @@ std::string base64Encode(const std::string &in) {
     return out;
 }
 
+// Every run of every stage of the pass, and its function statistics.
+json timeReportToJson(const std::string &passName, const TimeReport &timeReport)
+{
+    json stages = json::array();
+    for(auto &stage: timeReport.stages) {
+        stages.push_back({{"name", stage.name}, {"function", stage.function}, {"seconds", stage.seconds}});
+    }
+
+    json functions = json::array();
+    for(auto &[function, stats]: timeReport.functionStats) {
+        functions.push_back({
+            {"name", function},
+            {"instructions", stats.instructions},
+            {"virtualRegisters", stats.virtualRegisters},
+            {"spills", stats.spills},
+            {"maxFloatLiveness", stats.maxFloatLiveness},
+        });
+    }
+
+    return {
+        {"pass", passName},
+        {"totalSeconds", timeReport.totalSeconds()},
+        {"stages", stages},
+        {"functions", functions},
+    };
+}
+
+// Write the time reports of the passes as one JSON file for the dashboards.
+void writeTimeReports(const json &passReports)
+{
+    std::ofstream jsonFile(TIME_REPORT_PATHNAME);
+    if (!jsonFile.good()) {
+        std::cerr << "Can't open file \"" << TIME_REPORT_PATHNAME << "\".\n";
+        exit(EXIT_FAILURE);
+    }
+    jsonFile << json {{"passes", passReports}}.dump(2) << "\n";
+    jsonFile.close();
+}
+
+// Write the image to its frame's PPM file and optionally to the terminal.
+void writeImage(ImagePtr image, int frameNumber, bool imageToTerminal)
+{
+    std::ostringstream ss;
+    ss << "image" << std::setfill('0') << std::setw(4) << frameNumber << std::setw(0) << ".ppm";
+    std::ofstream imageFile(ss.str(), std::ios::out | std::ios::binary);
+    image->writePpm(imageFile);
+    imageFile.close();
+
+    if (imageToTerminal) {
+        // https://www.iterm2.com/documentation-images.html
+        std::ostringstream ss;
+        image->writePpm(ss);
+        std::cout << "\033]1337;File=width="
+            << image->width << "px;height="
+            << image->height << "px;inline=1:"
+            << base64Encode(ss.str()) << "\007\n";
+    }
+}
+
 int main(int argc, char **argv)
 {
     bool debug = false;
@@ -978,11 +1441,22 @@ int main(int argc, char **argv)
     bool doNotShade = false;
     bool inputIsJSON = false;
     bool imageToTerminal = false;
+    bool progressive = false;
+    float aaThreshold = 0;
+    int aaSampleBudget = 0;
     bool compile = false;
+    bool greedyAllocator = false;
+    bool forceLibraryCalls = false;
+    bool fastMath = false;
+    bool fuseMultiplyAdd = false;
+    bool unrollLoops = false;
+    bool scheduleInstructions = false;
+    bool timeReport = false;
     int threadCount = std::thread::hardware_concurrency();
     int frameStart = 0, frameEnd = 0;
     CommandLineParameters params;
-    std::string outputAssemblyPathname = DEFAULT_ASSEMBLY_PATHNAME;
+    std::string outputPathname = DEFAULT_OUTPUT_PATHNAME;
+    std::string libraryDirectory;
 
     params.outputWidth = DEFAULT_WIDTH;
     params.outputHeight = DEFAULT_HEIGHT;
@@ -993,6 +1467,7 @@ int main(int argc, char **argv)
 
     char *progname = argv[0];
     argv++; argc--;
+    libraryDirectory = getProgramDirectory(progname);
 
     while(argc > 0 && argv[0][0] == '-') {
         if(strcmp(argv[0], "-g") == 0) {
@@ -1010,6 +1485,39 @@ int main(int argc, char **argv)
             imageToTerminal = true;
             argv++; argc--;
 
+        } else if(strcmp(argv[0], "--progressive") == 0) {
+
+            progressive = true;
+            argv++; argc--;
+
+        } else if(strcmp(argv[0], "--aa") == 0) {
+
+            if(argc < 3) {
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            aaThreshold = atof(argv[1]);
+            aaSampleBudget = atoi(argv[2]);
+            argv += 3; argc -= 3;
+
+        } else if(strcmp(argv[0], "--texcache") == 0) {
+
+            if(argc < 2) {
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            params.textureCacheDirectory = argv[1];
+            argv += 2; argc -= 2;
+
+        } else if(strcmp(argv[0], "--libdir") == 0) {
+
+            if(argc < 2) {
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            libraryDirectory = argv[1];
+            argv += 2; argc -= 2;
+
         } else if(strcmp(argv[0], "-S") == 0) {
 
             disassemble = true;
@@ -1050,7 +1558,7 @@ int main(int argc, char **argv)
                 usage(progname);
                 exit(EXIT_FAILURE);
             }
-            outputAssemblyPathname = argv[1];
+            outputPathname = argv[1];
             argv += 2; argc -= 2;
 
         } else if(strcmp(argv[0], "-v") == 0) {
@@ -1078,6 +1586,41 @@ int main(int argc, char **argv)
             compile = true;
             argv++; argc--;
 
+        } else if(strcmp(argv[0], "--greedy-ra") == 0) {
+
+            greedyAllocator = true;
+            argv++; argc--;
+
+        } else if(strcmp(argv[0], "--no-inline") == 0) {
+
+            forceLibraryCalls = true;
+            argv++; argc--;
+
+        } else if(strcmp(argv[0], "--fast-math") == 0) {
+
+            fastMath = true;
+            argv++; argc--;
+
+        } else if(strcmp(argv[0], "--fused-madd") == 0) {
+
+            fuseMultiplyAdd = true;
+            argv++; argc--;
+
+        } else if(strcmp(argv[0], "--unroll") == 0) {
+
+            unrollLoops = true;
+            argv++; argc--;
+
+        } else if(strcmp(argv[0], "--schedule") == 0) {
+
+            scheduleInstructions = true;
+            argv++; argc--;
+
+        } else if(strcmp(argv[0], "--time-report") == 0) {
+
+            timeReport = true;
+            argv++; argc--;
+
         } else if(strcmp(argv[0], "-h") == 0) {
 
             usage(progname);
@@ -1129,6 +1672,7 @@ int main(int argc, char **argv)
 
     // Do passes
 
+    json passReports = json::array();
     for(auto& pass: renderPasses) {
 
         ShaderToyImage output = pass->outputs[0];
@@ -1147,13 +1691,29 @@ int main(int argc, char **argv)
         }
 
         if (compile) {
+            pass->pgm.forceLibraryCalls = forceLibraryCalls;
+            pass->pgm.fastMath = fastMath;
+            pass->pgm.fuseMultiplyAdd = fuseMultiplyAdd;
+            pass->pgm.unrollLoops = unrollLoops;
+            pass->pgm.threadCount = threadCount;
             pass->pgm.prepareForCompile();
-            Compiler compiler(&pass->pgm, outputAssemblyPathname);
+            Compiler compiler(&pass->pgm, outputPathname);
+            compiler.useGreedyAllocator = greedyAllocator;
+            compiler.useScheduler = scheduleInstructions;
+            compiler.libraryDirectory = libraryDirectory;
             compiler.compile();
-            exit(EXIT_SUCCESS);
         }
 
-        if (doNotShade) {
+        if (timeReport) {
+            std::cout << "Time report for pass \"" << pass->name << "\":\n";
+            pass->pgm.timeReport.print(std::cout);
+            passReports.push_back(timeReportToJson(pass->name, pass->pgm.timeReport));
+        }
+
+        if (compile || doNotShade) {
+            if (timeReport) {
+                writeTimeReports(passReports);
+            }
             exit(EXIT_SUCCESS);
         }
 
@@ -1163,40 +1723,77 @@ int main(int argc, char **argv)
         }
     }
 
+    if (timeReport) {
+        writeTimeReports(passReports);
+    }
+
     std::cout << "Using " << threadCount << " threads.\n";
 
+    std::vector<std::set<size_t>> predecessors;
+    getRenderPassDependencies(renderPasses, predecessors);
+
+    // Only the final image is worth previewing; buffers feed other passes.
+    size_t progressivePass = progressive ? renderPasses.size() - 1 : renderPasses.size();
+
     for(int frameNumber = frameStart; frameNumber <= frameEnd; frameNumber++) {
-        for(auto& pass: renderPasses) {
+        prepareRenderPassesForFrame(renderPasses);
 
-            Timer timer;
+        auto levelShaded = [frameNumber, imageToTerminal](ImagePtr preview) {
+            writeImage(preview, frameNumber, imageToTerminal);
+        };
 
-            ShaderToyImage output = pass->outputs[0];
-            ImagePtr image = output.sampledImage.image;
+        RenderGraphFrame frame(renderPasses, predecessors, frameNumber, frameNumber / 60.0,
+                progressivePass, levelShaded);
 
-            // Workers decrement rowsLeft at the end of each row.
-            rowsLeft = image->height;
+        // Workers decrement rowsLeft at the end of each row.
+        uint32_t totalRows = frame.getTotalRowCount();
+        rowsLeft = totalRows;
 
-            std::vector<std::thread *> thread;
+        std::vector<std::thread *> thread;
 
-            // Generate the rows on multiple threads.
-            for (int t = 0; t < threadCount; t++) {
-                thread.push_back(new std::thread(render, pass.get(), t, threadCount, frameNumber, frameNumber / 60.0));
-                // std::this_thread::sleep_for(std::chrono::milliseconds(100)); XXX delete
-            }
+        // Generate the rows on multiple threads.
+        for (int t = 0; t < threadCount; t++) {
+            thread.push_back(new std::thread(renderGraphWorker, &frame));
+        }
+
+        // Progress information.
+        thread.push_back(new std::thread(showProgress, totalRows, frame.timer.startTime()));
+
+        // Wait for worker threads to quit.
+        while (!thread.empty()) {
+            std::thread* td = thread.back();
+            thread.pop_back();
+            td->join();
+            delete td;
+        }
+
+        printRenderGraphStats(frame, predecessors);
 
-            // Progress information.
-            thread.push_back(new std::thread(showProgress, image->height, timer.startTime()));
+        if(aaSampleBudget > 0) {
+            Timer timer;
+            ShaderToyRenderPass* pass = renderPasses.back().get();
+            ImagePtr image = pass->outputs[0].sampledImage.image;
+            std::vector<bool> edges = findEdgePixels(image, aaThreshold);
+            int strata = std::max(1, int(sqrtf(aaSampleBudget)));
+            std::atomic_long extraSamples(0);
 
-            // Wait for worker threads to quit.
+            for (int t = 0; t < threadCount; t++) {
+                thread.push_back(new std::thread(supersampleRows, pass, t, threadCount, frameNumber,
+                            frameNumber / 60.0, &edges, strata, &extraSamples));
+            }
             while (!thread.empty()) {
                 std::thread* td = thread.back();
                 thread.pop_back();
                 td->join();
+                delete td;
             }
 
-            double elapsedSeconds = timer.elapsed();
-            std::cerr << "Shading pass " << pass->name << " took " << elapsedSeconds << " seconds ("
-                << long(image->width*image->height/elapsedSeconds) << " pixels per second)\n";
+            long pixelCount = image->width*image->height;
+            long edgeCount = std::count(edges.begin(), edges.end(), true);
+            std::cerr << "Anti-aliasing took " << timer.elapsed() << " seconds: " << edgeCount
+                << " of " << pixelCount << " pixels over threshold, " << extraSamples
+                << " extra samples (" << 100.0*extraSamples/(pixelCount*strata*strata)
+                << "% of full " << strata*strata << "x supersampling)\n";
         }
 
         if(false) {
@@ -1210,24 +1807,7 @@ int main(int argc, char **argv)
             imageFile.close();
         }
 
-        ShaderToyImage output = renderPasses.back()->outputs[0];
-        ImagePtr image = output.sampledImage.image;
-
-        std::ostringstream ss;
-        ss << "image" << std::setfill('0') << std::setw(4) << frameNumber << std::setw(0) << ".ppm";
-        std::ofstream imageFile(ss.str(), std::ios::out | std::ios::binary);
-        image->writePpm(imageFile);
-        imageFile.close();
-
-        if (imageToTerminal) {
-            // https://www.iterm2.com/documentation-images.html
-            std::ostringstream ss;
-            image->writePpm(ss);
-            std::cout << "\033]1337;File=width="
-                << image->width << "px;height="
-                << image->height << "px;inline=1:"
-                << base64Encode(ss.str()) << "\007\n";
-        }
+        writeImage(renderPasses.back()->outputs[0].sampledImage.image, frameNumber, imageToTerminal);
     }
 
     exit(EXIT_SUCCESS);
@@ -0,0 +1,43 @@
+// More floats live across a call to atan() than the library routine leaves
+// registers for, though fewer than 31 are live anywhere. Some have to be
+// spilled around the call.
+
+void mainImage( out vec4 fragColor, in vec2 fragCoord )
+{
+    // Normalized pixel coordinates (from 0 to 1)
+    vec2 uv = fragCoord/iResolution.xy;
+
+    float a0 = uv.x*1.5 + uv.y;
+    float a1 = uv.x*2.5 + uv.y;
+    float a2 = uv.x*3.5 + uv.y;
+    float a3 = uv.x*4.5 + uv.y;
+    float a4 = uv.x*5.5 + uv.y;
+    float a5 = uv.x*6.5 + uv.y;
+    float a6 = uv.x*7.5 + uv.y;
+    float a7 = uv.x*8.5 + uv.y;
+    float a8 = uv.x*9.5 + uv.y;
+    float a9 = uv.x*10.5 + uv.y;
+    float a10 = uv.x*11.5 + uv.y;
+    float a11 = uv.x*12.5 + uv.y;
+    float a12 = uv.x*13.5 + uv.y;
+    float a13 = uv.x*14.5 + uv.y;
+    float a14 = uv.x*15.5 + uv.y;
+    float a15 = uv.x*16.5 + uv.y;
+    float a16 = uv.x*17.5 + uv.y;
+    float a17 = uv.x*18.5 + uv.y;
+    float a18 = uv.x*19.5 + uv.y;
+    float a19 = uv.x*20.5 + uv.y;
+    float a20 = uv.x*21.5 + uv.y;
+    float a21 = uv.x*22.5 + uv.y;
+    float a22 = uv.x*23.5 + uv.y;
+    float a23 = uv.x*24.5 + uv.y;
+
+    float angle = atan(uv.y - 0.5, uv.x - 0.5);
+
+    float sum = a0 + a1 + a2 + a3 + a4 + a5
+        + a6 + a7 + a8 + a9 + a10 + a11
+        + a12 + a13 + a14 + a15 + a16 + a17
+        + a18 + a19 + a20 + a21 + a22 + a23;
+
+    fragColor = vec4(fract(sum), angle/6.2831853 + 0.5, 0.0, 1.0);
+}
@@ -171,7 +171,9 @@ void getOrderedRenderPassesFromJSON(const std::string& filename, std::vector<Sha
 
                 bool flipInY = ((input.find("vflip") != input.end()) && (input["vflip"].get<std::string>() == std::string("true")));
 
-                ImagePtr image = loadImage(asset_filename, flipInY);
+                ImagePtr image = params.textureCacheDirectory.empty()
+                    ? loadImage(asset_filename, flipInY)
+                    : loadImageCached(asset_filename, flipInY, params.textureCacheDirectory);
                 if(!image) {
                     std::cerr << "image load failed\n";
                     exit(EXIT_FAILURE);
@@ -241,4 +243,64 @@ void getOrderedRenderPassesFromJSON(const std::string& filename, std::vector<Sha
     
     // and sort in dependency order
     sortInDependencyOrder(renderPasses, channelIdsToPasses, namesToPasses, renderPassesOrdered);
+
+    // Double-buffer passes that are read before they're written.
+    for(size_t reader = 0; reader < renderPassesOrdered.size(); reader++) {
+        for(ShaderToyImage& input: renderPassesOrdered[reader]->inputs) {
+            for(size_t writer = reader; writer < renderPassesOrdered.size(); writer++) {
+                ShaderToyRenderPassPtr pass = renderPassesOrdered[writer];
+                ImagePtr output = pass->outputs[0].sampledImage.image;
+                if(input.id == pass->outputs[0].id && !pass->previousOutput) {
+                    pass->previousOutput.reset(new Image(output->format, Image::DIM_2D, output->width, output->height));
+                }
+            }
+        }
+    }
+}
+
+void getRenderPassDependencies(const std::vector<ShaderToyRenderPassPtr>& passesOrdered, std::vector<std::set<size_t>>& predecessors)
+{
+    predecessors.clear();
+    predecessors.resize(passesOrdered.size());
+
+    for(size_t reader = 0; reader < passesOrdered.size(); reader++) {
+        for(ShaderToyImage& input: passesOrdered[reader]->inputs) {
+            for(size_t writer = 0; writer < passesOrdered.size(); writer++) {
+                if(writer != reader && input.id == passesOrdered[writer]->outputs[0].id) {
+                    if(writer < reader) {
+                        // Reads this frame's output.
+                        predecessors[reader].insert(writer);
+                    } else if(!passesOrdered[writer]->previousOutput) {
+                        // Reads last frame's output; don't overwrite it until we're done.
+                        predecessors[writer].insert(reader);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void prepareRenderPassesForFrame(const std::vector<ShaderToyRenderPassPtr>& passesOrdered)
+{
+    for(auto& pass: passesOrdered) {
+        if(pass->previousOutput) {
+            std::swap(pass->outputs[0].sampledImage.image, pass->previousOutput);
+        }
+    }
+
+    for(size_t reader = 0; reader < passesOrdered.size(); reader++) {
+        ShaderToyRenderPassPtr pass = passesOrdered[reader];
+        for(size_t i = 0; i < pass->inputs.size(); i++) {
+            ShaderToyImage& input = pass->inputs[i];
+            for(size_t writer = 0; writer < passesOrdered.size(); writer++) {
+                ShaderToyRenderPassPtr source = passesOrdered[writer];
+                if(input.id == source->outputs[0].id) {
+                    input.sampledImage.image = (writer >= reader && source->previousOutput)
+                        ? source->previousOutput
+                        : source->outputs[0].sampledImage.image;
+                    pass->pgm.sampledImages[i].image = input.sampledImage.image;
+                }
+            }
+        }
+    }
 }
@@ -1,5 +1,6 @@
 #include <string>
 #include <vector>
+#include <set>
 
 #include "image.h"
 #include "program.h"
@@ -27,6 +28,10 @@ struct ShaderToyRenderPass
     std::string name;
     std::vector<ShaderToyImage> inputs; // in channel order
     std::vector<ShaderToyImage> outputs;
+    // For buffers whose output is read before it's written in a frame
+    // (by themselves or by an earlier pass): the image holding the previous
+    // frame. Swapped with outputs[0]'s image at the start of each frame.
+    ImagePtr previousOutput;
     std::vector<ShaderSource> sources;
     Program pgm;
     void Render(void) {
@@ -47,3 +52,14 @@ typedef std::shared_ptr<ShaderToyRenderPass> ShaderToyRenderPassPtr;
 
 void getOrderedRenderPassesFromJSON(const std::string& filename, std::vector<ShaderToyRenderPassPtr>& renderPassesOrdered, const CommandLineParameters& params);
 
+// For each pass in "passesOrdered" (as returned by getOrderedRenderPassesFromJSON),
+// the indices of the passes that must finish shading before it can start in the
+// same frame. A pass that reads a later pass's output sees that pass's previous
+// frame, so unless the later pass is double-buffered it must wait until the
+// reader is done.
+void getRenderPassDependencies(const std::vector<ShaderToyRenderPassPtr>& passesOrdered, std::vector<std::set<size_t>>& predecessors);
+
+// Swap the images of double-buffered passes and point every buffer input
+// (and the program's sampled image) at this frame's or the previous frame's
+// image, as appropriate. Call before shading each frame.
+void prepareRenderPassesForFrame(const std::vector<ShaderToyRenderPassPtr>& passesOrdered);
@@ -0,0 +1,105 @@
+#ifndef TIMEREPORT_H
+#define TIMEREPORT_H
+
+// Time spent in each compiler stage and statistics of each function's IR,
+// printed by "shade --time-report" as a table. shade also writes it as JSON.
+//
+// Stages are recorded every time they run, in order. Stages that run per
+// function (or per liveness/spill round) are recorded with the function's
+// name. The table adds up runs of the same stage and function.
+
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+class TimeReport {
+public:
+    struct Stage {
+        std::string name;
+        std::string function;
+        double seconds;
+    };
+
+    struct FunctionStats {
+        size_t instructions = 0;
+        size_t virtualRegisters = 0;
+        size_t spills = 0;
+        size_t maxFloatLiveness = 0;
+    };
+
+    std::vector<Stage> stages;
+    std::map<std::string,FunctionStats> functionStats;
+
+    // Record one run of a stage. The function is empty for whole-program stages.
+    void add(const std::string &name, const std::string &function, double seconds) {
+        stages.push_back({name, function, seconds});
+    }
+
+    // Append the other report's stages and take its function statistics.
+    void merge(const TimeReport &other) {
+        stages.insert(stages.end(), other.stages.begin(), other.stages.end());
+        for (auto &[function, stats] : other.functionStats) {
+            functionStats[function] = stats;
+        }
+    }
+
+    double totalSeconds() const {
+        double total = 0;
+        for (auto &stage : stages) {
+            total += stage.seconds;
+        }
+        return total;
+    }
+
+    // Print the stages, totaled by name and function in the order they first
+    // ran, then the function statistics.
+    void print(std::ostream &out) const {
+        std::vector<std::pair<std::string,std::string>> order;
+        std::map<std::pair<std::string,std::string>,std::pair<size_t,double>> totals;
+        for (auto &stage : stages) {
+            auto key = std::make_pair(stage.name, stage.function);
+            auto itr = totals.find(key);
+            if (itr == totals.end()) {
+                order.push_back(key);
+                totals[key] = std::make_pair(1, stage.seconds);
+            } else {
+                itr->second.first++;
+                itr->second.second += stage.seconds;
+            }
+        }
+
+        double total = totalSeconds();
+        out << "---------------------------------------------------------------------\n";
+        out << std::left << std::setw(24) << "Stage" << std::setw(20) << "Function"
+            << std::right << std::setw(6) << "Runs" << std::setw(12) << "Seconds"
+            << std::setw(8) << "%" << "\n";
+        for (auto &key : order) {
+            auto [runs, seconds] = totals.at(key);
+            out << std::left << std::setw(24) << key.first << std::setw(20) << key.second
+                << std::right << std::setw(6) << runs
+                << std::fixed << std::setprecision(6) << std::setw(12) << seconds
+                << std::setprecision(1) << std::setw(8) << (total > 0 ? 100*seconds/total : 0)
+                << std::defaultfloat << std::setprecision(6) << "\n";
+        }
+        out << std::left << std::setw(50) << "Total"
+            << std::right << std::fixed << std::setprecision(6) << std::setw(12) << total
+            << std::defaultfloat << "\n";
+
+        if (!functionStats.empty()) {
+            out << "\n";
+            out << std::left << std::setw(24) << "Function" << std::right
+                << std::setw(14) << "Instructions" << std::setw(11) << "Registers"
+                << std::setw(8) << "Spills" << std::setw(20) << "Max float liveness" << "\n";
+            for (auto &[function, stats] : functionStats) {
+                out << std::left << std::setw(24) << function << std::right
+                    << std::setw(14) << stats.instructions << std::setw(11) << stats.virtualRegisters
+                    << std::setw(8) << stats.spills << std::setw(20) << stats.maxFloatLiveness << "\n";
+            }
+        }
+        out << "---------------------------------------------------------------------\n";
+    }
+};
+
+#endif // TIMEREPORT_H